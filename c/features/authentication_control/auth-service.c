@@ -45,13 +45,43 @@
  * It will:
  * <ul>
  * <li>Deny all anonymous connections</li>
- * <li>Allow connections where the principal and credentials (i.e., username and password) match some hardcoded values</li>
+ * <li>Allow connections where the principal and credentials (i.e., username and password) match an entry in the credential store</li>
  * <li>Abstain from all other decisions, thereby letting Diffusion and other authentication handlers decide what to do.</li>
  * </ul>
+ *
+ * The credential store holds a salted, iterated SHA-256 hash of each
+ * password, indexed by principal in an open-addressed hash table, so a
+ * lookup costs the same however many principals there are. Hashes are
+ * compared in constant time. The store is loaded from a file given with
+ * --users, with lines of the form
+ *
+ *   <principal> <iterations> <salt as hex> <hash as hex>
+ *
+ * which --hash_password principal:password will generate. Without a file,
+ * the store is loaded with the hardcoded USERS.
+ *
+ * A decision cache sits in front of the store, remembering both allow
+ * and abstain decisions for a short time so that a burst of reconnections
+ * doesn't repeat the hashing for each of them.
+ *
+ * With --workers, requests that miss the decision cache are decided
+ * asynchronously. Each is queued, with a duplicate of its authenticator,
+ * for a pool of worker threads. The workers consult the backend and
+ * respond once it has decided. The backend here is a local stand-in that
+ * checks the credential store after a delay set with --backend_latency,
+ * in place of a call to a remote authentication service. The number of
+ * requests in flight and the decision latency are reported periodically.
+ *
+ * --benchmark measures authentications per second against stores of
+ * generated principals, without connecting to Diffusion.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef WIN32
         #include <unistd.h>
@@ -69,7 +99,7 @@ struct user_credentials_s {
         const char *password;
 };
 
-// Username/password pairs that this handler accepts.
+// Username/password pairs that this handler accepts when no users file is given.
 static const struct user_credentials_s USERS[] = {
         { "fish", "chips" },
         { "ham", "eggs" },
@@ -86,9 +116,1007 @@ ARG_OPTS_T arg_opts[] = {
         {'n', "name", "Name under which to register the authorisation handler", ARG_OPTIONAL, ARG_HAS_VALUE, "before-system-handler"},
         {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
         {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'f', "users", "File of principals and password hashes", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        {'t', "cache_ttl", "Milliseconds to cache decisions for, 0 to disable the cache", ARG_OPTIONAL, ARG_HAS_VALUE, "2000"},
+        {'s', "cache_size", "Number of decisions the cache can hold", ARG_OPTIONAL, ARG_HAS_VALUE, "65536"},
+        {'i', "iterations", "Hash iterations for generated passwords", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'H', "hash_password", "Print a users file line for principal:password and exit", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        {'w', "workers", "Worker threads deciding requests asynchronously, 0 to decide them in the callback", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'l', "backend_latency", "Milliseconds the local backend takes for each check", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'r', "principal_rate", "Attempts per second allowed for each principal, 0 for no limit", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'R', "principal_burst", "Attempts a principal may make in a burst", ARG_OPTIONAL, ARG_HAS_VALUE, "10"},
+        {'a', "source_rate", "Attempts per second allowed from each client address, 0 for no limit", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'A', "source_burst", "Attempts a client address may make in a burst", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'F', "failure_cost", "Extra attempts charged for each wrong password for a known principal", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'T', "throttle", "Decision for throttled attempts, deny or abstain", ARG_OPTIONAL, ARG_HAS_VALUE, "abstain"},
+        {'b', "benchmark", "Comma separated numbers of principals to benchmark with", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
         END_OF_ARG_OPTS
 };
 
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * SHA-256.
+ */
+#define DIGEST_LENGTH 32
+
+typedef struct sha256_s {
+        uint32_t state[8];
+        uint64_t length;
+        uint8_t block[64];
+        size_t block_length;
+} SHA256_T;
+
+static const uint32_t SHA256_K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress(uint32_t state[8], const uint8_t block[64])
+{
+        uint32_t w[64];
+        for(int i = 0; i < 16; i++) {
+                w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+                        | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for(int i = 16; i < 64; i++) {
+                const uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                const uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; i++) {
+                const uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+                        + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+                const uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+                        + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_init(SHA256_T *sha)
+{
+        static const uint32_t initial[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(sha->state, initial, sizeof(initial));
+        sha->length = 0;
+        sha->block_length = 0;
+}
+
+static void sha256_update(SHA256_T *sha, const void *data, size_t length)
+{
+        const uint8_t *bytes = data;
+        sha->length += length;
+        while(length > 0) {
+                size_t n = 64 - sha->block_length;
+                if(n > length) {
+                        n = length;
+                }
+                memcpy(sha->block + sha->block_length, bytes, n);
+                sha->block_length += n;
+                bytes += n;
+                length -= n;
+                if(sha->block_length == 64) {
+                        sha256_compress(sha->state, sha->block);
+                        sha->block_length = 0;
+                }
+        }
+}
+
+static void sha256_final(SHA256_T *sha, uint8_t digest[DIGEST_LENGTH])
+{
+        const uint64_t bits = sha->length * 8;
+        const uint8_t pad = 0x80;
+        const uint8_t zero = 0;
+
+        sha256_update(sha, &pad, 1);
+        while(sha->block_length != 56) {
+                sha256_update(sha, &zero, 1);
+        }
+        uint8_t length_bytes[8];
+        for(int i = 0; i < 8; i++) {
+                length_bytes[i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        sha256_update(sha, length_bytes, 8);
+
+        for(int i = 0; i < 8; i++) {
+                digest[i * 4] = (uint8_t)(sha->state[i] >> 24);
+                digest[i * 4 + 1] = (uint8_t)(sha->state[i] >> 16);
+                digest[i * 4 + 2] = (uint8_t)(sha->state[i] >> 8);
+                digest[i * 4 + 3] = (uint8_t)sha->state[i];
+        }
+}
+
+
+// Compares two digests in a time that doesn't depend on where they differ.
+static bool constant_time_equal(const uint8_t *a, const uint8_t *b, size_t length)
+{
+        volatile uint8_t difference = 0;
+        for(size_t i = 0; i < length; i++) {
+                difference |= a[i] ^ b[i];
+        }
+        return difference == 0;
+}
+
+
+/*
+ * Credential store.
+ */
+#define SALT_LENGTH 16
+
+typedef struct credential_s {
+        char *principal;                // NULL for an empty slot
+        uint64_t principal_hash;
+        uint32_t iterations;
+        uint8_t salt[SALT_LENGTH];
+        uint8_t digest[DIGEST_LENGTH];
+} CREDENTIAL_T;
+
+/*
+ * An open-addressed hash table with linear probing, kept at most half
+ * full. It isn't modified once loaded, so lookups need no locking.
+ */
+typedef struct credential_store_s {
+        CREDENTIAL_T *slots;
+        size_t capacity;
+        size_t count;
+} CREDENTIAL_STORE_T;
+
+static CREDENTIAL_STORE_T g_store;
+
+
+static uint64_t principal_hash(const char *principal)
+{
+        uint64_t hash = 14695981039346656037ULL;
+        for(const char *c = principal; *c != '\0'; c++) {
+                hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        return hash;
+}
+
+
+// The hash is SHA-256(salt, password), then SHA-256(previous, password) for each further iteration.
+static void hash_password(
+        const uint8_t salt[SALT_LENGTH],
+        uint32_t iterations,
+        const char *password,
+        size_t password_length,
+        uint8_t digest[DIGEST_LENGTH])
+{
+        SHA256_T sha;
+        sha256_init(&sha);
+        sha256_update(&sha, salt, SALT_LENGTH);
+        sha256_update(&sha, password, password_length);
+        sha256_final(&sha, digest);
+
+        for(uint32_t i = 1; i < iterations; i++) {
+                sha256_init(&sha);
+                sha256_update(&sha, digest, DIGEST_LENGTH);
+                sha256_update(&sha, password, password_length);
+                sha256_final(&sha, digest);
+        }
+}
+
+
+static void random_bytes(uint8_t *bytes, size_t length)
+{
+        FILE *random = fopen("/dev/urandom", "rb");
+        if(random == NULL || fread(bytes, 1, length, random) != length) {
+                for(size_t i = 0; i < length; i++) {
+                        bytes[i] = (uint8_t)rand();
+                }
+        }
+        if(random != NULL) {
+                fclose(random);
+        }
+}
+
+
+static CREDENTIAL_T *credential_store_find(const CREDENTIAL_STORE_T *store, const char *principal)
+{
+        if(store->capacity == 0) {
+                return NULL;
+        }
+        const uint64_t hash = principal_hash(principal);
+        for(size_t i = hash & (store->capacity - 1); ; i = (i + 1) & (store->capacity - 1)) {
+                CREDENTIAL_T *slot = &store->slots[i];
+                if(slot->principal == NULL) {
+                        return NULL;
+                }
+                if(slot->principal_hash == hash && strcmp(slot->principal, principal) == 0) {
+                        return slot;
+                }
+        }
+}
+
+
+static void credential_store_add(CREDENTIAL_STORE_T *store, const CREDENTIAL_T *credential)
+{
+        if((store->count + 1) * 2 > store->capacity) {
+                CREDENTIAL_STORE_T grown = {
+                        .capacity = store->capacity == 0 ? 16 : store->capacity * 2
+                };
+                grown.slots = calloc(grown.capacity, sizeof(CREDENTIAL_T));
+                for(size_t i = 0; i < store->capacity; i++) {
+                        if(store->slots[i].principal != NULL) {
+                                credential_store_add(&grown, &store->slots[i]);
+                        }
+                }
+                free(store->slots);
+                *store = grown;
+        }
+
+        const uint64_t hash = principal_hash(credential->principal);
+        size_t i = hash & (store->capacity - 1);
+        while(store->slots[i].principal != NULL) {
+                if(strcmp(store->slots[i].principal, credential->principal) == 0) {
+                        // Replace an earlier entry for the same principal.
+                        free(store->slots[i].principal);
+                        store->count--;
+                        break;
+                }
+                i = (i + 1) & (store->capacity - 1);
+        }
+        store->slots[i] = *credential;
+        store->slots[i].principal_hash = hash;
+        store->count++;
+}
+
+
+static void credential_store_add_password(
+        CREDENTIAL_STORE_T *store,
+        const char *principal,
+        const char *password,
+        uint32_t iterations,
+        bool secure_salt)
+{
+        CREDENTIAL_T credential = {
+                .principal = strdup(principal),
+                .iterations = iterations
+        };
+        if(secure_salt) {
+                random_bytes(credential.salt, SALT_LENGTH);
+        }
+        else {
+                for(int i = 0; i < SALT_LENGTH; i++) {
+                        credential.salt[i] = (uint8_t)rand();
+                }
+        }
+        hash_password(credential.salt, iterations, password, strlen(password), credential.digest);
+        credential_store_add(store, &credential);
+}
+
+
+static void credential_store_free(CREDENTIAL_STORE_T *store)
+{
+        for(size_t i = 0; i < store->capacity; i++) {
+                free(store->slots[i].principal);
+        }
+        free(store->slots);
+        memset(store, 0, sizeof(CREDENTIAL_STORE_T));
+}
+
+
+static void print_hex(const uint8_t *bytes, size_t length)
+{
+        for(size_t i = 0; i < length; i++) {
+                printf("%02x", bytes[i]);
+        }
+}
+
+
+static bool parse_hex(const char *hex, uint8_t *bytes, size_t length)
+{
+        if(strlen(hex) != length * 2) {
+                return false;
+        }
+        for(size_t i = 0; i < length; i++) {
+                unsigned int byte;
+                if(sscanf(hex + i * 2, "%2x", &byte) != 1) {
+                        return false;
+                }
+                bytes[i] = (uint8_t)byte;
+        }
+        return true;
+}
+
+
+static bool credential_store_load(CREDENTIAL_STORE_T *store, const char *file_name)
+{
+        FILE *file = fopen(file_name, "r");
+        if(file == NULL) {
+                fprintf(stderr, "Unable to open \"%s\"\n", file_name);
+                return false;
+        }
+
+        char line[1024];
+        char principal[512];
+        char salt[SALT_LENGTH * 2 + 2];
+        char digest[DIGEST_LENGTH * 2 + 2];
+        unsigned long iterations;
+        long line_number = 0;
+        bool ok = true;
+
+        while(ok && fgets(line, sizeof(line), file) != NULL) {
+                line_number++;
+                if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+                        continue;
+                }
+
+                CREDENTIAL_T credential = { 0 };
+                if(sscanf(line, "%511s %lu %33s %65s", principal, &iterations, salt, digest) != 4
+                   || iterations < 1
+                   || iterations > UINT32_MAX
+                   || !parse_hex(salt, credential.salt, SALT_LENGTH)
+                   || !parse_hex(digest, credential.digest, DIGEST_LENGTH)) {
+                        fprintf(stderr, "%s:%ld: expected <principal> <iterations> <salt> <hash>\n",
+                                file_name, line_number);
+                        ok = false;
+                        break;
+                }
+                credential.principal = strdup(principal);
+                credential.iterations = (uint32_t)iterations;
+                credential_store_add(store, &credential);
+        }
+
+        fclose(file);
+        return ok;
+}
+
+
+/*
+ * Decision cache. A direct-mapped table keyed by a hash of the principal
+ * and password, itself keyed with a secret chosen at startup, so the
+ * cache never holds passwords or anything that could be checked against
+ * them offline. A newer decision simply replaces whatever is in its slot.
+ */
+typedef enum {
+        AUTH_ABSTAIN,
+        AUTH_ALLOW,
+        AUTH_DENY,
+        // A known principal with the wrong password. Answered with an
+        // abstain, but charged by the rate limiter.
+        AUTH_BAD_PASSWORD
+} AUTH_DECISION_T;
+
+typedef struct cached_decision_s {
+        uint8_t key[DIGEST_LENGTH];
+        int64_t expires_ns;
+        AUTH_DECISION_T decision;
+} CACHED_DECISION_T;
+
+static struct {
+        pthread_mutex_t lock;
+        CACHED_DECISION_T *slots;
+        size_t mask;
+        int64_t ttl_ns;
+        uint8_t secret[SALT_LENGTH];
+        long hits;
+        long misses;
+} g_decisions = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+static void decision_cache_init(size_t size, long ttl_ms)
+{
+        size_t capacity = 16;
+        while(capacity < size) {
+                capacity *= 2;
+        }
+        g_decisions.slots = calloc(capacity, sizeof(CACHED_DECISION_T));
+        g_decisions.mask = capacity - 1;
+        g_decisions.ttl_ns = ttl_ms * 1000000LL;
+        g_decisions.hits = 0;
+        g_decisions.misses = 0;
+        random_bytes(g_decisions.secret, SALT_LENGTH);
+}
+
+
+static void decision_cache_free(void)
+{
+        free(g_decisions.slots);
+        g_decisions.slots = NULL;
+}
+
+
+static void decision_key(const char *principal, const char *password, size_t password_length, uint8_t key[DIGEST_LENGTH])
+{
+        SHA256_T sha;
+        sha256_init(&sha);
+        sha256_update(&sha, g_decisions.secret, SALT_LENGTH);
+        sha256_update(&sha, principal, strlen(principal) + 1);
+        sha256_update(&sha, password, password_length);
+        sha256_final(&sha, key);
+}
+
+
+static CACHED_DECISION_T *decision_slot(const uint8_t key[DIGEST_LENGTH])
+{
+        size_t index;
+        memcpy(&index, key, sizeof(index));
+        return &g_decisions.slots[index & g_decisions.mask];
+}
+
+
+/*
+ * Looks up a decision in the cache. If the cache is enabled, the key for
+ * the principal and password is left in key for decision_cache_put().
+ */
+static bool decision_cache_get(
+        const char *principal,
+        const char *password,
+        size_t password_length,
+        uint8_t key[DIGEST_LENGTH],
+        AUTH_DECISION_T *decision)
+{
+        if(g_decisions.ttl_ns <= 0) {
+                return false;
+        }
+        decision_key(principal, password, password_length, key);
+
+        pthread_mutex_lock(&g_decisions.lock);
+        const CACHED_DECISION_T *cached = decision_slot(key);
+        const bool hit = cached->expires_ns > monotonic_ns() && constant_time_equal(cached->key, key, DIGEST_LENGTH);
+        if(hit) {
+                *decision = cached->decision;
+                g_decisions.hits++;
+        }
+        else {
+                g_decisions.misses++;
+        }
+        pthread_mutex_unlock(&g_decisions.lock);
+        return hit;
+}
+
+
+static void decision_cache_put(const uint8_t key[DIGEST_LENGTH], AUTH_DECISION_T decision)
+{
+        if(g_decisions.ttl_ns <= 0) {
+                return;
+        }
+        pthread_mutex_lock(&g_decisions.lock);
+        CACHED_DECISION_T *slot = decision_slot(key);
+        memcpy(slot->key, key, DIGEST_LENGTH);
+        slot->decision = decision;
+        slot->expires_ns = monotonic_ns() + g_decisions.ttl_ns;
+        pthread_mutex_unlock(&g_decisions.lock);
+}
+
+
+/*
+ * Authentication backends. A backend's check may block, and in
+ * asynchronous mode is called from several worker threads at once.
+ */
+typedef struct auth_backend_s AUTH_BACKEND_T;
+
+struct auth_backend_s {
+        const char *name;
+        AUTH_DECISION_T (*check)(
+                AUTH_BACKEND_T *backend,
+                const char *principal,
+                const char *password,
+                size_t password_length);
+        long latency_ms;
+};
+
+
+/*
+ * A local stand-in for a remote backend, checking the credential store
+ * after a configurable delay. Principals that aren't in the store are
+ * left to other handlers.
+ */
+static AUTH_DECISION_T local_backend_check(
+        AUTH_BACKEND_T *backend,
+        const char *principal,
+        const char *password,
+        size_t password_length)
+{
+        if(backend->latency_ms > 0) {
+                const struct timespec delay = {
+                        backend->latency_ms / 1000,
+                        (backend->latency_ms % 1000) * 1000000
+                };
+                nanosleep(&delay, NULL);
+        }
+
+        const CREDENTIAL_T *credential = credential_store_find(&g_store, principal);
+        if(credential == NULL) {
+                return AUTH_ABSTAIN;
+        }
+        uint8_t digest[DIGEST_LENGTH];
+        hash_password(credential->salt, credential->iterations, password, password_length, digest);
+        return constant_time_equal(digest, credential->digest, DIGEST_LENGTH) ? AUTH_ALLOW : AUTH_BAD_PASSWORD;
+}
+
+
+static AUTH_BACKEND_T g_backend = {
+        .name = "local",
+        .check = local_backend_check
+};
+
+
+/*
+ * Checks a principal and password with the backend, through the
+ * decision cache.
+ */
+static AUTH_DECISION_T check_credentials(const char *principal, const char *password, size_t password_length)
+{
+        uint8_t key[DIGEST_LENGTH];
+        AUTH_DECISION_T decision;
+
+        if(decision_cache_get(principal, password, password_length, key, &decision)) {
+                return decision;
+        }
+        decision = g_backend.check(&g_backend, principal, password, password_length);
+        decision_cache_put(key, decision);
+        return decision;
+}
+
+
+static void respond(SESSION_T *session, const DIFFUSION_AUTHENTICATOR_T *authenticator, AUTH_DECISION_T decision)
+{
+        switch(decision) {
+        case AUTH_ALLOW:
+                diffusion_authenticator_allow(session, authenticator, NULL);
+                break;
+        case AUTH_DENY:
+                diffusion_authenticator_deny(session, authenticator, NULL);
+                break;
+        case AUTH_BAD_PASSWORD:
+        default:
+                diffusion_authenticator_abstain(session, authenticator, NULL);
+                break;
+        }
+}
+
+
+/*
+ * Rate limiting. Each limiter holds a token bucket per key, refilled at
+ * a fixed rate up to a burst size. Every authentication attempt takes a
+ * token from the bucket for its principal and from the bucket for its
+ * source address, and a wrong password for a principal this handler
+ * owns is charged extra tokens, so that repeated wrong passwords are
+ * throttled far sooner than normal logins. Attempts this handler abstains
+ * from, such as those by principals the system handler authenticates,
+ * are not charged extra. Limiting is off unless a rate is given.
+ *
+ * The buckets are spread over independently locked stripes by the hash of
+ * their key, so concurrent authentications rarely contend. Buckets that
+ * have refilled completely hold no state and are swept away when a
+ * stripe's table fills.
+ */
+#define LIMITER_STRIPES 64
+
+typedef struct token_bucket_s {
+        char *key;
+        uint64_t hash;
+        double tokens;
+        int64_t updated_ns;
+        struct token_bucket_s *next;
+} TOKEN_BUCKET_T;
+
+typedef struct limiter_stripe_s {
+        pthread_mutex_t lock;
+        TOKEN_BUCKET_T **table;
+        size_t size;
+        size_t count;
+        long throttled;
+} LIMITER_STRIPE_T;
+
+typedef struct rate_limiter_s {
+        const char *name;
+        double rate;            // Tokens per second, 0 for no limit
+        double burst;
+        LIMITER_STRIPE_T stripes[LIMITER_STRIPES];
+} RATE_LIMITER_T;
+
+static RATE_LIMITER_T g_principal_limiter = { .name = "principal" };
+static RATE_LIMITER_T g_source_limiter = { .name = "source" };
+
+// Extra tokens charged for a wrong password.
+static double g_failure_cost;
+
+// The decision given to throttled attempts.
+static AUTH_DECISION_T g_throttle_decision = AUTH_ABSTAIN;
+
+
+static void rate_limiter_init(RATE_LIMITER_T *limiter, double rate, double burst)
+{
+        limiter->rate = rate;
+        limiter->burst = burst;
+        for(int i = 0; i < LIMITER_STRIPES; i++) {
+                LIMITER_STRIPE_T *stripe = &limiter->stripes[i];
+                pthread_mutex_init(&stripe->lock, NULL);
+                stripe->size = 64;
+                stripe->table = calloc(stripe->size, sizeof(TOKEN_BUCKET_T *));
+        }
+}
+
+
+static void rate_limiter_free(RATE_LIMITER_T *limiter)
+{
+        for(int i = 0; i < LIMITER_STRIPES; i++) {
+                LIMITER_STRIPE_T *stripe = &limiter->stripes[i];
+                for(size_t j = 0; j < stripe->size; j++) {
+                        TOKEN_BUCKET_T *bucket = stripe->table[j];
+                        while(bucket != NULL) {
+                                TOKEN_BUCKET_T *next = bucket->next;
+                                free(bucket->key);
+                                free(bucket);
+                                bucket = next;
+                        }
+                }
+                free(stripe->table);
+                pthread_mutex_destroy(&stripe->lock);
+        }
+}
+
+
+static void refill(const RATE_LIMITER_T *limiter, TOKEN_BUCKET_T *bucket, int64_t now_ns)
+{
+        bucket->tokens += (now_ns - bucket->updated_ns) / 1e9 * limiter->rate;
+        if(bucket->tokens > limiter->burst) {
+                bucket->tokens = limiter->burst;
+        }
+        bucket->updated_ns = now_ns;
+}
+
+
+/*
+ * Makes room in a full stripe, first by dropping buckets that have
+ * refilled, then by doubling the table. Called with the stripe locked.
+ */
+static void stripe_make_room(const RATE_LIMITER_T *limiter, LIMITER_STRIPE_T *stripe, int64_t now_ns)
+{
+        for(size_t i = 0; i < stripe->size; i++) {
+                TOKEN_BUCKET_T **link = &stripe->table[i];
+                while(*link != NULL) {
+                        TOKEN_BUCKET_T *bucket = *link;
+                        refill(limiter, bucket, now_ns);
+                        if(bucket->tokens >= limiter->burst) {
+                                *link = bucket->next;
+                                free(bucket->key);
+                                free(bucket);
+                                stripe->count--;
+                        }
+                        else {
+                                link = &bucket->next;
+                        }
+                }
+        }
+
+        if(stripe->count * 2 < stripe->size) {
+                return;
+        }
+
+        const size_t size = stripe->size * 2;
+        TOKEN_BUCKET_T **table = calloc(size, sizeof(TOKEN_BUCKET_T *));
+        for(size_t i = 0; i < stripe->size; i++) {
+                TOKEN_BUCKET_T *bucket = stripe->table[i];
+                while(bucket != NULL) {
+                        TOKEN_BUCKET_T *next = bucket->next;
+                        // The low bits of the hash pick the stripe, so index with the rest.
+                        const size_t index = (bucket->hash >> 6) & (size - 1);
+                        bucket->next = table[index];
+                        table[index] = bucket;
+                        bucket = next;
+                }
+        }
+        free(stripe->table);
+        stripe->table = table;
+        stripe->size = size;
+}
+
+
+/*
+ * Takes cost tokens from the bucket for a key. If take_only_if_available
+ * is set, nothing is taken unless there are enough tokens and the result
+ * says whether there were; otherwise the tokens are charged regardless,
+ * down to a debt of one burst.
+ */
+static bool rate_limiter_take(RATE_LIMITER_T *limiter, const char *key, double cost, bool take_only_if_available)
+{
+        if(limiter->rate <= 0 || key == NULL) {
+                return true;
+        }
+
+        const uint64_t hash = principal_hash(key);
+        const int64_t now_ns = monotonic_ns();
+        LIMITER_STRIPE_T *stripe = &limiter->stripes[hash & (LIMITER_STRIPES - 1)];
+
+        pthread_mutex_lock(&stripe->lock);
+        TOKEN_BUCKET_T *bucket = stripe->table[(hash >> 6) & (stripe->size - 1)];
+        while(bucket != NULL && (bucket->hash != hash || strcmp(bucket->key, key) != 0)) {
+                bucket = bucket->next;
+        }
+
+        if(bucket == NULL) {
+                if(stripe->count >= stripe->size) {
+                        stripe_make_room(limiter, stripe, now_ns);
+                }
+                bucket = calloc(1, sizeof(TOKEN_BUCKET_T));
+                bucket->key = strdup(key);
+                bucket->hash = hash;
+                bucket->tokens = limiter->burst;
+                bucket->updated_ns = now_ns;
+                const size_t index = (hash >> 6) & (stripe->size - 1);
+                bucket->next = stripe->table[index];
+                stripe->table[index] = bucket;
+                stripe->count++;
+        }
+        else {
+                refill(limiter, bucket, now_ns);
+        }
+
+        bool allowed = true;
+        if(!take_only_if_available) {
+                bucket->tokens -= cost;
+                if(bucket->tokens < -limiter->burst) {
+                        bucket->tokens = -limiter->burst;
+                }
+        }
+        else if(bucket->tokens >= cost) {
+                bucket->tokens -= cost;
+        }
+        else {
+                stripe->throttled++;
+                allowed = false;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+
+        return allowed;
+}
+
+
+static long rate_limiter_throttled(RATE_LIMITER_T *limiter)
+{
+        long throttled = 0;
+        for(int i = 0; i < LIMITER_STRIPES; i++) {
+                pthread_mutex_lock(&limiter->stripes[i].lock);
+                throttled += limiter->stripes[i].throttled;
+                pthread_mutex_unlock(&limiter->stripes[i].lock);
+        }
+        return throttled;
+}
+
+
+// Whether an attempt from this principal and source may go ahead.
+static bool rate_limits_allow(const char *principal, const char *source)
+{
+        return rate_limiter_take(&g_principal_limiter, principal, 1, true)
+                && rate_limiter_take(&g_source_limiter, source, 1, true);
+}
+
+
+// Charges the principal and source for a wrong password.
+static void rate_limits_charge_failure(const char *principal, const char *source, AUTH_DECISION_T decision)
+{
+        if(decision != AUTH_BAD_PASSWORD || g_failure_cost <= 0) {
+                return;
+        }
+        rate_limiter_take(&g_principal_limiter, principal, g_failure_cost, false);
+        rate_limiter_take(&g_source_limiter, source, g_failure_cost, false);
+}
+
+
+/*
+ * Asynchronous mode. Requests that miss the decision cache are queued
+ * with a duplicate of their authenticator and copies of the principal
+ * and password, and decided by a pool of worker threads.
+ */
+typedef struct auth_request_s {
+        DIFFUSION_AUTHENTICATOR_T *authenticator;
+        char *principal;
+        char *source;
+        char *password;
+        size_t password_length;
+        uint8_t key[DIGEST_LENGTH];
+        int64_t received_ns;
+        struct auth_request_s *next;
+} AUTH_REQUEST_T;
+
+#define MAX_LATENCIES 100000
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        SESSION_T *session;
+        AUTH_REQUEST_T *head;
+        AUTH_REQUEST_T *tail;
+        bool stopping;
+        pthread_t *workers;
+        int worker_count;
+
+        // Requests received but not yet decided, in either mode.
+        long in_flight;
+        long max_in_flight;
+        long decided;
+        // Time from receiving each request to deciding it, in microseconds.
+        uint32_t latencies[MAX_LATENCIES];
+        long latency_count;
+} g_async = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void request_started(void)
+{
+        pthread_mutex_lock(&g_async.lock);
+        if(++g_async.in_flight > g_async.max_in_flight) {
+                g_async.max_in_flight = g_async.in_flight;
+        }
+        pthread_mutex_unlock(&g_async.lock);
+}
+
+
+static void request_decided(int64_t received_ns)
+{
+        const int64_t latency_us = (monotonic_ns() - received_ns) / 1000;
+
+        pthread_mutex_lock(&g_async.lock);
+        g_async.in_flight--;
+        g_async.decided++;
+        if(g_async.latency_count < MAX_LATENCIES) {
+                g_async.latencies[g_async.latency_count++] = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+        }
+        pthread_mutex_unlock(&g_async.lock);
+}
+
+
+static void auth_request_free(AUTH_REQUEST_T *request)
+{
+        // Don't leave the password lying around in freed memory.
+        volatile char *password = request->password;
+        for(size_t i = 0; i < request->password_length; i++) {
+                password[i] = 0;
+        }
+        free(request->password);
+        free(request->principal);
+        free(request->source);
+        diffusion_authenticator_free(request->authenticator);
+        free(request);
+}
+
+
+static void *auth_worker_run(void *arg)
+{
+        pthread_mutex_lock(&g_async.lock);
+        for(;;) {
+                while(g_async.head == NULL && !g_async.stopping) {
+                        pthread_cond_wait(&g_async.cond, &g_async.lock);
+                }
+                AUTH_REQUEST_T *request = g_async.head;
+                if(request == NULL) {
+                        break;
+                }
+                g_async.head = request->next;
+                if(g_async.head == NULL) {
+                        g_async.tail = NULL;
+                }
+                pthread_mutex_unlock(&g_async.lock);
+
+                const AUTH_DECISION_T decision = g_backend.check(
+                        &g_backend, request->principal, request->password, request->password_length);
+                decision_cache_put(request->key, decision);
+                rate_limits_charge_failure(request->principal, request->source, decision);
+                respond(g_async.session, request->authenticator, decision);
+                request_decided(request->received_ns);
+                auth_request_free(request);
+
+                pthread_mutex_lock(&g_async.lock);
+        }
+        pthread_mutex_unlock(&g_async.lock);
+        return NULL;
+}
+
+
+static void auth_workers_start(SESSION_T *session, int worker_count)
+{
+        g_async.session = session;
+        g_async.worker_count = worker_count;
+        g_async.workers = calloc(worker_count, sizeof(pthread_t));
+        for(int i = 0; i < worker_count; i++) {
+                pthread_create(&g_async.workers[i], NULL, auth_worker_run, NULL);
+        }
+}
+
+
+// Decides the requests already queued, then stops the workers.
+static void auth_workers_stop(void)
+{
+        pthread_mutex_lock(&g_async.lock);
+        g_async.stopping = true;
+        pthread_cond_broadcast(&g_async.cond);
+        pthread_mutex_unlock(&g_async.lock);
+
+        for(int i = 0; i < g_async.worker_count; i++) {
+                pthread_join(g_async.workers[i], NULL);
+        }
+        free(g_async.workers);
+        g_async.workers = NULL;
+        g_async.worker_count = 0;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+static void report(void)
+{
+        pthread_mutex_lock(&g_async.lock);
+        const long count = g_async.latency_count;
+        printf("Decided %ld, in flight %ld (max %ld)\n",
+               g_async.decided, g_async.in_flight, g_async.max_in_flight);
+        if(count > 0) {
+                qsort(g_async.latencies, count, sizeof(uint32_t), compare_latencies);
+                printf("  decision latency (us): p50 %u, p99 %u, max %u\n",
+                       percentile(g_async.latencies, count, 50),
+                       percentile(g_async.latencies, count, 99),
+                       g_async.latencies[count - 1]);
+        }
+        g_async.latency_count = 0;
+        g_async.max_in_flight = g_async.in_flight;
+        pthread_mutex_unlock(&g_async.lock);
+
+        pthread_mutex_lock(&g_decisions.lock);
+        printf("  decision cache: %ld hits, %ld misses\n", g_decisions.hits, g_decisions.misses);
+        pthread_mutex_unlock(&g_decisions.lock);
+
+        printf("  throttled: %ld by principal, %ld by source\n",
+               rate_limiter_throttled(&g_principal_limiter),
+               rate_limiter_throttled(&g_source_limiter));
+}
+
+
 // When the authenticator handler is active, this function will be called.
 static int on_authenticator_active(
         SESSION_T *session,
@@ -136,60 +1164,201 @@ static int on_authenticator_authenticate(
         // this type of authentication so abstain in case some other registered
         // authentication handler can deal with the request.
         if(credentials == NULL) {
-                printf("No credentials specified, abstaining\n");
                 diffusion_authenticator_abstain(session, authenticator, NULL);
                 return HANDLER_SUCCESS;
         }
         if(credentials->type != PLAIN_PASSWORD) {
-                printf("Credentials are not PLAIN_PASSWORD, abstaining\n");
                 diffusion_authenticator_abstain(session, authenticator, NULL);
                 return HANDLER_SUCCESS;
         }
 
-        printf("principal = %s\n", principal);
-        printf("credentials = %*s\n",
-               (int)credentials->data->len,
-               credentials->data->data);
-
         if(principal == NULL || strlen(principal) == 0) {
-                printf("Denying anonymous connection (no principal)\n");
                 // Deny anonymous connections
                 diffusion_authenticator_deny(session, authenticator, NULL);
                 return HANDLER_SUCCESS;
         }
 
-        char *password = malloc(credentials->data->len + 1);
-        memmove(password, credentials->data->data, credentials->data->len);
-        password[credentials->data->len] = '\0';
-
-        int auth_decided = 0;
-        int i = 0;
-        while(USERS[i].username != NULL) {
+        // Throttle principals and sources making too many attempts.
+        const char *source = session_properties != NULL ? hash_get(session_properties, "$ClientIP") : NULL;
+        if(!rate_limits_allow(principal, source)) {
+                respond(session, authenticator, g_throttle_decision);
+                return HANDLER_SUCCESS;
+        }
 
-                printf("Checking username %s vs %s\n", principal, USERS[i].username);
-                printf("     and password %s vs %s\n", password, USERS[i].password);
+        const int64_t received_ns = monotonic_ns();
+        const char *password = credentials->data->data;
+        const size_t password_length = credentials->data->len;
+        request_started();
 
-                if(strcmp(USERS[i].username, principal) == 0 &&
-                   strcmp(USERS[i].password, password) == 0) {
+        if(g_async.worker_count == 0) {
+                // The password is checked where it lies, without copying it.
+                const AUTH_DECISION_T decision = check_credentials(principal, password, password_length);
+                rate_limits_charge_failure(principal, source, decision);
+                respond(session, authenticator, decision);
+                request_decided(received_ns);
+                return HANDLER_SUCCESS;
+        }
 
-                        puts("Allowed");
-                        diffusion_authenticator_allow(session, authenticator, NULL);
-                        auth_decided = 1;
-                        break;
-                }
-                i++;
+        // Answer from the cache if possible, otherwise queue the request for the workers.
+        uint8_t key[DIGEST_LENGTH];
+        AUTH_DECISION_T decision;
+        if(decision_cache_get(principal, password, password_length, key, &decision)) {
+                rate_limits_charge_failure(principal, source, decision);
+                respond(session, authenticator, decision);
+                request_decided(received_ns);
+                return HANDLER_SUCCESS;
         }
 
-        free(password);
+        AUTH_REQUEST_T *request = calloc(1, sizeof(AUTH_REQUEST_T));
+        request->authenticator = diffusion_authenticator_dup(authenticator);
+        request->principal = strdup(principal);
+        request->source = source != NULL ? strdup(source) : NULL;
+        request->password = malloc(password_length);
+        memcpy(request->password, password, password_length);
+        request->password_length = password_length;
+        memcpy(request->key, key, DIGEST_LENGTH);
+        request->received_ns = received_ns;
 
-        if(auth_decided == 0) {
-                puts("Abstained");
-                diffusion_authenticator_abstain(session, authenticator, NULL);
+        pthread_mutex_lock(&g_async.lock);
+        if(g_async.tail != NULL) {
+                g_async.tail->next = request;
+        }
+        else {
+                g_async.head = request;
         }
+        g_async.tail = request;
+        pthread_cond_signal(&g_async.cond);
+        pthread_mutex_unlock(&g_async.lock);
+
         return HANDLER_SUCCESS;
 }
 
 
+/*
+ * Benchmark.
+ */
+static double rate_per_second(long count, int64_t start_ns)
+{
+        const double seconds = (monotonic_ns() - start_ns) / 1e9;
+        return seconds > 0 ? count / seconds : 0;
+}
+
+
+static void run_benchmark(const char *sizes_list, uint32_t iterations, long cache_ttl)
+{
+        char *sizes = strdup(sizes_list);
+
+        printf("Password hashes use %u iterations\n", iterations);
+        printf("%10s %10s %10s %10s %10s %10s %10s\n",
+               "principals", "load/s", "valid/s", "invalid/s", "unknown/s", "cached/s", "linear/s");
+
+        for(char *token = strtok(sizes, ","); token != NULL; token = strtok(NULL, ",")) {
+                const long count = atol(token);
+                if(count < 1) {
+                        continue;
+                }
+                const long attempts = count < 100000 ? count : 100000;
+                char principal[32];
+                char password[32];
+
+                // Load the store.
+                int64_t start_ns = monotonic_ns();
+                for(long i = 0; i < count; i++) {
+                        sprintf(principal, "user%ld", i);
+                        sprintf(password, "password%ld", i);
+                        credential_store_add_password(&g_store, principal, password, iterations, false);
+                }
+                const double load_rate = rate_per_second(count, start_ns);
+
+                // Authenticate against the store alone.
+                decision_cache_init(attempts * 2, 0);
+                long allowed = 0;
+                start_ns = monotonic_ns();
+                for(long i = 0; i < attempts; i++) {
+                        const long user = rand() % count;
+                        sprintf(principal, "user%ld", user);
+                        sprintf(password, "password%ld", user);
+                        allowed += check_credentials(principal, password, strlen(password)) == AUTH_ALLOW;
+                }
+                const double valid_rate = rate_per_second(attempts, start_ns);
+
+                start_ns = monotonic_ns();
+                for(long i = 0; i < attempts; i++) {
+                        const long user = rand() % count;
+                        sprintf(principal, "user%ld", user);
+                        sprintf(password, "wrong%ld", user);
+                        allowed += check_credentials(principal, password, strlen(password)) == AUTH_ALLOW;
+                }
+                const double invalid_rate = rate_per_second(attempts, start_ns);
+
+                start_ns = monotonic_ns();
+                for(long i = 0; i < attempts; i++) {
+                        sprintf(principal, "nobody%ld", (long)rand() % count);
+                        allowed += check_credentials(principal, "password", 8) == AUTH_ALLOW;
+                }
+                const double unknown_rate = rate_per_second(attempts, start_ns);
+                decision_cache_free();
+
+                /*
+                 * A reconnection storm: every principal authenticates, then
+                 * authenticates again while its decision is cached.
+                 */
+                decision_cache_init(attempts * 2, cache_ttl > 0 ? cache_ttl : 2000);
+                for(long i = 0; i < attempts; i++) {
+                        sprintf(principal, "user%ld", i);
+                        sprintf(password, "password%ld", i);
+                        check_credentials(principal, password, strlen(password));
+                }
+                start_ns = monotonic_ns();
+                for(long i = 0; i < attempts; i++) {
+                        sprintf(principal, "user%ld", i);
+                        sprintf(password, "password%ld", i);
+                        check_credentials(principal, password, strlen(password));
+                }
+                const double cached_rate = rate_per_second(attempts, start_ns);
+                decision_cache_free();
+
+                // The previous linear scan over plain text passwords, for comparison.
+                struct user_credentials_s *users = calloc(count + 1, sizeof(struct user_credentials_s));
+                for(long i = 0; i < count; i++) {
+                        sprintf(principal, "user%ld", i);
+                        sprintf(password, "password%ld", i);
+                        users[i].username = strdup(principal);
+                        users[i].password = strdup(password);
+                }
+                const long linear_attempts = attempts < 1000 ? attempts : 1000;
+                start_ns = monotonic_ns();
+                for(long i = 0; i < linear_attempts; i++) {
+                        const long user = rand() % count;
+                        sprintf(principal, "user%ld", user);
+                        sprintf(password, "password%ld", user);
+                        for(long j = 0; users[j].username != NULL; j++) {
+                                if(strcmp(users[j].username, principal) == 0 &&
+                                   strcmp(users[j].password, password) == 0) {
+                                        break;
+                                }
+                        }
+                }
+                const double linear_rate = rate_per_second(linear_attempts, start_ns);
+                for(long i = 0; i < count; i++) {
+                        free((char *)users[i].username);
+                        free((char *)users[i].password);
+                }
+                free(users);
+
+                printf("%10ld %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+                       count, load_rate, valid_rate, invalid_rate, unknown_rate, cached_rate, linear_rate);
+                if(allowed != attempts) {
+                        printf("  unexpected decisions: %ld allowed of %ld valid attempts\n", allowed, attempts);
+                }
+
+                credential_store_free(&g_store);
+        }
+
+        free(sizes);
+}
+
+
 int main(int argc, char** argv)
 {
         HASH_T *options = parse_cmdline(argc, argv, arg_opts);
@@ -202,6 +1371,87 @@ int main(int argc, char** argv)
         const char *name = hash_get(options, "name");
         const char *principal = hash_get(options, "principal");
         const char *password = hash_get(options, "credentials");
+        const char *users_file = hash_get(options, "users");
+        const long cache_ttl = atol(hash_get(options, "cache_ttl"));
+        const long cache_size = atol(hash_get(options, "cache_size"));
+        const long iterations = atol(hash_get(options, "iterations"));
+        const char *user_password = hash_get(options, "hash_password");
+        const char *benchmark = hash_get(options, "benchmark");
+        const int worker_count = atoi(hash_get(options, "workers"));
+        g_backend.latency_ms = atol(hash_get(options, "backend_latency"));
+        const double principal_rate = atof(hash_get(options, "principal_rate"));
+        const double principal_burst = atof(hash_get(options, "principal_burst"));
+        const double source_rate = atof(hash_get(options, "source_rate"));
+        const double source_burst = atof(hash_get(options, "source_burst"));
+        const char *throttle = hash_get(options, "throttle");
+        g_failure_cost = atof(hash_get(options, "failure_cost"));
+
+        if(iterations < 1 || iterations > UINT32_MAX) {
+                fprintf(stderr, "iterations must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+        if(worker_count < 0 || g_backend.latency_ms < 0) {
+                fprintf(stderr, "workers and backend_latency must not be negative\n");
+                return EXIT_FAILURE;
+        }
+        if(strcmp(throttle, "deny") == 0) {
+                g_throttle_decision = AUTH_DENY;
+        }
+        else if(strcmp(throttle, "abstain") == 0) {
+                g_throttle_decision = AUTH_ABSTAIN;
+        }
+        else {
+                fprintf(stderr, "throttle must be deny or abstain\n");
+                return EXIT_FAILURE;
+        }
+        if(principal_burst < 1 || source_burst < 1) {
+                fprintf(stderr, "principal_burst and source_burst must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        if(user_password != NULL) {
+                const char *separator = strchr(user_password, ':');
+                if(separator == NULL) {
+                        fprintf(stderr, "Expected principal:password\n");
+                        return EXIT_FAILURE;
+                }
+                CREDENTIAL_T credential = { .iterations = (uint32_t)iterations };
+                random_bytes(credential.salt, SALT_LENGTH);
+                hash_password(credential.salt, credential.iterations, separator + 1, strlen(separator + 1), credential.digest);
+
+                printf("%.*s %u ", (int)(separator - user_password), user_password, credential.iterations);
+                print_hex(credential.salt, SALT_LENGTH);
+                printf(" ");
+                print_hex(credential.digest, DIGEST_LENGTH);
+                printf("\n");
+
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
+        if(benchmark != NULL) {
+                run_benchmark(benchmark, (uint32_t)iterations, cache_ttl);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
+        /*
+         * Load the credential store.
+         */
+        if(users_file != NULL) {
+                if(!credential_store_load(&g_store, users_file)) {
+                        return EXIT_FAILURE;
+                }
+        }
+        else {
+                for(int i = 0; USERS[i].username != NULL; i++) {
+                        credential_store_add_password(&g_store, USERS[i].username, USERS[i].password, (uint32_t)iterations, true);
+                }
+        }
+        printf("Loaded %zu principals\n", g_store.count);
+        decision_cache_init(cache_size, cache_ttl);
+        rate_limiter_init(&g_principal_limiter, principal_rate, principal_burst);
+        rate_limiter_init(&g_source_limiter, source_rate, source_burst);
 
         CREDENTIALS_T *credentials = NULL;
         if (password != NULL) {
@@ -232,16 +1482,28 @@ int main(int argc, char** argv)
                 .handler = &handler
          };
 
+        if(worker_count > 0) {
+                printf("Deciding asynchronously with %d workers\n", worker_count);
+                auth_workers_start(session, worker_count);
+        }
+
         puts("Setting authentication handler");
         diffusion_set_authentication_handler(session, params);
 
         // Wait a while before moving on to deregistration.
-        sleep(30);
+        for(int i = 0; i < 3; i++) {
+                sleep(10);
+                report();
+        }
 
         // Deregister the authentication handler.
         printf("Closing authentication handler\n");
         diffusion_registration_close(session, g_registration);
 
+        if(worker_count > 0) {
+                auth_workers_stop();
+        }
+
         session_close(session, NULL);
         session_free(session);
         hash_free(options, NULL, free);
@@ -249,5 +1511,10 @@ int main(int argc, char** argv)
         diffusion_registration_free(g_registration);
         g_registration = NULL;
 
+        decision_cache_free();
+        rate_limiter_free(&g_principal_limiter);
+        rate_limiter_free(&g_source_limiter);
+        credential_store_free(&g_store);
+
         return EXIT_SUCCESS;
 }
@@ -0,0 +1,1340 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example keeps an in-memory registry of every connected session,
+ * built from the same session properties listener events that
+ * session-properties-listener.c prints.
+ *
+ * The properties of each session are held in memory. Selected properties
+ * ($Principal, $Country and $ClientType by default) also have an inverted
+ * index from each value to the sessions that have it. A query such as
+ * "$Country=GB" is then a posting list lookup rather than a scan of every
+ * session, and a query on several properties only walks the shortest
+ * posting list. Queries on properties that are not indexed fall back to
+ * a scan.
+ *
+ * Property names, values and session IDs are interned, so a value shared
+ * by many sessions is stored once. The registry counts the bytes it
+ * allocates and reports them per session, not including allocator
+ * overhead.
+ *
+ * With --benchmark, no connection is made. The given number of synthetic
+ * sessions is loaded into the registry and the open, query, update and
+ * close paths are timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "set.h"
+
+#define MAX_INDEXES 8
+#define MAX_CONDITIONS 8
+#define TOP_VALUES 5
+#define BENCHMARK_LIST_LIMIT 100
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'i', "index", "Comma-separated session properties to index", ARG_OPTIONAL, ARG_HAS_VALUE, "$Principal,$Country,$ClientType"},
+        {'q', "query", "Query to run with each report, as KEY=VALUE[,KEY=VALUE...]", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        {'l', "list", "Maximum number of matching session IDs to print for --query", ARG_OPTIONAL, ARG_HAS_VALUE, "10"},
+        {'I', "interval", "Seconds between registry reports", ARG_OPTIONAL, ARG_HAS_VALUE, "10"},
+        {'d', "duration", "Seconds to listen for session events", ARG_OPTIONAL, ARG_HAS_VALUE, "120"},
+        {'b', "benchmark", "Load this many synthetic sessions and time queries instead of connecting", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+static uint32_t fnv1a(const char *text)
+{
+        uint32_t hash = 2166136261u;
+        for(const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+                hash ^= *p;
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+
+/*
+ * Registry data structures.
+ *
+ * Interned strings, sessions and posting lists are all kept in chained
+ * hash tables. Each node starts with a CHAINED_T so that the tables can
+ * share their insert, unlink and resize code.
+ */
+typedef struct chained_s {
+        struct chained_s *next;
+        uint32_t hash;
+} CHAINED_T;
+
+typedef struct {
+        CHAINED_T **buckets;
+        uint32_t bucket_count;
+        uint32_t count;
+} CHAIN_TABLE_T;
+
+typedef struct {
+        CHAINED_T chain;
+        uint32_t references;
+        char text[];
+} INTERNED_T;
+
+typedef struct {
+        const char *key;
+        const char *value;
+} PROPERTY_T;
+
+struct posting_s;
+
+/*
+ * Where a session appears in one index: the posting list for its value
+ * and its position in that list, so it can be removed without a search.
+ */
+typedef struct {
+        struct posting_s *posting;
+        uint32_t position;
+} INDEX_SLOT_T;
+
+typedef struct {
+        CHAINED_T chain;
+        const char *session_id;
+        PROPERTY_T *properties;
+        uint16_t property_count;
+        uint16_t property_capacity;
+        INDEX_SLOT_T slots[];
+} SESSION_ENTRY_T;
+
+typedef struct posting_s {
+        CHAINED_T chain;
+        const char *value;
+        uint32_t count;
+        uint32_t capacity;
+        SESSION_ENTRY_T **entries;
+} POSTING_T;
+
+typedef struct {
+        const char *property;
+        CHAIN_TABLE_T postings;
+} PROPERTY_INDEX_T;
+
+typedef enum {
+        MEMORY_SESSIONS,
+        MEMORY_STRINGS,
+        MEMORY_INDEXES,
+        MEMORY_CATEGORIES
+} MEMORY_CATEGORY_T;
+
+typedef struct {
+        pthread_mutex_t lock;
+        CHAIN_TABLE_T strings;
+        CHAIN_TABLE_T sessions;
+        PROPERTY_INDEX_T indexes[MAX_INDEXES];
+        int index_count;
+        size_t bytes[MEMORY_CATEGORIES];
+        uint64_t opens;
+        uint64_t updates;
+        uint64_t closes;
+} SESSION_REGISTRY_T;
+
+/*
+ * A query condition, KEY=VALUE, as text.
+ */
+typedef struct {
+        const char *key;
+        const char *value;
+} CONDITION_T;
+
+static SESSION_REGISTRY_T g_registry = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+/*
+ * Allocation helpers that account every byte against a memory category.
+ */
+static void *registry_alloc(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        size_t size)
+{
+        void *p = calloc(1, size);
+        if(p == NULL) {
+                fprintf(stderr, "ERR : Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        registry->bytes[category] += size;
+        return p;
+}
+
+
+static void *registry_realloc(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        void *p,
+        size_t old_size,
+        size_t new_size)
+{
+        void *resized = realloc(p, new_size);
+        if(resized == NULL && new_size > 0) {
+                fprintf(stderr, "ERR : Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        registry->bytes[category] += new_size;
+        registry->bytes[category] -= old_size;
+        return resized;
+}
+
+
+static void registry_release(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        void *p,
+        size_t size)
+{
+        if(p == NULL) {
+                return;
+        }
+        free(p);
+        registry->bytes[category] -= size;
+}
+
+
+/*
+ * Chained hash tables. Bucket counts are powers of two and the table
+ * doubles when it holds more nodes than buckets.
+ */
+static void table_init(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        CHAIN_TABLE_T *table,
+        uint32_t bucket_count)
+{
+        table->buckets = registry_alloc(registry, category, bucket_count * sizeof(CHAINED_T *));
+        table->bucket_count = bucket_count;
+        table->count = 0;
+}
+
+
+static void table_free(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        CHAIN_TABLE_T *table)
+{
+        registry_release(registry, category, table->buckets, table->bucket_count * sizeof(CHAINED_T *));
+        table->buckets = NULL;
+        table->bucket_count = 0;
+        table->count = 0;
+}
+
+
+static void table_grow(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        CHAIN_TABLE_T *table)
+{
+        const uint32_t bucket_count = table->bucket_count * 2;
+        CHAINED_T **buckets = registry_alloc(registry, category, bucket_count * sizeof(CHAINED_T *));
+
+        for(uint32_t i = 0; i < table->bucket_count; i++) {
+                CHAINED_T *node = table->buckets[i];
+                while(node != NULL) {
+                        CHAINED_T *next = node->next;
+                        CHAINED_T **bucket = &buckets[node->hash & (bucket_count - 1)];
+                        node->next = *bucket;
+                        *bucket = node;
+                        node = next;
+                }
+        }
+        registry_release(registry, category, table->buckets, table->bucket_count * sizeof(CHAINED_T *));
+        table->buckets = buckets;
+        table->bucket_count = bucket_count;
+}
+
+
+static void table_insert(
+        SESSION_REGISTRY_T *registry,
+        MEMORY_CATEGORY_T category,
+        CHAIN_TABLE_T *table,
+        CHAINED_T *node)
+{
+        if(table->count >= table->bucket_count) {
+                table_grow(registry, category, table);
+        }
+        CHAINED_T **bucket = &table->buckets[node->hash & (table->bucket_count - 1)];
+        node->next = *bucket;
+        *bucket = node;
+        table->count++;
+}
+
+
+static void table_unlink(
+        CHAIN_TABLE_T *table,
+        CHAINED_T *node)
+{
+        CHAINED_T **link = &table->buckets[node->hash & (table->bucket_count - 1)];
+        while(*link != node) {
+                link = &(*link)->next;
+        }
+        *link = node->next;
+        table->count--;
+}
+
+
+static CHAINED_T *table_first(
+        const CHAIN_TABLE_T *table,
+        uint32_t hash)
+{
+        return table->buckets[hash & (table->bucket_count - 1)];
+}
+
+
+/*
+ * String interning. Interned strings are reference counted and compared
+ * by pointer everywhere else in the registry.
+ */
+static INTERNED_T *interned_node(const char *text)
+{
+        return (INTERNED_T *)(text - offsetof(INTERNED_T, text));
+}
+
+
+static const char *string_find(
+        const SESSION_REGISTRY_T *registry,
+        const char *text)
+{
+        const uint32_t hash = fnv1a(text);
+        for(CHAINED_T *node = table_first(&registry->strings, hash); node != NULL; node = node->next) {
+                INTERNED_T *interned = (INTERNED_T *)node;
+                if(node->hash == hash && strcmp(interned->text, text) == 0) {
+                        return interned->text;
+                }
+        }
+        return NULL;
+}
+
+
+static const char *string_acquire(
+        SESSION_REGISTRY_T *registry,
+        const char *text)
+{
+        const char *existing = string_find(registry, text);
+        if(existing != NULL) {
+                interned_node(existing)->references++;
+                return existing;
+        }
+
+        const size_t length = strlen(text);
+        INTERNED_T *interned = registry_alloc(registry, MEMORY_STRINGS, sizeof(INTERNED_T) + length + 1);
+        interned->chain.hash = fnv1a(text);
+        interned->references = 1;
+        memcpy(interned->text, text, length + 1);
+        table_insert(registry, MEMORY_STRINGS, &registry->strings, &interned->chain);
+        return interned->text;
+}
+
+
+static void string_retain(const char *text)
+{
+        interned_node(text)->references++;
+}
+
+
+static void string_release(
+        SESSION_REGISTRY_T *registry,
+        const char *text)
+{
+        INTERNED_T *interned = interned_node(text);
+        if(--interned->references > 0) {
+                return;
+        }
+        table_unlink(&registry->strings, &interned->chain);
+        registry_release(registry, MEMORY_STRINGS, interned, sizeof(INTERNED_T) + strlen(interned->text) + 1);
+}
+
+
+/*
+ * Inverted indexes.
+ */
+static int index_number(
+        const SESSION_REGISTRY_T *registry,
+        const char *key)
+{
+        for(int i = 0; i < registry->index_count; i++) {
+                if(registry->indexes[i].property == key) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+
+static POSTING_T *posting_find(
+        const PROPERTY_INDEX_T *index,
+        const char *value)
+{
+        const uint32_t hash = interned_node(value)->chain.hash;
+        for(CHAINED_T *node = table_first(&index->postings, hash); node != NULL; node = node->next) {
+                POSTING_T *posting = (POSTING_T *)node;
+                if(posting->value == value) {
+                        return posting;
+                }
+        }
+        return NULL;
+}
+
+
+static void index_add(
+        SESSION_REGISTRY_T *registry,
+        int number,
+        SESSION_ENTRY_T *entry,
+        const char *value)
+{
+        PROPERTY_INDEX_T *index = &registry->indexes[number];
+        POSTING_T *posting = posting_find(index, value);
+        if(posting == NULL) {
+                posting = registry_alloc(registry, MEMORY_INDEXES, sizeof(POSTING_T));
+                posting->chain.hash = interned_node(value)->chain.hash;
+                posting->value = value;
+                string_retain(value);
+                table_insert(registry, MEMORY_INDEXES, &index->postings, &posting->chain);
+        }
+
+        if(posting->count == posting->capacity) {
+                const uint32_t capacity = posting->capacity == 0 ? 4 : posting->capacity * 2;
+                posting->entries = registry_realloc(registry, MEMORY_INDEXES, posting->entries,
+                                                    posting->capacity * sizeof(SESSION_ENTRY_T *),
+                                                    capacity * sizeof(SESSION_ENTRY_T *));
+                posting->capacity = capacity;
+        }
+        posting->entries[posting->count] = entry;
+        entry->slots[number].posting = posting;
+        entry->slots[number].position = posting->count++;
+}
+
+
+/*
+ * Remove a session from one index by moving the last session in the
+ * posting list into its place. Posting lists shrink when they fall to a
+ * quarter full and are freed when empty.
+ */
+static void index_remove(
+        SESSION_REGISTRY_T *registry,
+        int number,
+        SESSION_ENTRY_T *entry)
+{
+        INDEX_SLOT_T *slot = &entry->slots[number];
+        POSTING_T *posting = slot->posting;
+        if(posting == NULL) {
+                return;
+        }
+
+        SESSION_ENTRY_T *last = posting->entries[--posting->count];
+        posting->entries[slot->position] = last;
+        last->slots[number].position = slot->position;
+        slot->posting = NULL;
+
+        if(posting->count == 0) {
+                table_unlink(&registry->indexes[number].postings, &posting->chain);
+                string_release(registry, posting->value);
+                registry_release(registry, MEMORY_INDEXES, posting->entries, posting->capacity * sizeof(SESSION_ENTRY_T *));
+                registry_release(registry, MEMORY_INDEXES, posting, sizeof(POSTING_T));
+        }
+        else if(posting->capacity > 16 && posting->count < posting->capacity / 4) {
+                const uint32_t capacity = posting->capacity / 2;
+                posting->entries = registry_realloc(registry, MEMORY_INDEXES, posting->entries,
+                                                    posting->capacity * sizeof(SESSION_ENTRY_T *),
+                                                    capacity * sizeof(SESSION_ENTRY_T *));
+                posting->capacity = capacity;
+        }
+}
+
+
+/*
+ * Sessions.
+ */
+static size_t entry_size(const SESSION_REGISTRY_T *registry)
+{
+        return sizeof(SESSION_ENTRY_T) + registry->index_count * sizeof(INDEX_SLOT_T);
+}
+
+
+static SESSION_ENTRY_T *session_find(
+        const SESSION_REGISTRY_T *registry,
+        const char *session_id)
+{
+        const char *interned = string_find(registry, session_id);
+        if(interned == NULL) {
+                return NULL;
+        }
+        const uint32_t hash = interned_node(interned)->chain.hash;
+        for(CHAINED_T *node = table_first(&registry->sessions, hash); node != NULL; node = node->next) {
+                SESSION_ENTRY_T *entry = (SESSION_ENTRY_T *)node;
+                if(entry->session_id == interned) {
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+
+static PROPERTY_T *entry_find_property(
+        const SESSION_ENTRY_T *entry,
+        const char *key)
+{
+        for(int i = 0; i < entry->property_count; i++) {
+                if(entry->properties[i].key == key) {
+                        return &entry->properties[i];
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * Set one property of a session, keeping the indexes up to date. A NULL
+ * value removes the property.
+ */
+static void entry_set_property(
+        SESSION_REGISTRY_T *registry,
+        SESSION_ENTRY_T *entry,
+        const char *key_text,
+        const char *value_text)
+{
+        const char *key = string_acquire(registry, key_text);
+        PROPERTY_T *property = entry_find_property(entry, key);
+        const int number = index_number(registry, key);
+
+        if(value_text == NULL) {
+                if(property != NULL) {
+                        if(number >= 0) {
+                                index_remove(registry, number, entry);
+                        }
+                        string_release(registry, property->key);
+                        string_release(registry, property->value);
+                        *property = entry->properties[--entry->property_count];
+                }
+                string_release(registry, key);
+                return;
+        }
+
+        const char *value = string_acquire(registry, value_text);
+        if(property != NULL) {
+                string_release(registry, key);
+                if(property->value == value) {
+                        string_release(registry, value);
+                        return;
+                }
+                if(number >= 0) {
+                        index_remove(registry, number, entry);
+                }
+                string_release(registry, property->value);
+                property->value = value;
+        }
+        else {
+                if(entry->property_count == entry->property_capacity) {
+                        const uint16_t capacity = entry->property_capacity + 4;
+                        entry->properties = registry_realloc(registry, MEMORY_SESSIONS, entry->properties,
+                                                             entry->property_capacity * sizeof(PROPERTY_T),
+                                                             capacity * sizeof(PROPERTY_T));
+                        entry->property_capacity = capacity;
+                }
+                entry->properties[entry->property_count].key = key;
+                entry->properties[entry->property_count].value = value;
+                entry->property_count++;
+        }
+
+        if(number >= 0) {
+                index_add(registry, number, entry, value);
+        }
+}
+
+
+/*
+ * Record a session's properties. Opens and updates are handled alike:
+ * the given properties are merged into those already held, and a session
+ * that has not been seen before is created. If replace is set, held
+ * properties that are not given are removed.
+ */
+static void registry_put(
+        SESSION_REGISTRY_T *registry,
+        const char *session_id,
+        const char **keys,
+        const char **values,
+        int property_count,
+        int is_open,
+        int replace)
+{
+        pthread_mutex_lock(&registry->lock);
+
+        SESSION_ENTRY_T *entry = session_find(registry, session_id);
+        if(entry == NULL) {
+                entry = registry_alloc(registry, MEMORY_SESSIONS, entry_size(registry));
+                entry->session_id = string_acquire(registry, session_id);
+                entry->chain.hash = interned_node(entry->session_id)->chain.hash;
+                table_insert(registry, MEMORY_SESSIONS, &registry->sessions, &entry->chain);
+
+                if(property_count > 0) {
+                        entry->properties = registry_alloc(registry, MEMORY_SESSIONS, property_count * sizeof(PROPERTY_T));
+                        entry->property_capacity = property_count;
+                }
+        }
+
+        for(int i = 0; i < property_count; i++) {
+                entry_set_property(registry, entry, keys[i], values[i]);
+        }
+
+        // Removing a property moves the last one into its slot, so work
+        // backwards over those already checked.
+        for(int p = replace ? entry->property_count - 1 : -1; p >= 0; p--) {
+                const char *key = entry->properties[p].key;
+                int given = 0;
+                for(int i = 0; i < property_count && !given; i++) {
+                        given = strcmp(keys[i], key) == 0;
+                }
+                if(!given) {
+                        entry_set_property(registry, entry, key, NULL);
+                }
+        }
+
+        if(is_open) {
+                registry->opens++;
+        }
+        else {
+                registry->updates++;
+        }
+
+        pthread_mutex_unlock(&registry->lock);
+}
+
+
+static void registry_remove_entry(
+        SESSION_REGISTRY_T *registry,
+        SESSION_ENTRY_T *entry)
+{
+        for(int i = 0; i < registry->index_count; i++) {
+                index_remove(registry, i, entry);
+        }
+        for(int i = 0; i < entry->property_count; i++) {
+                string_release(registry, entry->properties[i].key);
+                string_release(registry, entry->properties[i].value);
+        }
+        registry_release(registry, MEMORY_SESSIONS, entry->properties, entry->property_capacity * sizeof(PROPERTY_T));
+        table_unlink(&registry->sessions, &entry->chain);
+        string_release(registry, entry->session_id);
+        registry_release(registry, MEMORY_SESSIONS, entry, entry_size(registry));
+}
+
+
+static void registry_remove(
+        SESSION_REGISTRY_T *registry,
+        const char *session_id)
+{
+        pthread_mutex_lock(&registry->lock);
+        SESSION_ENTRY_T *entry = session_find(registry, session_id);
+        if(entry != NULL) {
+                registry_remove_entry(registry, entry);
+                registry->closes++;
+        }
+        pthread_mutex_unlock(&registry->lock);
+}
+
+
+/*
+ * Set up an empty registry with an index on each of the named
+ * properties.
+ */
+static void registry_init(
+        SESSION_REGISTRY_T *registry,
+        const char **index_properties,
+        int index_count)
+{
+        table_init(registry, MEMORY_STRINGS, &registry->strings, 1024);
+        table_init(registry, MEMORY_SESSIONS, &registry->sessions, 1024);
+        for(int i = 0; i < index_count; i++) {
+                PROPERTY_INDEX_T *index = &registry->indexes[i];
+                index->property = string_acquire(registry, index_properties[i]);
+                table_init(registry, MEMORY_INDEXES, &index->postings, 64);
+        }
+        registry->index_count = index_count;
+}
+
+
+static void registry_free(SESSION_REGISTRY_T *registry)
+{
+        pthread_mutex_lock(&registry->lock);
+        for(uint32_t i = 0; i < registry->sessions.bucket_count; i++) {
+                while(registry->sessions.buckets[i] != NULL) {
+                        registry_remove_entry(registry, (SESSION_ENTRY_T *)registry->sessions.buckets[i]);
+                }
+        }
+        for(int i = 0; i < registry->index_count; i++) {
+                table_free(registry, MEMORY_INDEXES, &registry->indexes[i].postings);
+                string_release(registry, registry->indexes[i].property);
+        }
+        registry->index_count = 0;
+        table_free(registry, MEMORY_SESSIONS, &registry->sessions);
+        table_free(registry, MEMORY_STRINGS, &registry->strings);
+        pthread_mutex_unlock(&registry->lock);
+}
+
+
+static size_t registry_bytes(const SESSION_REGISTRY_T *registry)
+{
+        size_t total = 0;
+        for(int i = 0; i < MEMORY_CATEGORIES; i++) {
+                total += registry->bytes[i];
+        }
+        return total;
+}
+
+
+/*
+ * Queries.
+ */
+typedef struct {
+        const char *key;
+        const char *value;
+        POSTING_T *posting;
+        int number;
+} RESOLVED_CONDITION_T;
+
+
+static int entry_matches(
+        const SESSION_ENTRY_T *entry,
+        const RESOLVED_CONDITION_T *conditions,
+        int condition_count)
+{
+        for(int i = 0; i < condition_count; i++) {
+                if(conditions[i].number >= 0) {
+                        if(entry->slots[conditions[i].number].posting != conditions[i].posting) {
+                                return 0;
+                        }
+                        continue;
+                }
+                const PROPERTY_T *property = entry_find_property(entry, conditions[i].key);
+                if(property == NULL || property->value != conditions[i].value) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * Find the sessions that match every condition. Returns the number of
+ * matching sessions, and copies up to max_session_ids of their IDs into
+ * session_ids; the caller frees the copies. Pass max_session_ids of 0
+ * to count only.
+ *
+ * Indexed conditions are resolved to their posting lists and the
+ * shortest list drives the query; the other indexed conditions are then
+ * checked against each session's index slots. Without an indexed
+ * condition every session is scanned.
+ */
+static size_t registry_select(
+        SESSION_REGISTRY_T *registry,
+        const CONDITION_T *conditions,
+        int condition_count,
+        char **session_ids,
+        size_t max_session_ids)
+{
+        RESOLVED_CONDITION_T resolved[MAX_CONDITIONS];
+        const POSTING_T *driver = NULL;
+        size_t matches = 0;
+
+        pthread_mutex_lock(&registry->lock);
+
+        for(int i = 0; i < condition_count; i++) {
+                resolved[i].key = string_find(registry, conditions[i].key);
+                resolved[i].value = string_find(registry, conditions[i].value);
+                resolved[i].posting = NULL;
+                resolved[i].number = -1;
+                if(resolved[i].key == NULL || resolved[i].value == NULL) {
+                        /*
+                         * No session has this key or value.
+                         */
+                        goto done;
+                }
+                resolved[i].number = index_number(registry, resolved[i].key);
+                if(resolved[i].number >= 0) {
+                        resolved[i].posting = posting_find(&registry->indexes[resolved[i].number], resolved[i].value);
+                        if(resolved[i].posting == NULL) {
+                                goto done;
+                        }
+                        if(driver == NULL || resolved[i].posting->count < driver->count) {
+                                driver = resolved[i].posting;
+                        }
+                }
+        }
+
+        if(driver != NULL) {
+                if(condition_count == 1) {
+                        matches = driver->count;
+                        for(size_t i = 0; i < matches && i < max_session_ids; i++) {
+                                session_ids[i] = strdup(driver->entries[i]->session_id);
+                        }
+                        goto done;
+                }
+                for(uint32_t i = 0; i < driver->count; i++) {
+                        const SESSION_ENTRY_T *entry = driver->entries[i];
+                        if(entry_matches(entry, resolved, condition_count)) {
+                                if(matches < max_session_ids) {
+                                        session_ids[matches] = strdup(entry->session_id);
+                                }
+                                matches++;
+                        }
+                }
+        }
+        else {
+                for(uint32_t b = 0; b < registry->sessions.bucket_count; b++) {
+                        for(CHAINED_T *node = registry->sessions.buckets[b]; node != NULL; node = node->next) {
+                                const SESSION_ENTRY_T *entry = (const SESSION_ENTRY_T *)node;
+                                if(entry_matches(entry, resolved, condition_count)) {
+                                        if(matches < max_session_ids) {
+                                                session_ids[matches] = strdup(entry->session_id);
+                                        }
+                                        matches++;
+                                }
+                        }
+                }
+        }
+
+done:
+        pthread_mutex_unlock(&registry->lock);
+        return matches;
+}
+
+
+/*
+ * Parse "KEY=VALUE[,KEY=VALUE...]" in place. Returns the number of
+ * conditions, or -1 if the text is malformed.
+ */
+static int parse_conditions(
+        char *text,
+        CONDITION_T *conditions,
+        int max_conditions)
+{
+        int count = 0;
+        char *saveptr = NULL;
+        for(char *token = strtok_r(text, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+                char *separator = strchr(token, '=');
+                if(separator == NULL || separator == token || count == max_conditions) {
+                        return -1;
+                }
+                *separator = '\0';
+                conditions[count].key = token;
+                conditions[count].value = separator + 1;
+                count++;
+        }
+        return count;
+}
+
+
+/*
+ * Run a query, printing the number of matches, the time taken and up to
+ * list_limit of the matching session IDs.
+ */
+static void run_query(
+        SESSION_REGISTRY_T *registry,
+        const char *description,
+        const CONDITION_T *conditions,
+        int condition_count,
+        size_t list_limit)
+{
+        char **session_ids = list_limit > 0 ? calloc(list_limit, sizeof(char *)) : NULL;
+
+        const int64_t start_ns = monotonic_ns();
+        const size_t matches = registry_select(registry, conditions, condition_count, session_ids, list_limit);
+        const int64_t elapsed_ns = monotonic_ns() - start_ns;
+
+        printf("Query %s: %zu sessions in %.1f us\n", description, matches, elapsed_ns / 1000.0);
+        for(size_t i = 0; i < matches && i < list_limit; i++) {
+                printf("        %s\n", session_ids[i]);
+                free(session_ids[i]);
+        }
+        free(session_ids);
+}
+
+
+/*
+ * Print the session count, memory use and the most common values of
+ * each indexed property.
+ */
+static void registry_report(SESSION_REGISTRY_T *registry)
+{
+        pthread_mutex_lock(&registry->lock);
+
+        const uint32_t sessions = registry->sessions.count;
+        const size_t total = registry_bytes(registry);
+
+        printf("Sessions: %u (opens %llu, updates %llu, closes %llu), distinct strings %u\n",
+               sessions,
+               (unsigned long long)registry->opens,
+               (unsigned long long)registry->updates,
+               (unsigned long long)registry->closes,
+               registry->strings.count);
+        printf("Memory: %zu bytes, %.1f bytes/session (sessions %zu, strings %zu, indexes %zu)\n",
+               total,
+               sessions > 0 ? (double)total / sessions : 0.0,
+               registry->bytes[MEMORY_SESSIONS],
+               registry->bytes[MEMORY_STRINGS],
+               registry->bytes[MEMORY_INDEXES]);
+
+        for(int i = 0; i < registry->index_count; i++) {
+                const PROPERTY_INDEX_T *index = &registry->indexes[i];
+                const POSTING_T *top[TOP_VALUES] = { NULL };
+
+                for(uint32_t b = 0; b < index->postings.bucket_count; b++) {
+                        for(CHAINED_T *node = index->postings.buckets[b]; node != NULL; node = node->next) {
+                                const POSTING_T *posting = (const POSTING_T *)node;
+                                for(int t = 0; t < TOP_VALUES; t++) {
+                                        if(top[t] == NULL || posting->count > top[t]->count) {
+                                                memmove(&top[t + 1], &top[t], (TOP_VALUES - t - 1) * sizeof(POSTING_T *));
+                                                top[t] = posting;
+                                                break;
+                                        }
+                                }
+                        }
+                }
+
+                printf("Index %s: %u values;", index->property, index->postings.count);
+                for(int t = 0; t < TOP_VALUES && top[t] != NULL; t++) {
+                        printf(" %s=%u", top[t]->value, top[t]->count);
+                }
+                printf("\n");
+        }
+
+        pthread_mutex_unlock(&registry->lock);
+}
+
+
+/*
+ * Session properties listener callbacks.
+ *
+ * On registration the server sends an open event for every session that
+ * is already connected, so the registry starts out complete. Each open
+ * and update event carries all of the session's requested properties, so
+ * a property missing from an update has been removed from the session.
+ */
+static void put_event(
+        const SESSION_PROPERTIES_EVENT_T *request,
+        int is_open)
+{
+        if(request->properties == NULL) {
+                return;
+        }
+
+        char *sid_str = session_id_to_string(&request->session_id);
+        char **keys = hash_keys(request->properties);
+        int property_count = 0;
+        while(keys[property_count] != NULL) {
+                property_count++;
+        }
+
+        const char **values = calloc(property_count + 1, sizeof(char *));
+        for(int i = 0; i < property_count; i++) {
+                values[i] = hash_get(request->properties, keys[i]);
+        }
+        registry_put(&g_registry, sid_str, (const char **)keys, values, property_count, is_open, 1);
+
+        free(values);
+        free(keys);
+        free(sid_str);
+}
+
+
+static int on_registered(
+        SESSION_T *session,
+        void *context)
+{
+        printf("Session properties listener registered\n");
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_registration_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        fprintf(stderr, "Session properties listener registration failed: %s\n", error->message);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_session_open(
+        SESSION_T *session,
+        const SESSION_PROPERTIES_EVENT_T *request,
+        void *context)
+{
+        put_event(request, 1);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_session_update(
+        SESSION_T *session,
+        const SESSION_PROPERTIES_EVENT_T *request,
+        void *context)
+{
+        put_event(request, 0);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_session_close(
+        SESSION_T *session,
+        const SESSION_PROPERTIES_EVENT_T *request,
+        void *context)
+{
+        char *sid_str = session_id_to_string(&request->session_id);
+        registry_remove(&g_registry, sid_str);
+        free(sid_str);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_session_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        fprintf(stderr, "Session properties listener error: %s\n", error->message);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Benchmark mode.
+ *
+ * Synthetic sessions carry a similar set of fixed properties to real
+ * ones: unique session IDs, client addresses and start times, a
+ * principal shared by around 20 sessions, and a small set of countries,
+ * client types and connection details shared by many.
+ */
+static const char *g_countries[] = {
+        "GB", "US", "DE", "FR", "JP", "IN", "BR", "CA", "AU", "NL",
+        "SE", "ES", "IT", "SG", "ZA", "MX", "KR", "CH", "IE", "PL"
+};
+
+static const char *g_client_types[] = {
+        "JAVASCRIPT_BROWSER", "ANDROID", "IOS", "JAVA", "DOTNET", "C", "PYTHON"
+};
+
+#define ARRAY_LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+#define SYNTHETIC_PROPERTIES 11
+
+
+static void synthetic_session_id(
+        long n,
+        char *buffer,
+        size_t size)
+{
+        snprintf(buffer, size, "%016llx-%016llx",
+                 0x5eed0000deadbeefULL, (unsigned long long)n * 0x9e3779b97f4a7c15ULL);
+}
+
+
+static void load_synthetic_session(
+        SESSION_REGISTRY_T *registry,
+        long n,
+        long principals)
+{
+        char session_id[40];
+        char principal[32];
+        char client_ip[32];
+        char start_time[32];
+
+        synthetic_session_id(n, session_id, sizeof(session_id));
+        snprintf(principal, sizeof(principal), "user%ld", n % principals);
+        snprintf(client_ip, sizeof(client_ip), "10.%ld.%ld.%ld", (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff);
+        snprintf(start_time, sizeof(start_time), "%lld", 1650000000000LL + n * 37);
+
+        const char *keys[SYNTHETIC_PROPERTIES] = {
+                "$SessionId", "$Principal", "$ClientIP", "$StartTime", "$Country",
+                "$ClientType", "$Connector", "$Transport", "$ServerName", "$Roles", "$Language"
+        };
+        const char *values[SYNTHETIC_PROPERTIES] = {
+                session_id, principal, client_ip, start_time,
+                g_countries[(n * 7) % ARRAY_LENGTH(g_countries)],
+                g_client_types[(n * 3) % ARRAY_LENGTH(g_client_types)],
+                "Client Connector", "WEBSOCKET", "server-1", "\"CLIENT\"", "en"
+        };
+        registry_put(registry, session_id, keys, values, SYNTHETIC_PROPERTIES, 1, 1);
+}
+
+
+/*
+ * Time a query by repeating it until at least 50ms have elapsed.
+ */
+static void time_query(
+        SESSION_REGISTRY_T *registry,
+        const char *description,
+        const CONDITION_T *conditions,
+        int condition_count)
+{
+        char *session_ids[BENCHMARK_LIST_LIMIT];
+        size_t matches = 0;
+        double count_us = 0;
+        double list_us = 0;
+
+        for(int list = 0; list <= 1; list++) {
+                long iterations = 0;
+                const int64_t start_ns = monotonic_ns();
+                int64_t elapsed_ns;
+                do {
+                        const size_t limit = list ? BENCHMARK_LIST_LIMIT : 0;
+                        matches = registry_select(registry, conditions, condition_count, session_ids, limit);
+                        for(size_t i = 0; i < matches && i < limit; i++) {
+                                free(session_ids[i]);
+                        }
+                        iterations++;
+                        elapsed_ns = monotonic_ns() - start_ns;
+                } while(elapsed_ns < 50000000LL);
+
+                if(list) {
+                        list_us = elapsed_ns / 1000.0 / iterations;
+                }
+                else {
+                        count_us = elapsed_ns / 1000.0 / iterations;
+                }
+        }
+
+        printf("%-40s %10zu %12.2f %12.2f\n", description, matches, count_us, list_us);
+}
+
+
+static void run_benchmark(
+        SESSION_REGISTRY_T *registry,
+        long session_count,
+        const CONDITION_T *query,
+        int query_count,
+        const char *query_text)
+{
+        const long principals = session_count / 20 > 0 ? session_count / 20 : 1;
+
+        int64_t start_ns = monotonic_ns();
+        for(long n = 0; n < session_count; n++) {
+                load_synthetic_session(registry, n, principals);
+        }
+        int64_t elapsed_ns = monotonic_ns() - start_ns;
+        printf("Opened %ld sessions in %.1f ms (%.2f us/session)\n",
+               session_count, elapsed_ns / 1e6, elapsed_ns / 1000.0 / session_count);
+        registry_report(registry);
+
+        const CONDITION_T country[] = { { "$Country", "GB" } };
+        const CONDITION_T client_type[] = { { "$ClientType", "ANDROID" } };
+        const CONDITION_T principal[] = { { "$Principal", "user7" } };
+        const CONDITION_T country_and_type[] = { { "$Country", "GB" }, { "$ClientType", "IOS" } };
+        const CONDITION_T transport[] = { { "$Transport", "WEBSOCKET" } };
+        const CONDITION_T client_ip[] = { { "$ClientIP", "10.0.0.5" } };
+
+        printf("\n%-40s %10s %12s %12s\n", "Query", "Matches", "Count (us)", "List (us)");
+        time_query(registry, "$Country=GB", country, 1);
+        time_query(registry, "$ClientType=ANDROID", client_type, 1);
+        time_query(registry, "$Principal=user7", principal, 1);
+        time_query(registry, "$Country=GB,$ClientType=IOS", country_and_type, 2);
+        time_query(registry, "$Transport=WEBSOCKET", transport, 1);
+        time_query(registry, "$ClientIP=10.0.0.5", client_ip, 1);
+        if(query_count > 0) {
+                time_query(registry, query_text, query, query_count);
+        }
+        printf("(list queries return at most %d session IDs)\n\n", BENCHMARK_LIST_LIMIT);
+
+        /*
+         * Move one session in ten to a different country.
+         */
+        const char *update_keys[] = { "$Country" };
+        long updated = 0;
+        start_ns = monotonic_ns();
+        for(long n = 0; n < session_count; n += 10) {
+                char session_id[40];
+                synthetic_session_id(n, session_id, sizeof(session_id));
+                const char *update_values[] = { g_countries[(n * 7 + 1) % ARRAY_LENGTH(g_countries)] };
+                registry_put(registry, session_id, update_keys, update_values, 1, 0, 0);
+                updated++;
+        }
+        elapsed_ns = monotonic_ns() - start_ns;
+        printf("Updated %ld sessions in %.1f ms (%.2f us/session)\n",
+               updated, elapsed_ns / 1e6, updated > 0 ? elapsed_ns / 1000.0 / updated : 0.0);
+
+        start_ns = monotonic_ns();
+        for(long n = 0; n < session_count; n++) {
+                char session_id[40];
+                synthetic_session_id(n, session_id, sizeof(session_id));
+                registry_remove(registry, session_id);
+        }
+        elapsed_ns = monotonic_ns() - start_ns;
+        printf("Closed %ld sessions in %.1f ms (%.2f us/session)\n",
+               session_count, elapsed_ns / 1e6, elapsed_ns / 1000.0 / session_count);
+        registry_report(registry);
+}
+
+
+/*
+ * Program entry point.
+ */
+int main(int argc, char **argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        const long interval = atol(hash_get(options, "interval"));
+        const long duration = atol(hash_get(options, "duration"));
+        const long list_limit = atol(hash_get(options, "list"));
+        const char *benchmark = hash_get(options, "benchmark");
+        const long benchmark_sessions = benchmark != NULL ? atol(benchmark) : 0;
+        if(interval <= 0 || duration <= 0 || list_limit < 0 || (benchmark != NULL && benchmark_sessions <= 0)) {
+                fprintf(stderr, "--interval, --duration and --benchmark must be positive and --list must not be negative\n");
+                return EXIT_FAILURE;
+        }
+
+        char *index_text = strdup(hash_get(options, "index"));
+        const char *index_properties[MAX_INDEXES];
+        int index_count = 0;
+        char *saveptr = NULL;
+        for(char *token = strtok_r(index_text, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+                if(index_count == MAX_INDEXES) {
+                        fprintf(stderr, "At most %d properties can be indexed\n", MAX_INDEXES);
+                        return EXIT_FAILURE;
+                }
+                index_properties[index_count++] = token;
+        }
+
+        const char *query_option = hash_get(options, "query");
+        char *query_text = query_option != NULL ? strdup(query_option) : NULL;
+        CONDITION_T query[MAX_CONDITIONS];
+        int query_count = 0;
+        if(query_text != NULL) {
+                query_count = parse_conditions(query_text, query, MAX_CONDITIONS);
+                if(query_count <= 0) {
+                        fprintf(stderr, "--query must be KEY=VALUE[,KEY=VALUE...] with at most %d conditions\n", MAX_CONDITIONS);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        registry_init(&g_registry, index_properties, index_count);
+
+        if(benchmark != NULL) {
+                run_benchmark(&g_registry, benchmark_sessions, query, query_count, query_option);
+                registry_free(&g_registry);
+                free(query_text);
+                free(index_text);
+                credentials_free(credentials);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
+        /*
+         * Create a session with Diffusion.
+         */
+        DIFFUSION_ERROR_T error = { 0 };
+        SESSION_T *session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Register a session properties listener for all fixed and user
+         * properties, so that any of them can be queried.
+         */
+        SET_T *required_properties = set_new_string(5);
+        set_add(required_properties, PROPERTIES_SELECTOR_ALL_FIXED_PROPERTIES);
+        set_add(required_properties, PROPERTIES_SELECTOR_ALL_USER_PROPERTIES);
+
+        SESSION_PROPERTIES_REGISTRATION_PARAMS_T params = {
+                .on_registered = on_registered,
+                .on_registration_error = on_registration_error,
+                .on_session_open = on_session_open,
+                .on_session_close = on_session_close,
+                .on_session_update = on_session_update,
+                .on_session_error = on_session_error,
+                .required_properties = required_properties
+        };
+        session_properties_listener_register(session, params);
+
+        /*
+         * Report on the registry, and run the query if one was given,
+         * until the duration has passed.
+         */
+        for(long elapsed = 0; elapsed < duration; elapsed += interval) {
+                sleep(interval < duration - elapsed ? interval : duration - elapsed);
+                registry_report(&g_registry);
+                if(query_count > 0) {
+                        run_query(&g_registry, query_option, query, query_count, list_limit);
+                }
+                printf("\n");
+        }
+
+        /*
+         * Close session and free resources.
+         */
+        session_close(session, NULL);
+        session_free(session);
+
+        registry_free(&g_registry);
+        set_free(required_properties);
+        free(query_text);
+        free(index_text);
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
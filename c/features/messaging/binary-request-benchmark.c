@@ -0,0 +1,449 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example shows how to send requests and responses as binary values,
+ * and compares the round trip cost with string values.
+ *
+ * Binary requests are written from a preformatted frame. The raw bytes of
+ * a binary value are the frame itself, so the responder takes them with
+ * a single block copy and passes a pointer and length view of them to
+ * the code handling the frame, with no decoding step. The string version
+ * encodes and decodes the same payload with write_diffusion_string_value
+ * and read_diffusion_string_value, as the other messaging examples do.
+ *
+ * For each payload size, a fixed number of requests are sent to an echo
+ * responder with a limit on the number outstanding, first as strings
+ * then as binary. The throughput and round trip latency of each are
+ * reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+#define STRING_PATH "benchmark/string"
+#define BINARY_PATH "benchmark/binary"
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'z', "sizes", "Comma separated payload sizes in bytes", ARG_OPTIONAL, ARG_HAS_VALUE, "64,256,1024,4096,16384,65536"},
+        {'n', "requests", "Number of requests for each size and datatype", ARG_OPTIONAL, ARG_HAS_VALUE, "5000"},
+        {'w', "window", "Maximum number of requests outstanding", ARG_OPTIONAL, ARG_HAS_VALUE, "16"},
+        END_OF_ARG_OPTS
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * A view of a binary payload. The data is owned by whoever created the
+ * view.
+ */
+typedef struct payload_view_s {
+        const char *data;
+        size_t length;
+} PAYLOAD_VIEW_T;
+
+
+/*
+ * Handling a frame. This example echoes it back, but a real responder
+ * would parse the frame in place.
+ */
+static void handle_frame(SESSION_T *session, const DIFFUSION_RESPONDER_HANDLE_T *handle, PAYLOAD_VIEW_T frame)
+{
+        BUF_T *response_buf = buf_create();
+        write_diffusion_binary_value(frame.data, response_buf, (int)frame.length);
+        diffusion_respond_to_request(session, handle, response_buf, NULL);
+        buf_free(response_buf);
+}
+
+
+static int
+on_binary_request(SESSION_T *session, DIFFUSION_DATATYPE request_datatype, const DIFFUSION_VALUE_T *request,
+                  const DIFFUSION_REQUEST_CONTEXT_T *request_context, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
+{
+        // The raw bytes of a binary value are the frame itself.
+        char *bytes;
+        size_t length;
+        if(!diffusion_value_get_raw_bytes(request, &bytes, &length)) {
+                diffusion_respond_to_request_with_error(session, handle, "Unreadable frame", NULL);
+                return HANDLER_SUCCESS;
+        }
+
+        const PAYLOAD_VIEW_T frame = { bytes, length };
+        handle_frame(session, handle, frame);
+        free(bytes);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int
+on_string_request(SESSION_T *session, DIFFUSION_DATATYPE request_datatype, const DIFFUSION_VALUE_T *request,
+                  const DIFFUSION_REQUEST_CONTEXT_T *request_context, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
+{
+        char *request_val;
+        read_diffusion_string_value(request, &request_val, NULL);
+
+        BUF_T *response_buf = buf_create();
+        write_diffusion_string_value(request_val, response_buf);
+        diffusion_respond_to_request(session, handle, response_buf, NULL);
+
+        buf_free(response_buf);
+        free(request_val);
+
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Requester side. The context of each request is its index in the
+ * table of send times.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long outstanding;
+        long completed;
+        long failed;
+        size_t expected_length;
+        long length_mismatches;
+        int64_t *sent_ns;
+        uint32_t *latencies;
+        long latency_count;
+} g_bench = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void request_finished(long index, bool failed, size_t length)
+{
+        const int64_t latency_ns = monotonic_ns() - g_bench.sent_ns[index];
+
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.outstanding--;
+        if(failed) {
+                g_bench.failed++;
+        }
+        else {
+                g_bench.completed++;
+                g_bench.latencies[g_bench.latency_count++] = (uint32_t)(latency_ns / 1000);
+                if(length != g_bench.expected_length) {
+                        g_bench.length_mismatches++;
+                }
+        }
+        pthread_cond_broadcast(&g_bench.cond);
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static int
+on_binary_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
+{
+        char *bytes;
+        size_t length = 0;
+        const bool ok = diffusion_value_get_raw_bytes(response, &bytes, &length);
+        if(ok) {
+                free(bytes);
+        }
+        request_finished((long)(intptr_t)context, !ok, length);
+        return HANDLER_SUCCESS;
+}
+
+
+static int
+on_string_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
+{
+        char *response_val = NULL;
+        const bool ok = read_diffusion_string_value(response, &response_val, NULL);
+        request_finished((long)(intptr_t)context, !ok, ok ? strlen(response_val) : 0);
+        free(response_val);
+        return HANDLER_SUCCESS;
+}
+
+
+static int
+on_request_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        request_finished((long)(intptr_t)error->context, true, 0);
+        return HANDLER_SUCCESS;
+}
+
+
+static int
+on_request_discard(SESSION_T *session, void *context)
+{
+        request_finished((long)(intptr_t)context, true, 0);
+        return HANDLER_SUCCESS;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+/*
+ * Sends request_count requests of the given size and datatype, and
+ * prints a line of results.
+ */
+static void run_benchmark(
+        SESSION_T *session,
+        DIFFUSION_DATATYPE datatype,
+        const char *frame,
+        size_t size,
+        long request_count,
+        long window)
+{
+        const bool binary = datatype == DATATYPE_BINARY;
+
+        g_bench.outstanding = 0;
+        g_bench.completed = 0;
+        g_bench.failed = 0;
+        g_bench.length_mismatches = 0;
+        g_bench.latency_count = 0;
+        g_bench.expected_length = size;
+
+        SEND_REQUEST_PARAMS_T send_request_params = {
+                .path = binary ? BINARY_PATH : STRING_PATH,
+                .on_response = binary ? on_binary_response : on_string_response,
+                .on_error = on_request_error,
+                .on_discard = on_request_discard,
+                .request_datatype = datatype,
+                .response_datatype = datatype
+        };
+
+        // The binary frame is preformatted once and sent as it is.
+        BUF_T *binary_request = NULL;
+        if(binary) {
+                binary_request = buf_create();
+                write_diffusion_binary_value(frame, binary_request, (int)size);
+        }
+
+        const int64_t start_ns = monotonic_ns();
+
+        for(long i = 0; i < request_count; i++) {
+                pthread_mutex_lock(&g_bench.lock);
+                while(g_bench.outstanding >= window) {
+                        pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+                }
+                g_bench.outstanding++;
+                pthread_mutex_unlock(&g_bench.lock);
+
+                BUF_T *request = binary_request;
+                if(!binary) {
+                        request = buf_create();
+                        write_diffusion_string_value(frame, request);
+                }
+
+                g_bench.sent_ns[i] = monotonic_ns();
+                send_request_params.request = request;
+                send_request_params.context = (void *)(intptr_t)i;
+                send_request(session, send_request_params);
+
+                if(!binary) {
+                        buf_free(request);
+                }
+        }
+
+        pthread_mutex_lock(&g_bench.lock);
+        while(g_bench.outstanding > 0) {
+                pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+        }
+        pthread_mutex_unlock(&g_bench.lock);
+
+        const double seconds = (monotonic_ns() - start_ns) / 1e9;
+        if(binary_request != NULL) {
+                buf_free(binary_request);
+        }
+
+        const long count = g_bench.latency_count;
+        qsort(g_bench.latencies, count, sizeof(uint32_t), compare_latencies);
+
+        printf("%8zu %-7s %10.0f %10.2f", size, binary ? "binary" : "string",
+               g_bench.completed / seconds, 2.0 * size * g_bench.completed / seconds / (1024 * 1024));
+        if(count > 0) {
+                printf(" %8u %8u %8u",
+                       percentile(g_bench.latencies, count, 50),
+                       percentile(g_bench.latencies, count, 99),
+                       g_bench.latencies[count - 1]);
+        }
+        if(g_bench.failed > 0 || g_bench.length_mismatches > 0) {
+                printf("  (%ld failed, %ld wrong length)", g_bench.failed, g_bench.length_mismatches);
+        }
+        printf("\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        char *url = hash_get(options, "url");
+
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        const long request_count = atol(hash_get(options, "requests"));
+        const long window = atol(hash_get(options, "window"));
+
+        if(request_count < 1 || window < 1) {
+                fprintf(stderr, "requests and window must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Create 2 sessions with Diffusion.
+         */
+        SESSION_T *session = NULL;
+        SESSION_T *handler = NULL;
+
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        handler = session_create(url, "admin", credentials, NULL, NULL, &error);
+        if(handler == NULL) {
+                fprintf(stderr, "TEST: Failed to create handler session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        DIFFUSION_REQUEST_HANDLER_T string_handler = {
+                .request_datatype = DATATYPE_STRING,
+                .response_datatype = DATATYPE_STRING,
+                .on_request = on_string_request
+        };
+        DIFFUSION_REQUEST_HANDLER_T binary_handler = {
+                .request_datatype = DATATYPE_BINARY,
+                .response_datatype = DATATYPE_BINARY,
+                .on_request = on_binary_request
+        };
+
+        ADD_REQUEST_HANDLER_PARAMS_T string_handler_params = {
+                .path = STRING_PATH,
+                .request_handler = &string_handler
+        };
+        ADD_REQUEST_HANDLER_PARAMS_T binary_handler_params = {
+                .path = BINARY_PATH,
+                .request_handler = &binary_handler
+        };
+
+        add_request_handler(handler, string_handler_params);
+        add_request_handler(handler, binary_handler_params);
+        sleep(1);
+
+        g_bench.sent_ns = calloc(request_count, sizeof(int64_t));
+        g_bench.latencies = calloc(request_count, sizeof(uint32_t));
+
+        printf("%8s %-7s %10s %10s %8s %8s %8s\n",
+               "size", "type", "req/s", "MB/s", "p50 us", "p99 us", "max us");
+
+        char *sizes = strdup(hash_get(options, "sizes"));
+        for(char *token = strtok(sizes, ","); token != NULL; token = strtok(NULL, ",")) {
+                const long size = atol(token);
+                if(size < 1) {
+                        continue;
+                }
+
+                // Printable, so the same payload can be sent as a string.
+                char *frame = malloc(size + 1);
+                for(long i = 0; i < size; i++) {
+                        frame[i] = 'a' + (i % 26);
+                }
+                frame[size] = '\0';
+
+                run_benchmark(session, DATATYPE_STRING, frame, size, request_count, window);
+                run_benchmark(session, DATATYPE_BINARY, frame, size, request_count, window);
+
+                free(frame);
+        }
+        free(sizes);
+
+        session_close(session, NULL);
+        session_free(session);
+
+        session_close(handler, NULL);
+        session_free(handler);
+
+        free(g_bench.sent_ns);
+        free(g_bench.latencies);
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,539 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example shows how a request handler can hand requests to a pool of
+ * worker threads, rather than responding on the callback thread, so that
+ * slow work such as a database lookup doesn't hold up other requests.
+ *
+ * Each request path is a route with its own work function and a limit on
+ * how many of its requests may be worked on at once. The request handler
+ * copies the request and a duplicate of the responder handle into the
+ * route's queue. Workers take requests from whichever routes are below
+ * their limit, in turn, and respond from the worker thread. Requests are
+ * rejected with an error when a route's queue is full.
+ *
+ * Queue depth, time spent queued and service time are reported for each
+ * route. Two routes are set up: "lookup", which simulates a slow lookup,
+ * and "echo", which responds immediately. A client session sends requests
+ * to both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'w', "workers", "Number of worker threads", ARG_OPTIONAL, ARG_HAS_VALUE, "8"},
+        {'l', "lookup_limit", "Maximum concurrent requests on the lookup path", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'m', "lookup_ms", "Time taken by each lookup, in milliseconds", ARG_OPTIONAL, ARG_HAS_VALUE, "20"},
+        {'q', "queue", "Maximum requests queued on each path", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'r', "rate", "Requests per second sent to each path", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'s', "seconds", "Number of seconds to run for", ARG_OPTIONAL, ARG_HAS_VALUE, "30"},
+        END_OF_ARG_OPTS
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * The work done for a request on a route. Returns the response, which the
+ * caller frees, or NULL if the request failed.
+ */
+typedef char *(*REQUEST_WORK_T)(const char *request, void *context);
+
+
+typedef struct pooled_request_s {
+        char *request;
+        DIFFUSION_RESPONDER_HANDLE_T *handle;
+        int64_t received_ns;
+        struct pooled_request_s *next;
+} POOLED_REQUEST_T;
+
+
+#define MAX_SAMPLES 100000
+
+typedef struct route_s {
+        const char *path;
+        REQUEST_WORK_T work;
+        void *work_context;
+        int max_concurrency;
+        long max_queued;
+
+        // Protected by the pool lock.
+        POOLED_REQUEST_T *head;
+        POOLED_REQUEST_T *tail;
+        long queued;
+        int active;
+
+        long received;
+        long completed;
+        long failed;
+        long rejected;
+        long max_queue_depth;
+        uint32_t wait_us[MAX_SAMPLES];
+        uint32_t service_us[MAX_SAMPLES];
+        long sample_count;
+} ROUTE_T;
+
+
+typedef struct responder_pool_s {
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        SESSION_T *session;
+        ROUTE_T **routes;
+        int route_count;
+        int next_route;
+        bool stopping;
+        pthread_t *workers;
+        int worker_count;
+} RESPONDER_POOL_T;
+
+
+/*
+ * Takes the next request from a route that is below its concurrency
+ * limit, visiting routes in turn so that a busy route can't starve the
+ * others. Called with the lock held.
+ */
+static POOLED_REQUEST_T *take_request(RESPONDER_POOL_T *pool, ROUTE_T **route)
+{
+        for(int i = 0; i < pool->route_count; i++) {
+                ROUTE_T *candidate = pool->routes[(pool->next_route + i) % pool->route_count];
+                if(candidate->head != NULL && candidate->active < candidate->max_concurrency) {
+                        POOLED_REQUEST_T *request = candidate->head;
+                        candidate->head = request->next;
+                        if(candidate->head == NULL) {
+                                candidate->tail = NULL;
+                        }
+                        candidate->queued--;
+                        candidate->active++;
+                        pool->next_route = (pool->next_route + i + 1) % pool->route_count;
+                        *route = candidate;
+                        return request;
+                }
+        }
+        return NULL;
+}
+
+
+static void *worker_run(void *arg)
+{
+        RESPONDER_POOL_T *pool = arg;
+
+        pthread_mutex_lock(&pool->lock);
+        for(;;) {
+                ROUTE_T *route = NULL;
+                POOLED_REQUEST_T *request = take_request(pool, &route);
+                if(request == NULL) {
+                        if(pool->stopping) {
+                                break;
+                        }
+                        pthread_cond_wait(&pool->ready, &pool->lock);
+                        continue;
+                }
+                pthread_mutex_unlock(&pool->lock);
+
+                const int64_t start_ns = monotonic_ns();
+                char *response = route->work(request->request, route->work_context);
+                const bool succeeded = response != NULL;
+
+                if(succeeded) {
+                        BUF_T *response_buf = buf_create();
+                        write_diffusion_string_value(response, response_buf);
+                        diffusion_respond_to_request(pool->session, request->handle, response_buf, NULL);
+                        buf_free(response_buf);
+                        free(response);
+                }
+                else {
+                        diffusion_respond_to_request_with_error(pool->session, request->handle, "Request failed", NULL);
+                }
+                const int64_t end_ns = monotonic_ns();
+
+                pthread_mutex_lock(&pool->lock);
+                route->active--;
+                if(succeeded) {
+                        route->completed++;
+                }
+                else {
+                        route->failed++;
+                }
+                if(route->sample_count < MAX_SAMPLES) {
+                        route->wait_us[route->sample_count] = (uint32_t)((start_ns - request->received_ns) / 1000);
+                        route->service_us[route->sample_count] = (uint32_t)((end_ns - start_ns) / 1000);
+                        route->sample_count++;
+                }
+                // A slot has freed up on this route.
+                if(route->head != NULL) {
+                        pthread_cond_signal(&pool->ready);
+                }
+
+                diffusion_responder_handle_free(request->handle);
+                free(request->request);
+                free(request);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+
+static int
+on_pooled_request(SESSION_T *session, DIFFUSION_DATATYPE request_datatype, const DIFFUSION_VALUE_T *request,
+                  const DIFFUSION_REQUEST_CONTEXT_T *request_context, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
+{
+        RESPONDER_POOL_T *pool = session->user_context;
+        ROUTE_T *route = context;
+
+        // The request and handle are only valid during this callback.
+        POOLED_REQUEST_T *pooled = calloc(1, sizeof(POOLED_REQUEST_T));
+        read_diffusion_string_value(request, &pooled->request, NULL);
+        pooled->received_ns = monotonic_ns();
+
+        pthread_mutex_lock(&pool->lock);
+        route->received++;
+        if(route->queued >= route->max_queued) {
+                route->rejected++;
+                pthread_mutex_unlock(&pool->lock);
+                diffusion_respond_to_request_with_error(session, handle, "Too many requests", NULL);
+                free(pooled->request);
+                free(pooled);
+                return HANDLER_SUCCESS;
+        }
+
+        pooled->handle = diffusion_responder_handle_dup(handle);
+        if(route->tail != NULL) {
+                route->tail->next = pooled;
+        }
+        else {
+                route->head = pooled;
+        }
+        route->tail = pooled;
+        route->queued++;
+        if(route->queued > route->max_queue_depth) {
+                route->max_queue_depth = route->queued;
+        }
+        if(route->active < route->max_concurrency) {
+                pthread_cond_signal(&pool->ready);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static void responder_pool_start(RESPONDER_POOL_T *pool, SESSION_T *session, int worker_count)
+{
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->ready, NULL);
+        pool->session = session;
+        session->user_context = pool;
+        pool->worker_count = worker_count;
+        pool->workers = calloc(worker_count, sizeof(pthread_t));
+        for(int i = 0; i < worker_count; i++) {
+                pthread_create(&pool->workers[i], NULL, worker_run, pool);
+        }
+}
+
+
+static void responder_pool_add_route(RESPONDER_POOL_T *pool, ROUTE_T *route)
+{
+        pthread_mutex_lock(&pool->lock);
+        pool->routes = realloc(pool->routes, (pool->route_count + 1) * sizeof(ROUTE_T *));
+        pool->routes[pool->route_count++] = route;
+        pthread_mutex_unlock(&pool->lock);
+
+        static DIFFUSION_REQUEST_HANDLER_T request_handler = {
+                .request_datatype = DATATYPE_STRING,
+                .response_datatype = DATATYPE_STRING,
+                .on_request = on_pooled_request
+        };
+
+        ADD_REQUEST_HANDLER_PARAMS_T request_handler_params = {
+                .path = route->path,
+                .request_handler = &request_handler,
+                .context = route
+        };
+
+        add_request_handler(pool->session, request_handler_params);
+}
+
+
+// Finishes the queued requests, then stops the workers.
+static void responder_pool_stop(RESPONDER_POOL_T *pool)
+{
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+
+        for(int i = 0; i < pool->worker_count; i++) {
+                pthread_join(pool->workers[i], NULL);
+        }
+        free(pool->workers);
+}
+
+
+static void responder_pool_free(RESPONDER_POOL_T *pool)
+{
+        free(pool->routes);
+        pthread_cond_destroy(&pool->ready);
+        pthread_mutex_destroy(&pool->lock);
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+static void report(RESPONDER_POOL_T *pool)
+{
+        pthread_mutex_lock(&pool->lock);
+        for(int i = 0; i < pool->route_count; i++) {
+                ROUTE_T *route = pool->routes[i];
+                printf("%-8s received %ld, completed %ld, failed %ld, rejected %ld, queued %ld (max %ld), active %d/%d\n",
+                       route->path, route->received, route->completed, route->failed, route->rejected,
+                       route->queued, route->max_queue_depth, route->active, route->max_concurrency);
+
+                const long count = route->sample_count;
+                if(count > 0) {
+                        qsort(route->wait_us, count, sizeof(uint32_t), compare_latencies);
+                        qsort(route->service_us, count, sizeof(uint32_t), compare_latencies);
+                        printf("         queued (us): p50 %u, p99 %u, max %u; service (us): p50 %u, p99 %u, max %u\n",
+                               percentile(route->wait_us, count, 50),
+                               percentile(route->wait_us, count, 99),
+                               route->wait_us[count - 1],
+                               percentile(route->service_us, count, 50),
+                               percentile(route->service_us, count, 99),
+                               route->service_us[count - 1]);
+                }
+                route->sample_count = 0;
+                route->max_queue_depth = route->queued;
+        }
+        pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Work functions for the example routes.
+ */
+static char *lookup_work(const char *request, void *context)
+{
+        const long lookup_ms = *(long *)context;
+        const struct timespec delay = { lookup_ms / 1000, (lookup_ms % 1000) * 1000000 };
+        nanosleep(&delay, NULL);
+
+        char *response = malloc(strlen(request) + 16);
+        sprintf(response, "value of %s", request);
+        return response;
+}
+
+
+static char *echo_work(const char *request, void *context)
+{
+        return strdup(request);
+}
+
+
+static int
+on_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
+{
+        return HANDLER_SUCCESS;
+}
+
+
+static int
+on_response_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        return HANDLER_SUCCESS;
+}
+
+
+int
+main(int argc, char **argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        char *url = hash_get(options, "url");
+
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        const int worker_count = atoi(hash_get(options, "workers"));
+        const int lookup_limit = atoi(hash_get(options, "lookup_limit"));
+        long lookup_ms = atol(hash_get(options, "lookup_ms"));
+        const long max_queued = atol(hash_get(options, "queue"));
+        const long rate = atol(hash_get(options, "rate"));
+        const long seconds = atol(hash_get(options, "seconds"));
+
+        if(worker_count < 1 || lookup_limit < 1 || rate < 1) {
+                fprintf(stderr, "workers, lookup_limit and rate must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Create 2 sessions with Diffusion.
+         */
+        SESSION_T *session = NULL;
+        SESSION_T *handler = NULL;
+
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        handler = session_create(url, "admin", credentials, NULL, NULL, &error);
+        if(handler == NULL) {
+                fprintf(stderr, "TEST: Failed to create handler session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Start the pool and register the routes.
+         */
+        RESPONDER_POOL_T pool = { 0 };
+        responder_pool_start(&pool, handler, worker_count);
+
+        ROUTE_T *lookup = calloc(1, sizeof(ROUTE_T));
+        lookup->path = "lookup";
+        lookup->work = lookup_work;
+        lookup->work_context = &lookup_ms;
+        lookup->max_concurrency = lookup_limit;
+        lookup->max_queued = max_queued;
+        responder_pool_add_route(&pool, lookup);
+
+        ROUTE_T *echo = calloc(1, sizeof(ROUTE_T));
+        echo->path = "echo";
+        echo->work = echo_work;
+        echo->max_concurrency = worker_count;
+        echo->max_queued = max_queued;
+        responder_pool_add_route(&pool, echo);
+
+        sleep(1);
+
+        /*
+         * Send requests to both routes, reporting once a second.
+         */
+        BUF_T *request = buf_create();
+        write_diffusion_string_value("key", request);
+
+        SEND_REQUEST_PARAMS_T send_request_params = {
+                .request = request,
+                .on_response = on_response,
+                .on_error = on_response_error,
+                .request_datatype = DATATYPE_STRING,
+                .response_datatype = DATATYPE_STRING
+        };
+
+        // Pace against a deadline, so time spent sending isn't added to
+        // each interval.
+        const int64_t interval_ns = 1000000000LL / rate;
+        const int64_t start_ns = monotonic_ns();
+        long sent = 0;
+        for(long second = 0; second < seconds; second++) {
+                for(long i = 0; i < rate; i++) {
+                        send_request_params.path = "lookup";
+                        send_request(session, send_request_params);
+                        send_request_params.path = "echo";
+                        send_request(session, send_request_params);
+
+                        const int64_t due_ns = start_ns + ++sent * interval_ns;
+                        const struct timespec due = {
+                                due_ns / 1000000000LL,
+                                due_ns % 1000000000LL
+                        };
+                        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+                }
+                report(&pool);
+        }
+
+        session_close(session, NULL);
+        session_free(session);
+
+        responder_pool_stop(&pool);
+        report(&pool);
+        responder_pool_free(&pool);
+
+        session_close(handler, NULL);
+        session_free(handler);
+
+        free(lookup);
+        free(echo);
+        buf_free(request);
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,457 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example generates request/response load against a request path
+ * and reports the round trip latency.
+ *
+ * A number of requester threads, each with its own session, send requests
+ * of a given size at a fixed combined rate. Requests are sent on schedule
+ * whether or not earlier responses have arrived, and latency is measured
+ * from the time each request was due to be sent, so a slow responder
+ * shows up in the latencies rather than silently lowering the rate.
+ * Responses that take longer than the timeout are counted as timeouts.
+ *
+ * The responder echoes each request back. It runs in this process by
+ * default; use --mode responder and --mode requester to run it and the
+ * requesters as separate processes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "request_path", "Request path", ARG_OPTIONAL, ARG_HAS_VALUE, "echo"},
+        {'m', "mode", "both, requester or responder", ARG_OPTIONAL, ARG_HAS_VALUE, "both"},
+        {'n', "requesters", "Number of concurrent requesters", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'r', "rate", "Total requests per second", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'z', "size", "Request size in bytes", ARG_OPTIONAL, ARG_HAS_VALUE, "64"},
+        {'o', "timeout", "Request timeout in milliseconds", ARG_OPTIONAL, ARG_HAS_VALUE, "5000"},
+        {'s', "seconds", "Number of seconds to send requests for", ARG_OPTIONAL, ARG_HAS_VALUE, "30"},
+        END_OF_ARG_OPTS
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * Responder.
+ */
+static int
+on_active(SESSION_T *session, const char *path, const DIFFUSION_REGISTRATION_T *registered_handler)
+{
+        printf("Request handler active on \"%s\"\n", path);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_request(SESSION_T *session,  DIFFUSION_DATATYPE request_datatype, const DIFFUSION_VALUE_T *request,
+           const DIFFUSION_REQUEST_CONTEXT_T *request_context, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
+{
+        char *request_val;
+        read_diffusion_string_value(request, &request_val, NULL);
+
+        BUF_T *response_buf = buf_create();
+        write_diffusion_string_value(request_val, response_buf);
+        diffusion_respond_to_request(session, handle, response_buf, NULL);
+
+        buf_free(response_buf);
+        free(request_val);
+
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Requesters. Each request's context is its index in the requester's
+ * table of scheduled send times.
+ */
+typedef struct requester_s {
+        pthread_t thread;
+        SESSION_T *session;
+        const char *request_path;
+        const BUF_T *request;
+        int64_t start_ns;
+        int64_t interval_ns;
+        long count;
+        int64_t *scheduled_ns;
+} REQUESTER_T;
+
+
+static struct {
+        pthread_mutex_t lock;
+        int64_t timeout_ns;
+        long sent;
+        long responses;
+        long timeouts;
+        long errors;
+        int64_t max_send_lag_ns;
+        uint32_t *latencies;
+        long latency_count;
+} g_load = {
+        .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+typedef struct response_context_s {
+        REQUESTER_T *requester;
+        long index;
+} RESPONSE_CONTEXT_T;
+
+
+static int
+on_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
+{
+        RESPONSE_CONTEXT_T *response_context = context;
+        const int64_t latency_ns = monotonic_ns() - response_context->requester->scheduled_ns[response_context->index];
+        free(response_context);
+
+        pthread_mutex_lock(&g_load.lock);
+        g_load.responses++;
+        if(latency_ns > g_load.timeout_ns) {
+                g_load.timeouts++;
+        }
+        else {
+                g_load.latencies[g_load.latency_count++] = (uint32_t)(latency_ns / 1000);
+        }
+        pthread_mutex_unlock(&g_load.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_request_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        free(error->context);
+
+        pthread_mutex_lock(&g_load.lock);
+        if(g_load.errors++ == 0) {
+                printf("Request failed: %s\n", error->message);
+        }
+        pthread_mutex_unlock(&g_load.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_request_discard(SESSION_T *session, void *context)
+{
+        free(context);
+
+        pthread_mutex_lock(&g_load.lock);
+        g_load.errors++;
+        pthread_mutex_unlock(&g_load.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static void *requester_run(void *arg)
+{
+        REQUESTER_T *requester = arg;
+
+        SEND_REQUEST_PARAMS_T send_request_params = {
+                .path = requester->request_path,
+                .request = requester->request,
+                .on_response = on_response,
+                .on_error = on_request_error,
+                .on_discard = on_request_discard,
+                .request_datatype = DATATYPE_STRING,
+                .response_datatype = DATATYPE_STRING
+        };
+
+        int64_t max_lag_ns = 0;
+
+        for(long i = 0; i < requester->count; i++) {
+                const int64_t due_ns = requester->start_ns + i * requester->interval_ns;
+                const int64_t now_ns = monotonic_ns();
+                if(now_ns < due_ns) {
+                        const struct timespec due = {
+                                due_ns / 1000000000LL,
+                                due_ns % 1000000000LL
+                        };
+                        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+                }
+                else if(now_ns - due_ns > max_lag_ns) {
+                        max_lag_ns = now_ns - due_ns;
+                }
+
+                requester->scheduled_ns[i] = due_ns;
+
+                RESPONSE_CONTEXT_T *response_context = malloc(sizeof(RESPONSE_CONTEXT_T));
+                response_context->requester = requester;
+                response_context->index = i;
+                send_request_params.context = response_context;
+                send_request(requester->session, send_request_params);
+        }
+
+        pthread_mutex_lock(&g_load.lock);
+        g_load.sent += requester->count;
+        if(max_lag_ns > g_load.max_send_lag_ns) {
+                g_load.max_send_lag_ns = max_lag_ns;
+        }
+        pthread_mutex_unlock(&g_load.lock);
+
+        return NULL;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+int
+main(int argc, char **argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        char *url = hash_get(options, "url");
+
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        char *request_path = hash_get(options, "request_path");
+        const char *mode = hash_get(options, "mode");
+        const int requester_count = atoi(hash_get(options, "requesters"));
+        const double rate = atof(hash_get(options, "rate"));
+        const long size = atol(hash_get(options, "size"));
+        const long timeout_ms = atol(hash_get(options, "timeout"));
+        const long seconds = atol(hash_get(options, "seconds"));
+
+        const bool run_responder = strcmp(mode, "both") == 0 || strcmp(mode, "responder") == 0;
+        const bool run_requesters = strcmp(mode, "both") == 0 || strcmp(mode, "requester") == 0;
+
+        if(!run_responder && !run_requesters) {
+                fprintf(stderr, "Unknown mode \"%s\"\n", mode);
+                return EXIT_FAILURE;
+        }
+        if(requester_count < 1 || rate <= 0 || size < 0 || seconds < 1) {
+                fprintf(stderr, "requesters, rate and seconds must be positive\n");
+                return EXIT_FAILURE;
+        }
+
+        DIFFUSION_ERROR_T error = { 0 };
+
+        /*
+         * Register the responder.
+         */
+        SESSION_T *handler = NULL;
+        DIFFUSION_REQUEST_HANDLER_T request_handler = {
+                .request_datatype = DATATYPE_STRING,
+                .response_datatype = DATATYPE_STRING,
+                .on_active = on_active,
+                .on_request = on_request
+        };
+
+        if(run_responder) {
+                handler = session_create(url, "admin", credentials, NULL, NULL, &error);
+                if(handler == NULL) {
+                        fprintf(stderr, "TEST: Failed to create handler session\n");
+                        fprintf(stderr, "ERR : %s\n", error.message);
+                        return EXIT_FAILURE;
+                }
+
+                ADD_REQUEST_HANDLER_PARAMS_T request_handler_params = {
+                        .path = request_path,
+                        .request_handler = &request_handler
+                };
+
+                add_request_handler(handler, request_handler_params);
+        }
+
+        if(!run_requesters) {
+                printf("Responding to requests on \"%s\" for %ld seconds\n", request_path, seconds);
+                sleep(seconds);
+        }
+        else {
+                /*
+                 * Create the request payload, shared by all requesters.
+                 */
+                char *request_data = malloc(size + 1);
+                memset(request_data, 'x', size);
+                request_data[size] = '\0';
+
+                BUF_T *request = buf_create();
+                write_diffusion_string_value(request_data, request);
+                free(request_data);
+
+                const double requester_rate = rate / requester_count;
+                const long per_requester = (long)(requester_rate * seconds);
+
+                g_load.timeout_ns = timeout_ms * 1000000LL;
+                g_load.latencies = malloc((per_requester * requester_count + 1) * sizeof(uint32_t));
+
+                REQUESTER_T *requesters = calloc(requester_count, sizeof(REQUESTER_T));
+                for(int i = 0; i < requester_count; i++) {
+                        requesters[i].session = session_create(url, principal, credentials, NULL, NULL, &error);
+                        if(requesters[i].session == NULL) {
+                                fprintf(stderr, "TEST: Failed to create session\n");
+                                fprintf(stderr, "ERR : %s\n", error.message);
+                                return EXIT_FAILURE;
+                        }
+                        requesters[i].request_path = request_path;
+                        requesters[i].request = request;
+                        requesters[i].interval_ns = (int64_t)(1e9 / requester_rate);
+                        requesters[i].count = per_requester;
+                        requesters[i].scheduled_ns = calloc(per_requester + 1, sizeof(int64_t));
+                }
+
+                // Give the responder a moment to register.
+                sleep(1);
+
+                printf("Sending %ld byte requests to \"%s\" at %.0f/s from %d requesters for %ld seconds\n",
+                       size, request_path, rate, requester_count, seconds);
+
+                const int64_t start_ns = monotonic_ns();
+                for(int i = 0; i < requester_count; i++) {
+                        // Stagger the requesters across one interval.
+                        requesters[i].start_ns = start_ns + i * requesters[i].interval_ns / requester_count;
+                        pthread_create(&requesters[i].thread, NULL, requester_run, &requesters[i]);
+                }
+                for(int i = 0; i < requester_count; i++) {
+                        pthread_join(requesters[i].thread, NULL);
+                }
+                const int64_t send_end_ns = monotonic_ns();
+
+                /*
+                 * Wait for outstanding responses, up to the timeout.
+                 */
+                for(;;) {
+                        pthread_mutex_lock(&g_load.lock);
+                        const long outstanding = g_load.sent - g_load.responses - g_load.errors;
+                        pthread_mutex_unlock(&g_load.lock);
+                        if(outstanding <= 0 || monotonic_ns() - send_end_ns > g_load.timeout_ns) {
+                                break;
+                        }
+                        const struct timespec poll = { 0, 10000000 };
+                        nanosleep(&poll, NULL);
+                }
+                const double send_seconds = (send_end_ns - start_ns) / 1e9;
+                const double elapsed = (monotonic_ns() - start_ns) / 1e9;
+
+                /*
+                 * Take the counts before closing the sessions, which
+                 * discards the requests still unanswered; those are
+                 * timeouts, not errors.
+                 */
+                pthread_mutex_lock(&g_load.lock);
+                const long sent = g_load.sent;
+                const long responses = g_load.responses;
+                const long timeouts = g_load.timeouts;
+                const long errors = g_load.errors;
+                const long count = g_load.latency_count;
+                pthread_mutex_unlock(&g_load.lock);
+
+                for(int i = 0; i < requester_count; i++) {
+                        session_close(requesters[i].session, NULL);
+                        session_free(requesters[i].session);
+                }
+
+                /*
+                 * Report.
+                 */
+                pthread_mutex_lock(&g_load.lock);
+                const long unanswered = sent - responses - errors;
+                qsort(g_load.latencies, count, sizeof(uint32_t), compare_latencies);
+
+                printf("sent %ld, responses %ld, timeouts %ld, errors %ld\n",
+                       sent, responses - timeouts, timeouts + unanswered, errors);
+                printf("%.0f requests/sec sent, %.0f responses/sec within timeout, max send lag %.3fms\n",
+                       sent / send_seconds, count / elapsed, g_load.max_send_lag_ns / 1e6);
+                if(count > 0) {
+                        printf("round trip (us): p50 %u, p99 %u, p99.9 %u, max %u\n",
+                               percentile(g_load.latencies, count, 50),
+                               percentile(g_load.latencies, count, 99),
+                               percentile(g_load.latencies, count, 99.9),
+                               g_load.latencies[count - 1]);
+                }
+                pthread_mutex_unlock(&g_load.lock);
+
+                for(int i = 0; i < requester_count; i++) {
+                        free(requesters[i].scheduled_ns);
+                }
+                free(requesters);
+                free(g_load.latencies);
+                buf_free(request);
+        }
+
+        if(handler != NULL) {
+                session_close(handler, NULL);
+                session_free(handler);
+        }
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
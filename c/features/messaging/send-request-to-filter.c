@@ -21,9 +21,22 @@
 /*
  * This example shows how a request can be sent through a filter to distribute to
  * all clients matching the filter.
+ *
+ * The responses are gathered by a scatter-gather helper. It collects them
+ * into a preallocated array until the number of sessions the request was
+ * sent to have responded or a deadline passes, whichever is first, then
+ * calls a completion callback once with everything collected. Responses
+ * arriving after that are counted as stragglers. The time for each
+ * response to arrive is recorded so the fan-out latency distribution can
+ * be reported.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -44,42 +57,271 @@ ARG_OPTS_T arg_opts[] = {
         {'t', "request_path", "Request path", ARG_REQUIRED, ARG_HAS_VALUE, "echo"},
         {'d', "request", "Request to send", ARG_REQUIRED, ARG_HAS_VALUE, "hello client request!"},
         {'r', "response", "Response to send", ARG_REQUIRED, ARG_HAS_VALUE, "hello client response!"},
+        {'n', "clients", "Number of client sessions to respond to requests", ARG_OPTIONAL, ARG_HAS_VALUE, "1"},
+        {'D', "deadline", "Milliseconds to wait for responses to each request", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'m', "max_responses", "Maximum number of responses gathered for each request", ARG_OPTIONAL, ARG_HAS_VALUE, "10000"},
         END_OF_ARG_OPTS
 };
 
-static int on_number_sent(int number_sent, void *context)
+
+static int64_t monotonic_ns(void)
 {
-        printf("Requests sent: %d\n", number_sent);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * Scatter-gather.
+ */
+typedef struct gathered_response_s {
+        char *value;
+        uint32_t latency_us;
+} GATHERED_RESPONSE_T;
+
+typedef struct scatter_gather_s SCATTER_GATHER_T;
+
+typedef void (*ON_GATHERED_T)(const SCATTER_GATHER_T *gather, void *context);
+
+struct scatter_gather_s {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        int64_t sent_ns;
+        int64_t deadline_ns;
+
+        // The number of sessions the request was sent to, once known.
+        int expected;
+        bool expected_known;
+
+        GATHERED_RESPONSE_T *responses;
+        int capacity;
+        int count;
+        int errors;
+        int stragglers;
+        bool timed_out;
+        bool completed;
+
+        ON_GATHERED_T on_gathered;
+        void *context;
+};
+
+
+static SCATTER_GATHER_T *scatter_gather_create(int capacity, ON_GATHERED_T on_gathered, void *context)
+{
+        SCATTER_GATHER_T *gather = calloc(1, sizeof(SCATTER_GATHER_T));
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&gather->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&gather->lock, NULL);
+
+        gather->responses = calloc(capacity, sizeof(GATHERED_RESPONSE_T));
+        gather->capacity = capacity;
+        gather->on_gathered = on_gathered;
+        gather->context = context;
+        return gather;
+}
+
+
+static void scatter_gather_free(SCATTER_GATHER_T *gather)
+{
+        for(int i = 0; i < gather->count; i++) {
+                free(gather->responses[i].value);
+        }
+        free(gather->responses);
+        pthread_cond_destroy(&gather->cond);
+        pthread_mutex_destroy(&gather->lock);
+        free(gather);
+}
+
+
+/*
+ * Completes the gather if everything expected has arrived. Called with
+ * the lock held; the completion callback is called without it.
+ */
+static void scatter_gather_check(SCATTER_GATHER_T *gather)
+{
+        if(gather->completed) {
+                return;
+        }
+        const bool all_arrived = gather->expected_known
+                && gather->count + gather->errors >= gather->expected;
+        const bool full = gather->count == gather->capacity;
+        if(!all_arrived && !full && !gather->timed_out) {
+                return;
+        }
+
+        gather->completed = true;
+        pthread_cond_broadcast(&gather->cond);
+
+        pthread_mutex_unlock(&gather->lock);
+        gather->on_gathered(gather, gather->context);
+        pthread_mutex_lock(&gather->lock);
+}
+
+
+static int on_gather_number_sent(int number_sent, void *context)
+{
+        SCATTER_GATHER_T *gather = context;
+
+        pthread_mutex_lock(&gather->lock);
+        gather->expected = number_sent;
+        gather->expected_known = true;
+        scatter_gather_check(gather);
+        pthread_mutex_unlock(&gather->lock);
+
         return HANDLER_SUCCESS;
 }
 
+
 static int
-on_request(SESSION_T *session, const char *request_path, DIFFUSION_DATATYPE request_datatype,
-           const DIFFUSION_VALUE_T *request, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
+on_gather_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
 {
+        SCATTER_GATHER_T *gather = context;
+        const int64_t received_ns = monotonic_ns();
 
-        char *request_val;
-        read_diffusion_string_value(request, &request_val, NULL);
+        pthread_mutex_lock(&gather->lock);
+        if(gather->completed) {
+                gather->stragglers++;
+        }
+        else {
+                GATHERED_RESPONSE_T *gathered = &gather->responses[gather->count++];
+                read_diffusion_string_value(response, &gathered->value, NULL);
+                gathered->latency_us = (uint32_t)((received_ns - gather->sent_ns) / 1000);
+                scatter_gather_check(gather);
+        }
+        pthread_mutex_unlock(&gather->lock);
 
-        printf("Request received: %s\n", request_val);
-        free(request_val);
+        return HANDLER_SUCCESS;
+}
 
-        BUF_T *response_buf = buf_create();
-        write_diffusion_string_value(response, response_buf);
-        diffusion_respond_to_request(session, handle, response_buf, NULL);
 
-        buf_free(response_buf);
+static int
+on_gather_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        SCATTER_GATHER_T *gather = error->context;
+
+        pthread_mutex_lock(&gather->lock);
+        gather->errors++;
+        if(!gather->expected_known) {
+                // The request couldn't be sent at all.
+                gather->expected = 0;
+                gather->expected_known = true;
+        }
+        scatter_gather_check(gather);
+        pthread_mutex_unlock(&gather->lock);
 
         return HANDLER_SUCCESS;
 }
 
+
+/*
+ * Sends a request to the sessions matching a filter. The gather's
+ * completion callback is called once, when every session has responded,
+ * or the array of responses is full, or deadline_ms has passed.
+ */
+static void scatter_gather_send(
+        SESSION_T *session,
+        SEND_REQUEST_TO_FILTER_PARAMS_T params,
+        SCATTER_GATHER_T *gather,
+        long deadline_ms)
+{
+        gather->sent_ns = monotonic_ns();
+        gather->deadline_ns = gather->sent_ns + deadline_ms * 1000000LL;
+
+        params.on_response = on_gather_response;
+        params.on_number_sent = on_gather_number_sent;
+        params.on_error = on_gather_error;
+        params.context = gather;
+
+        send_request_to_filter(session, params);
+}
+
+
+// Waits for the gather to complete, completing it at the deadline.
+static void scatter_gather_await(SCATTER_GATHER_T *gather)
+{
+        const struct timespec deadline = {
+                gather->deadline_ns / 1000000000LL,
+                gather->deadline_ns % 1000000000LL
+        };
+
+        pthread_mutex_lock(&gather->lock);
+        while(!gather->completed) {
+                if(pthread_cond_timedwait(&gather->cond, &gather->lock, &deadline) != 0
+                   && !gather->completed) {
+                        gather->timed_out = true;
+                        scatter_gather_check(gather);
+                }
+        }
+        pthread_mutex_unlock(&gather->lock);
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+/*
+ * Completion callback for the example, reporting on each gather. The
+ * context is the number of the request.
+ */
+static void on_gathered(const SCATTER_GATHER_T *gather, void *context)
+{
+        const int count = gather->count;
+        const double elapsed_ms = (monotonic_ns() - gather->sent_ns) / 1e6;
+
+        printf("Request #%d: %d of %d responses, %d errors in %.1fms%s\n",
+               (int)(intptr_t)context, count, gather->expected_known ? gather->expected : -1,
+               gather->errors, elapsed_ms, gather->timed_out ? " (deadline passed)" : "");
+
+        if(count > 0) {
+                uint32_t *latencies = malloc(count * sizeof(uint32_t));
+                for(int i = 0; i < count; i++) {
+                        latencies[i] = gather->responses[i].latency_us;
+                }
+                qsort(latencies, count, sizeof(uint32_t), compare_latencies);
+                printf("  response latency (us): p50 %u, p90 %u, p99 %u, max %u\n",
+                       percentile(latencies, count, 50),
+                       percentile(latencies, count, 90),
+                       percentile(latencies, count, 99),
+                       latencies[count - 1]);
+                free(latencies);
+        }
+}
+
+
 static int
-on_response(DIFFUSION_DATATYPE response_datatype, const DIFFUSION_VALUE_T *response, void *context)
+on_request(SESSION_T *session, const char *request_path, DIFFUSION_DATATYPE request_datatype,
+           const DIFFUSION_VALUE_T *request, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
 {
-        char *response_val;
-        read_diffusion_string_value(response, &response_val, NULL);
-        printf("Response received: %s\n\n", response_val);
-        free(response_val);
+        BUF_T *response_buf = buf_create();
+        write_diffusion_string_value(response, response_buf);
+        diffusion_respond_to_request(session, handle, response_buf, NULL);
+
+        buf_free(response_buf);
 
         return HANDLER_SUCCESS;
 }
@@ -107,19 +349,29 @@ main(int argc, char **argv)
         }
 
         char *request_path = hash_get(options, "request_path");
+        const int client_count = atoi(hash_get(options, "clients"));
+        const long deadline_ms = atol(hash_get(options, "deadline"));
+        const int max_responses = atoi(hash_get(options, "max_responses"));
+
+        if(client_count < 1 || max_responses < 1) {
+                fprintf(stderr, "clients and max_responses must be at least 1\n");
+                return EXIT_FAILURE;
+        }
 
         /*
-         * Create 2 sessions with Diffusion.
+         * Create the client sessions and the sender session with Diffusion.
          */
-        SESSION_T *client = NULL;
+        SESSION_T **clients = calloc(client_count, sizeof(SESSION_T *));
         SESSION_T *sender = NULL;
 
         DIFFUSION_ERROR_T error = { 0 };
-        client = session_create(url, principal, credentials, NULL, NULL, &error);
-        if(client == NULL) {
-                fprintf(stderr, "TEST: Failed to create session\n");
-                fprintf(stderr, "ERR : %s\n", error.message);
-                return EXIT_FAILURE;
+        for(int i = 0; i < client_count; i++) {
+                clients[i] = session_create(url, principal, credentials, NULL, NULL, &error);
+                if(clients[i] == NULL) {
+                        fprintf(stderr, "TEST: Failed to create session\n");
+                        fprintf(stderr, "ERR : %s\n", error.message);
+                        return EXIT_FAILURE;
+                }
         }
 
         sender = session_create(url, "admin", credentials, NULL, NULL, &error);
@@ -143,7 +395,9 @@ main(int argc, char **argv)
                 .on_request = on_request
         };
 
-        set_request_stream(client, request_path, DATATYPE_STRING, DATATYPE_STRING, &request_stream);
+        for(int i = 0; i < client_count; i++) {
+                set_request_stream(clients[i], request_path, DATATYPE_STRING, DATATYPE_STRING, &request_stream);
+        }
 
         /*
          * Send to all non admin principal clients.
@@ -153,29 +407,46 @@ main(int argc, char **argv)
                 .filter = "$Principal NE 'admin'",
                 .request_datatype = DATATYPE_STRING,
                 .response_datatype = DATATYPE_STRING,
-                .on_response = on_response,
-                .on_number_sent = on_number_sent,
                 .request = request,
         };
 
+        /*
+         * Gathers are kept until the end, as stragglers can still arrive
+         * after a gather has completed.
+         */
+        SCATTER_GATHER_T *gathers[120];
         int counter = 1;
 
         while (counter <= 120) {
                 printf("Sending filter request to path {%s}.. #%d\n", request_path, counter);
-                send_request_to_filter(sender, params);
+                SCATTER_GATHER_T *gather = scatter_gather_create(max_responses, on_gathered, (void *)(intptr_t)counter);
+                gathers[counter - 1] = gather;
+
+                scatter_gather_send(sender, params, gather, deadline_ms);
+                scatter_gather_await(gather);
                 sleep(1);
                 ++counter;
         }
 
-        session_close(client, NULL);
-        session_free(client);
+        for(int i = 0; i < client_count; i++) {
+                session_close(clients[i], NULL);
+                session_free(clients[i]);
+        }
+        free(clients);
 
         session_close(sender, NULL);
         session_free(sender);
 
+        int stragglers = 0;
+        for(int i = 0; i < counter - 1; i++) {
+                stragglers += gathers[i]->stragglers;
+                scatter_gather_free(gathers[i]);
+        }
+        printf("%d responses arrived after their request was complete\n", stragglers);
+
         buf_free(request);
         credentials_free(credentials);
         hash_free(options, NULL, free);
 
         return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
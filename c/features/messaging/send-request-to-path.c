@@ -21,9 +21,22 @@
 /*
  * This example shows how a request can be sent to a request handler via
  * a request path endpoint.
+ *
+ * The request handler can optionally use a response cache. Responses are
+ * cached against the request path and the bytes of the request for a
+ * time to live, with the least recently used responses evicted when the
+ * cache is full. A repeated request is answered from the cache without
+ * calling the handler. While a response is being produced, identical
+ * requests wait for it rather than producing it again, and are all
+ * answered together when it's ready.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -35,6 +48,7 @@
 #include "args.h"
 
 char *response;
+long work_ms;
 
 ARG_OPTS_T arg_opts[] = {
         ARG_OPTS_HELP,
@@ -44,9 +58,326 @@ ARG_OPTS_T arg_opts[] = {
         {'t', "request_path", "Request path", ARG_REQUIRED, ARG_HAS_VALUE, "echo"},
         {'d', "request", "Request to send", ARG_REQUIRED, ARG_HAS_VALUE, "hello client request!"},
         {'r', "response", "Response to send", ARG_REQUIRED, ARG_HAS_VALUE, "hello client response!"},
+        {'T', "cache_ttl", "Milliseconds to cache responses for, 0 to disable the cache", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'S', "cache_size", "Maximum number of cached responses", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'w', "work_ms", "Milliseconds taken to produce each response", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'n', "repeat", "Number of times each request is sent", ARG_OPTIONAL, ARG_HAS_VALUE, "1"},
         END_OF_ARG_OPTS
 };
 
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * Response cache. Entries are found through a hash table and, once they
+ * have a response, kept in a list in order of use for eviction. Entries
+ * still waiting for a response hold the handles of every request waiting
+ * for it, and are not evicted.
+ */
+typedef struct cached_response_s {
+        uint64_t hash;
+        char *path;
+        char *request;
+        size_t request_length;
+
+        char *response;         // NULL until the response is ready
+        int64_t expires_ns;
+
+        SESSION_T *session;
+        DIFFUSION_RESPONDER_HANDLE_T **waiters;
+        int waiter_count;
+        int waiter_capacity;
+
+        struct cached_response_s *bucket_next;
+        struct cached_response_s *newer;
+        struct cached_response_s *older;
+} CACHED_RESPONSE_T;
+
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t idle;
+        CACHED_RESPONSE_T **buckets;
+        uint32_t bucket_count;
+        long size;
+        long capacity;
+        int64_t ttl_ns;
+        CACHED_RESPONSE_T *newest;
+        CACHED_RESPONSE_T *oldest;
+
+        // Responses being produced, each by its own thread.
+        long producing;
+
+        long hits;
+        long misses;
+        long coalesced;
+        long expired;
+        long evicted;
+} g_cache = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER
+};
+
+
+static void response_cache_init(long capacity, long ttl_ms)
+{
+        g_cache.capacity = capacity;
+        g_cache.ttl_ns = ttl_ms * 1000000LL;
+        g_cache.bucket_count = 16;
+        while(g_cache.bucket_count < capacity) {
+                g_cache.bucket_count *= 2;
+        }
+        g_cache.buckets = calloc(g_cache.bucket_count, sizeof(CACHED_RESPONSE_T *));
+}
+
+
+// FNV-1a over the path, a separator, then the request bytes.
+static uint64_t request_hash(const char *path, const char *request, size_t request_length)
+{
+        uint64_t hash = 14695981039346656037ULL;
+        for(const char *c = path; ; c++) {
+                hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+                if(*c == '\0') {
+                        break;
+                }
+        }
+        for(size_t i = 0; i < request_length; i++) {
+                hash = (hash ^ (unsigned char)request[i]) * 1099511628211ULL;
+        }
+        return hash;
+}
+
+
+static void lru_unlink(CACHED_RESPONSE_T *entry)
+{
+        if(entry->newer != NULL) {
+                entry->newer->older = entry->older;
+        }
+        else {
+                g_cache.newest = entry->older;
+        }
+        if(entry->older != NULL) {
+                entry->older->newer = entry->newer;
+        }
+        else {
+                g_cache.oldest = entry->newer;
+        }
+        entry->newer = NULL;
+        entry->older = NULL;
+}
+
+
+static void lru_push_newest(CACHED_RESPONSE_T *entry)
+{
+        entry->older = g_cache.newest;
+        if(g_cache.newest != NULL) {
+                g_cache.newest->newer = entry;
+        }
+        g_cache.newest = entry;
+        if(g_cache.oldest == NULL) {
+                g_cache.oldest = entry;
+        }
+}
+
+
+// Removes a completed entry from the cache. Called with the lock held.
+static void cache_remove(CACHED_RESPONSE_T *entry)
+{
+        CACHED_RESPONSE_T **link = &g_cache.buckets[entry->hash & (g_cache.bucket_count - 1)];
+        while(*link != entry) {
+                link = &(*link)->bucket_next;
+        }
+        *link = entry->bucket_next;
+        lru_unlink(entry);
+        g_cache.size--;
+
+        free(entry->path);
+        free(entry->request);
+        free(entry->response);
+        free(entry->waiters);
+        free(entry);
+}
+
+
+static void add_waiter(CACHED_RESPONSE_T *entry, const DIFFUSION_RESPONDER_HANDLE_T *handle)
+{
+        if(entry->waiter_count == entry->waiter_capacity) {
+                entry->waiter_capacity = entry->waiter_capacity == 0 ? 4 : entry->waiter_capacity * 2;
+                entry->waiters = realloc(entry->waiters, entry->waiter_capacity * sizeof(DIFFUSION_RESPONDER_HANDLE_T *));
+        }
+        entry->waiters[entry->waiter_count++] = diffusion_responder_handle_dup(handle);
+}
+
+
+static void respond(SESSION_T *session, const DIFFUSION_RESPONDER_HANDLE_T *handle, const char *response_val)
+{
+        BUF_T *response_buf = buf_create();
+        write_diffusion_string_value(response_val, response_buf);
+        diffusion_respond_to_request(session, handle, response_buf, NULL);
+        buf_free(response_buf);
+}
+
+
+/*
+ * Stores the response for an entry, and sends it to every request waiting
+ * for it.
+ */
+static void response_cache_complete(CACHED_RESPONSE_T *entry, const char *response_val)
+{
+        pthread_mutex_lock(&g_cache.lock);
+        entry->response = strdup(response_val);
+        entry->expires_ns = monotonic_ns() + g_cache.ttl_ns;
+
+        DIFFUSION_RESPONDER_HANDLE_T **waiters = entry->waiters;
+        const int waiter_count = entry->waiter_count;
+        entry->waiters = NULL;
+        entry->waiter_count = 0;
+        entry->waiter_capacity = 0;
+
+        g_cache.size++;
+        lru_push_newest(entry);
+        while(g_cache.size > g_cache.capacity && g_cache.oldest != entry) {
+                cache_remove(g_cache.oldest);
+                g_cache.evicted++;
+        }
+        SESSION_T *session = entry->session;
+        pthread_mutex_unlock(&g_cache.lock);
+
+        for(int i = 0; i < waiter_count; i++) {
+                respond(session, waiters[i], response_val);
+                diffusion_responder_handle_free(waiters[i]);
+        }
+        free(waiters);
+
+        // Only now may the cache and the session be freed.
+        pthread_mutex_lock(&g_cache.lock);
+        if(--g_cache.producing == 0) {
+                pthread_cond_broadcast(&g_cache.idle);
+        }
+        pthread_mutex_unlock(&g_cache.lock);
+}
+
+
+/*
+ * Produces the response for an entry. This stands in for the real work
+ * of the handler.
+ */
+static void *produce_response(void *arg)
+{
+        CACHED_RESPONSE_T *entry = arg;
+
+        if(work_ms > 0) {
+                const struct timespec delay = { work_ms / 1000, (work_ms % 1000) * 1000000 };
+                nanosleep(&delay, NULL);
+        }
+        printf("Response produced for request to {%s}\n", entry->path);
+
+        response_cache_complete(entry, response);
+        return NULL;
+}
+
+
+static int
+on_cached_request(SESSION_T *session, const char *path, const DIFFUSION_VALUE_T *request,
+                  const DIFFUSION_RESPONDER_HANDLE_T *handle)
+{
+        char *request_bytes;
+        size_t request_length;
+        if(!diffusion_value_get_raw_bytes(request, &request_bytes, &request_length)) {
+                diffusion_respond_to_request_with_error(session, handle, "Unreadable request", NULL);
+                return HANDLER_SUCCESS;
+        }
+
+        const uint64_t hash = request_hash(path, request_bytes, request_length);
+        const int64_t now_ns = monotonic_ns();
+
+        pthread_mutex_lock(&g_cache.lock);
+        CACHED_RESPONSE_T **bucket = &g_cache.buckets[hash & (g_cache.bucket_count - 1)];
+        CACHED_RESPONSE_T *entry = *bucket;
+        while(entry != NULL
+              && (entry->hash != hash
+                  || entry->request_length != request_length
+                  || strcmp(entry->path, path) != 0
+                  || memcmp(entry->request, request_bytes, request_length) != 0)) {
+                entry = entry->bucket_next;
+        }
+
+        if(entry != NULL && entry->response != NULL && entry->expires_ns <= now_ns) {
+                cache_remove(entry);
+                g_cache.expired++;
+                entry = NULL;
+        }
+
+        if(entry != NULL && entry->response != NULL) {
+                // Answer from the cache.
+                g_cache.hits++;
+                lru_unlink(entry);
+                lru_push_newest(entry);
+                char *response_val = strdup(entry->response);
+                pthread_mutex_unlock(&g_cache.lock);
+
+                respond(session, handle, response_val);
+                free(response_val);
+                free(request_bytes);
+                return HANDLER_SUCCESS;
+        }
+
+        if(entry != NULL) {
+                // The response is being produced; wait for it.
+                g_cache.coalesced++;
+                add_waiter(entry, handle);
+                pthread_mutex_unlock(&g_cache.lock);
+                free(request_bytes);
+                return HANDLER_SUCCESS;
+        }
+
+        // Produce the response, away from the callback thread.
+        g_cache.misses++;
+        entry = calloc(1, sizeof(CACHED_RESPONSE_T));
+        entry->hash = hash;
+        entry->path = strdup(path);
+        entry->request = request_bytes;
+        entry->request_length = request_length;
+        entry->session = session;
+        entry->bucket_next = *bucket;
+        *bucket = entry;
+        add_waiter(entry, handle);
+        g_cache.producing++;
+        pthread_mutex_unlock(&g_cache.lock);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, produce_response, entry);
+        pthread_detach(thread);
+
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Waits for responses still being produced, then frees the cache. Call
+ * this after the handler's session has been closed, so no more requests
+ * arrive, but before it's freed, as producers respond through it.
+ */
+static void response_cache_free(void)
+{
+        pthread_mutex_lock(&g_cache.lock);
+        while(g_cache.producing > 0) {
+                pthread_cond_wait(&g_cache.idle, &g_cache.lock);
+        }
+        while(g_cache.oldest != NULL) {
+                cache_remove(g_cache.oldest);
+        }
+        pthread_mutex_unlock(&g_cache.lock);
+        free(g_cache.buckets);
+}
+
+
 static int
 on_active(SESSION_T *session, const char *path, const DIFFUSION_REGISTRATION_T *registered_handler)
 {
@@ -58,6 +389,9 @@ static int
 on_request(SESSION_T *session,  DIFFUSION_DATATYPE request_datatype, const DIFFUSION_VALUE_T *request,
            const DIFFUSION_REQUEST_CONTEXT_T *request_context, const DIFFUSION_RESPONDER_HANDLE_T *handle, void *context)
 {
+        if(g_cache.ttl_ns > 0) {
+                return on_cached_request(session, context, request, handle);
+        }
 
         char *request_val;
         read_diffusion_string_value(request, &request_val, NULL);
@@ -113,6 +447,18 @@ main(int argc, char **argv)
         }
 
         char *request_path = hash_get(options, "request_path");
+        const long cache_ttl = atol(hash_get(options, "cache_ttl"));
+        const long cache_size = atol(hash_get(options, "cache_size"));
+        const int repeat = atoi(hash_get(options, "repeat"));
+        work_ms = atol(hash_get(options, "work_ms"));
+
+        if(cache_ttl > 0) {
+                if(cache_size < 1) {
+                        fprintf(stderr, "cache_size must be at least 1\n");
+                        return EXIT_FAILURE;
+                }
+                response_cache_init(cache_size, cache_ttl);
+        }
 
         /*
          * Create 2 sessions with Diffusion.
@@ -154,7 +500,8 @@ main(int argc, char **argv)
 
         ADD_REQUEST_HANDLER_PARAMS_T request_handler_params = {
                 .path = request_path,
-                .request_handler = &request_handler
+                .request_handler = &request_handler,
+                .context = request_path
         };
 
         add_request_handler(handler, request_handler_params);
@@ -171,7 +518,9 @@ main(int argc, char **argv)
 
         while (counter <= 120) {
                 printf("Sending request to path {%s}.. #%d\n", request_path, counter);
-                send_request(session, send_request_params);
+                for(int i = 0; i < repeat; i++) {
+                        send_request(session, send_request_params);
+                }
                 sleep(1);
                 ++counter;
         }
@@ -180,6 +529,13 @@ main(int argc, char **argv)
         session_free(session);
 
         session_close(handler, NULL);
+
+        if(cache_ttl > 0) {
+                response_cache_free();
+                printf("Response cache: %ld hits, %ld misses, %ld coalesced, %ld expired, %ld evicted\n",
+                       g_cache.hits, g_cache.misses, g_cache.coalesced, g_cache.expired, g_cache.evicted);
+        }
+
         session_free(handler);
 
         buf_free(request);
@@ -187,4 +543,4 @@ main(int argc, char **argv)
         hash_free(options, NULL, free);
 
         return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
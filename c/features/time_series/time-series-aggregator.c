@@ -0,0 +1,734 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example downsamples Time series topics on the client, maintaining
+ * open/high/low/close, volume weighted average price (VWAP), volume and
+ * event count for 1 second, 1 minute and 1 hour buckets.
+ *
+ * Each topic is subscribed to with a time series value stream, so that
+ * new events are aggregated as they arrive. The history already in the
+ * series is read once at startup with range queries of a bounded page
+ * size, and live events that arrive during this backfill are held back
+ * until it completes. Edits to existing events are counted but not
+ * applied, as buckets can't be updated to remove the original value.
+ *
+ * Event values are strings of the form "<price>,<volume>" or "<price>",
+ * in which case the volume is taken to be 1.
+ *
+ * The buckets for each topic and resolution are held in a ring buffer
+ * stored as a structure of arrays, with the slot for a bucket given by
+ * its bucket number modulo the ring size. Adding an event is a constant
+ * time update of one slot. Events up to the ring size late still update
+ * their bucket; older ones are dropped.
+ *
+ * If a publish prefix is given, each bucket is published as a JSON value
+ * to <prefix>/<topic>/<resolution> when it closes, and again if a late
+ * event changes it.
+ *
+ * The --benchmark option runs the aggregator over synthetic events without
+ * connecting to a server, to measure the cost per event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+#define RESOLUTION_COUNT 3
+
+static const int64_t RESOLUTION_MS[RESOLUTION_COUNT] = { 1000, 60 * 1000, 60 * 60 * 1000 };
+static const char *RESOLUTION_NAMES[RESOLUTION_COUNT] = { "1s", "1m", "1h" };
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "topics", "Comma separated list of time series topics to aggregate", ARG_OPTIONAL, ARG_HAS_VALUE, "ticks"},
+        {'P', "publish", "Prefix under which to publish buckets as JSON topics", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        {'r', "ring", "Number of buckets kept for each resolution", ARG_OPTIONAL, ARG_HAS_VALUE, "120"},
+        {'n', "page_size", "Number of events read by each backfill query", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'s', "seconds", "Number of seconds to run for before exiting", ARG_OPTIONAL, ARG_HAS_VALUE, "60"},
+        {'b', "benchmark", "Aggregate this many synthetic events offline and exit", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * Buckets of a single resolution, as parallel arrays indexed by ring slot.
+ * A slot whose start doesn't match the bucket being looked up is empty or
+ * belongs to an older bucket.
+ */
+typedef struct bucket_ring_s {
+        int64_t width;
+        int64_t size;
+
+        // Bucket number of the most recent bucket, or -1 if none yet.
+        int64_t latest;
+
+        int64_t *start;
+        double *open;
+        double *high;
+        double *low;
+        double *close;
+        double *price_volume;
+        double *volume;
+        uint32_t *count;
+} BUCKET_RING_T;
+
+
+typedef struct series_s SERIES_T;
+
+/*
+ * Called when a bucket closes, or when a late event changes a closed
+ * bucket.
+ */
+typedef void (*ON_BUCKET_T)(const SERIES_T *series, int resolution, const BUCKET_RING_T *ring, int64_t slot);
+
+
+/*
+ * A live event received while the series is being backfilled.
+ */
+typedef struct pending_event_s {
+        int64_t sequence;
+        int64_t timestamp;
+        double price;
+        double volume;
+} PENDING_EVENT_T;
+
+
+struct series_s {
+        char *topic_path;
+        BUCKET_RING_T rings[RESOLUTION_COUNT];
+        ON_BUCKET_T on_bucket;
+        void *context;
+        long events;
+        long late_dropped;
+
+        // Guards the fields below, and the rings, against the value
+        // stream and the backfill queries.
+        pthread_mutex_t lock;
+        int64_t next_sequence;
+        bool backfilling;
+        PENDING_EVENT_T *pending;
+        long pending_count;
+        long pending_capacity;
+        long edits_ignored;
+
+        // Number of events returned by the last backfill query.
+        int page_events;
+};
+
+
+static void bucket_ring_init(BUCKET_RING_T *ring, int64_t width, int64_t size)
+{
+        ring->width = width;
+        ring->size = size;
+        ring->latest = -1;
+        ring->start = malloc(size * sizeof(int64_t));
+        ring->open = malloc(size * sizeof(double));
+        ring->high = malloc(size * sizeof(double));
+        ring->low = malloc(size * sizeof(double));
+        ring->close = malloc(size * sizeof(double));
+        ring->price_volume = malloc(size * sizeof(double));
+        ring->volume = malloc(size * sizeof(double));
+        ring->count = malloc(size * sizeof(uint32_t));
+        for(int64_t i = 0; i < size; i++) {
+                ring->start[i] = INT64_MIN;
+                ring->count[i] = 0;
+        }
+}
+
+
+static void bucket_ring_free(BUCKET_RING_T *ring)
+{
+        free(ring->start);
+        free(ring->open);
+        free(ring->high);
+        free(ring->low);
+        free(ring->close);
+        free(ring->price_volume);
+        free(ring->volume);
+        free(ring->count);
+}
+
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+        return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+
+/*
+ * Add an event to one resolution. Returns false if the event is too late
+ * to be held in the ring.
+ */
+static bool bucket_ring_add(
+        SERIES_T *series,
+        int resolution,
+        int64_t timestamp,
+        double price,
+        double volume)
+{
+        BUCKET_RING_T *ring = &series->rings[resolution];
+        const int64_t bucket = floor_div(timestamp, ring->width);
+
+        if(ring->latest >= 0 && bucket <= ring->latest - ring->size) {
+                return false;
+        }
+
+        if(bucket > ring->latest) {
+                // The current bucket closes when a later one opens.
+                if(ring->latest >= 0 && series->on_bucket != NULL) {
+                        const int64_t slot = ring->latest % ring->size;
+                        if(ring->count[slot] > 0) {
+                                series->on_bucket(series, resolution, ring, slot);
+                        }
+                }
+                ring->latest = bucket;
+        }
+
+        const int64_t slot = ((bucket % ring->size) + ring->size) % ring->size;
+        const int64_t start = bucket * ring->width;
+        if(ring->start[slot] != start) {
+                ring->start[slot] = start;
+                ring->open[slot] = price;
+                ring->high[slot] = price;
+                ring->low[slot] = price;
+                ring->price_volume[slot] = 0;
+                ring->volume[slot] = 0;
+                ring->count[slot] = 0;
+        }
+
+        if(price > ring->high[slot]) {
+                ring->high[slot] = price;
+        }
+        if(price < ring->low[slot]) {
+                ring->low[slot] = price;
+        }
+        ring->close[slot] = price;
+        ring->price_volume[slot] += price * volume;
+        ring->volume[slot] += volume;
+        ring->count[slot]++;
+
+        // A late event changes a bucket that has already been reported.
+        if(bucket < ring->latest && series->on_bucket != NULL) {
+                series->on_bucket(series, resolution, ring, slot);
+        }
+        return true;
+}
+
+
+/*
+ * Add an event to every resolution of a series. Events are assumed to
+ * arrive in roughly timestamp order; the close of a bucket is the most
+ * recently added event within it.
+ */
+static void series_add(SERIES_T *series, int64_t timestamp, double price, double volume)
+{
+        bool dropped = false;
+        for(int r = 0; r < RESOLUTION_COUNT; r++) {
+                if(!bucket_ring_add(series, r, timestamp, price, volume)) {
+                        dropped = true;
+                }
+        }
+        series->events++;
+        if(dropped) {
+                series->late_dropped++;
+        }
+}
+
+
+static SERIES_T *series_create(const char *topic_path, int64_t ring_size, ON_BUCKET_T on_bucket, void *context)
+{
+        SERIES_T *series = calloc(1, sizeof(SERIES_T));
+        series->topic_path = strdup(topic_path);
+        series->on_bucket = on_bucket;
+        series->context = context;
+        pthread_mutex_init(&series->lock, NULL);
+        series->backfilling = true;
+        for(int r = 0; r < RESOLUTION_COUNT; r++) {
+                bucket_ring_init(&series->rings[r], RESOLUTION_MS[r], ring_size);
+        }
+        return series;
+}
+
+
+static void series_free(SERIES_T *series)
+{
+        for(int r = 0; r < RESOLUTION_COUNT; r++) {
+                bucket_ring_free(&series->rings[r]);
+        }
+        pthread_mutex_destroy(&series->lock);
+        free(series->pending);
+        free(series->topic_path);
+        free(series);
+}
+
+
+/*
+ * Publishing buckets back to the server.
+ */
+typedef struct publisher_s {
+        SESSION_T *session;
+        const char *prefix;
+        TOPIC_SPECIFICATION_T *specification;
+        long published;
+        long failed;
+} PUBLISHER_T;
+
+
+static int on_bucket_published(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        ((PUBLISHER_T *)context)->published++;
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_publish_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        PUBLISHER_T *publisher = error->context;
+        if(publisher->failed++ == 0) {
+                printf("Failed to publish bucket: %s\n", error->message);
+        }
+        return HANDLER_SUCCESS;
+}
+
+
+static void publish_bucket(const SERIES_T *series, int resolution, const BUCKET_RING_T *ring, int64_t slot)
+{
+        PUBLISHER_T *publisher = series->context;
+
+        char topic_path[512];
+        snprintf(topic_path, sizeof(topic_path), "%s/%s/%s",
+                 publisher->prefix, series->topic_path, RESOLUTION_NAMES[resolution]);
+
+        char json[512];
+        snprintf(json, sizeof(json),
+                 "{\"start\":%" PRId64 ",\"open\":%.10g,\"high\":%.10g,\"low\":%.10g,\"close\":%.10g,"
+                 "\"vwap\":%.10g,\"volume\":%.10g,\"count\":%u}",
+                 ring->start[slot], ring->open[slot], ring->high[slot], ring->low[slot], ring->close[slot],
+                 ring->volume[slot] > 0 ? ring->price_volume[slot] / ring->volume[slot] : ring->close[slot],
+                 ring->volume[slot], ring->count[slot]);
+
+        BUF_T *update_buf = buf_create();
+        write_diffusion_json_value(json, update_buf);
+
+        DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T topic_update_params = {
+                .topic_path = topic_path,
+                .specification = publisher->specification,
+                .datatype = DATATYPE_JSON,
+                .update = update_buf,
+                .on_topic_update_add_and_set = on_bucket_published,
+                .on_error = on_publish_error,
+                .context = publisher
+        };
+
+        diffusion_topic_update_add_and_set(publisher->session, topic_update_params);
+        buf_free(update_buf);
+}
+
+
+static void print_bucket(const SERIES_T *series, int resolution, const BUCKET_RING_T *ring, int64_t slot)
+{
+        printf("%s %s %" PRId64 ": O=%g H=%g L=%g C=%g VWAP=%g V=%g N=%u\n",
+               series->topic_path, RESOLUTION_NAMES[resolution], ring->start[slot],
+               ring->open[slot], ring->high[slot], ring->low[slot], ring->close[slot],
+               ring->volume[slot] > 0 ? ring->price_volume[slot] / ring->volume[slot] : ring->close[slot],
+               ring->volume[slot], ring->count[slot]);
+}
+
+
+/*
+ * Reading events from the server.
+ */
+/*
+ * Parse an event value of the form "<price>,<volume>" or "<price>".
+ */
+static bool parse_tick(const DIFFUSION_VALUE_T *value, double *price, double *volume)
+{
+        char *val;
+        if(!read_diffusion_string_value(value, &val, NULL)) {
+                return false;
+        }
+        char *end;
+        *price = strtod(val, &end);
+        *volume = *end == ',' ? strtod(end + 1, NULL) : 1.0;
+        const bool parsed = end != val;
+        free(val);
+        return parsed;
+}
+
+
+/*
+ * The sequence number of the original event that an event stands for. In
+ * the value view an edit replaces its original but keeps its own sequence
+ * number, so for an edit the original's is read from its metadata.
+ */
+static int64_t original_sequence(const DIFFUSION_TIME_SERIES_EVENT_T *event)
+{
+        if(!diffusion_time_series_event_is_edit_event(event)) {
+                return diffusion_time_series_event_get_sequence(event);
+        }
+        DIFFUSION_TIME_SERIES_EVENT_METADATA_T *original = diffusion_time_series_event_get_original_event(event);
+        const int64_t sequence = diffusion_time_series_event_metadata_get_sequence(original);
+        diffusion_time_series_event_metadata_free(original);
+        return sequence;
+}
+
+
+// Add an event not yet seen to the series. Called with the series locked.
+static void series_add_event(SERIES_T *series, int64_t sequence, int64_t timestamp, double price, double volume)
+{
+        if(sequence < series->next_sequence) {
+                return;
+        }
+        series_add(series, timestamp, price, volume);
+        series->next_sequence = sequence + 1;
+}
+
+
+/*
+ * Backfill from the history already in the series.
+ */
+static pthread_mutex_t g_query_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_query_cond = PTHREAD_COND_INITIALIZER;
+static bool g_query_done;
+static bool g_query_failed;
+
+
+static void query_complete(bool failed)
+{
+        pthread_mutex_lock(&g_query_lock);
+        g_query_done = true;
+        g_query_failed = failed;
+        pthread_cond_signal(&g_query_cond);
+        pthread_mutex_unlock(&g_query_lock);
+}
+
+
+static int on_query_result(
+        const DIFFUSION_TIME_SERIES_QUERY_RESULT_T *query_result,
+        void *context)
+{
+        SERIES_T *series = context;
+
+        LIST_T *events = diffusion_time_series_query_result_get_events(query_result);
+        const int size = list_get_size(events);
+
+        pthread_mutex_lock(&series->lock);
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TIME_SERIES_EVENT_T *event = list_get_data_indexed(events, i);
+                const int64_t sequence = original_sequence(event);
+
+                double price, volume;
+                DIFFUSION_VALUE_T *value = diffusion_time_series_event_get_value(event);
+                if(parse_tick(value, &price, &volume)) {
+                        series_add_event(series, sequence, diffusion_time_series_event_get_timestamp(event), price, volume);
+                }
+                else if(sequence >= series->next_sequence) {
+                        series->next_sequence = sequence + 1;
+                }
+                diffusion_value_free(value);
+        }
+        series->page_events = size;
+        pthread_mutex_unlock(&series->lock);
+
+        list_free(events, (void (*)(void *))diffusion_time_series_event_free);
+        query_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_query_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("time series range query error: %s\n", error->message);
+        query_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Read the history of a series a page at a time, then apply the live
+ * events that arrived meanwhile and hand over to the value stream.
+ */
+static void backfill_series(SESSION_T *session, SERIES_T *series, int page_size)
+{
+        bool failed = false;
+        do {
+                pthread_mutex_lock(&series->lock);
+                const int64_t from = series->next_sequence;
+                pthread_mutex_unlock(&series->lock);
+
+                DIFFUSION_TIME_SERIES_RANGE_QUERY_T *range_query = diffusion_time_series_range_query();
+                diffusion_time_series_range_query_from(range_query, from, NULL);
+                diffusion_time_series_range_query_next(range_query, page_size - 1, NULL);
+
+                DIFFUSION_TIME_SERIES_RANGE_QUERY_PARAMS_T params = {
+                        .topic_path = series->topic_path,
+                        .range_query = range_query,
+                        .on_query_result = on_query_result,
+                        .on_error = on_query_error,
+                        .context = series
+                };
+
+                pthread_mutex_lock(&g_query_lock);
+                g_query_done = false;
+                pthread_mutex_unlock(&g_query_lock);
+
+                diffusion_time_series_select_from(session, params, NULL);
+
+                pthread_mutex_lock(&g_query_lock);
+                while(!g_query_done) {
+                        pthread_cond_wait(&g_query_cond, &g_query_lock);
+                }
+                failed = g_query_failed;
+                pthread_mutex_unlock(&g_query_lock);
+
+                diffusion_time_series_range_query_free(range_query);
+        } while(!failed && series->page_events == page_size);
+
+        pthread_mutex_lock(&series->lock);
+        for(long i = 0; i < series->pending_count; i++) {
+                const PENDING_EVENT_T *event = &series->pending[i];
+                series_add_event(series, event->sequence, event->timestamp, event->price, event->volume);
+        }
+        free(series->pending);
+        series->pending = NULL;
+        series->pending_count = 0;
+        series->pending_capacity = 0;
+        series->backfilling = false;
+        pthread_mutex_unlock(&series->lock);
+}
+
+
+/*
+ * Live events from the value stream.
+ */
+static int on_event(
+        const char *topic_path,
+        const TOPIC_SPECIFICATION_T *specification,
+        DIFFUSION_DATATYPE datatype,
+        const DIFFUSION_VALUE_T *old_value,
+        const DIFFUSION_VALUE_T *new_value,
+        void *context)
+{
+        SERIES_T *series = context;
+
+        DIFFUSION_TIME_SERIES_EVENT_T *event;
+        if(!read_diffusion_time_series_event(new_value, &event, NULL)) {
+                return HANDLER_SUCCESS;
+        }
+
+        pthread_mutex_lock(&series->lock);
+        if(diffusion_time_series_event_is_edit_event(event)) {
+                series->edits_ignored++;
+        }
+        else {
+                const int64_t sequence = diffusion_time_series_event_get_sequence(event);
+                const int64_t timestamp = diffusion_time_series_event_get_timestamp(event);
+                double price, volume;
+                DIFFUSION_VALUE_T *value = diffusion_time_series_event_get_value(event);
+                const bool parsed = parse_tick(value, &price, &volume);
+                diffusion_value_free(value);
+
+                if(parsed && series->backfilling) {
+                        if(series->pending_count == series->pending_capacity) {
+                                series->pending_capacity = series->pending_capacity == 0 ? 256 : series->pending_capacity * 2;
+                                series->pending = realloc(series->pending, series->pending_capacity * sizeof(PENDING_EVENT_T));
+                        }
+                        series->pending[series->pending_count++] = (PENDING_EVENT_T) {
+                                .sequence = sequence,
+                                .timestamp = timestamp,
+                                .price = price,
+                                .volume = volume
+                        };
+                }
+                else if(parsed) {
+                        series_add_event(series, sequence, timestamp, price, volume);
+                }
+        }
+        pthread_mutex_unlock(&series->lock);
+
+        diffusion_time_series_event_free(event);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Aggregate synthetic ticks, ten per second with a random walk price, and
+ * report the cost per event.
+ */
+static void run_benchmark(long count, int64_t ring_size)
+{
+        SERIES_T *series = series_create("benchmark", ring_size, NULL, NULL);
+
+        int64_t timestamp = 0;
+        double price = 100.0;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(long i = 0; i < count; i++) {
+                timestamp += 100;
+                price += ((rand() % 201) - 100) / 1000.0;
+                series_add(series, timestamp, price, 1 + rand() % 100);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Aggregated %ld events in %.3f s (%.1f ns/event, %.0f events/sec)\n",
+               count, seconds, seconds * 1e9 / count, seconds > 0 ? count / seconds : 0.0);
+        for(int r = 0; r < RESOLUTION_COUNT; r++) {
+                const BUCKET_RING_T *ring = &series->rings[r];
+                print_bucket(series, r, ring, ring->latest % ring->size);
+        }
+
+        series_free(series);
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *topics = hash_get(options, "topics");
+        const char *prefix = hash_get(options, "publish");
+        const int64_t ring_size = atol(hash_get(options, "ring"));
+        const int page_size = atoi(hash_get(options, "page_size"));
+        const long seconds = atol(hash_get(options, "seconds"));
+        if(ring_size < 1) {
+                fprintf(stderr, "ring must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+        if(page_size < 1) {
+                fprintf(stderr, "page_size must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        if(hash_get(options, "benchmark") != NULL) {
+                run_benchmark(atol(hash_get(options, "benchmark")), ring_size);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // Create a session with the Diffusion server.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        PUBLISHER_T publisher = {
+                .session = session,
+                .prefix = prefix,
+                .specification = topic_specification_init(TOPIC_TYPE_JSON)
+        };
+
+        // One series per topic in the comma separated list.
+        int series_count = 0;
+        SERIES_T **series = NULL;
+        char *topic_list = strdup(topics);
+        for(char *topic = strtok(topic_list, ","); topic != NULL; topic = strtok(NULL, ",")) {
+                series = realloc(series, (series_count + 1) * sizeof(SERIES_T *));
+                series[series_count++] = series_create(topic, ring_size,
+                                                       prefix != NULL ? publish_bucket : print_bucket,
+                                                       &publisher);
+        }
+        free(topic_list);
+
+        const time_t end_time = time(NULL) + seconds;
+
+        // Subscribe to each series before backfilling it, so that no
+        // event falls between the two.
+        for(int i = 0; i < series_count; i++) {
+                VALUE_STREAM_T value_stream = {
+                        .datatype = DATATYPE_TIME_SERIES,
+                        .on_value = on_event,
+                        .user_context = series[i]
+                };
+                add_stream(session, series[i]->topic_path, &value_stream);
+
+                SUBSCRIPTION_PARAMS_T params = {
+                        .topic_selector = series[i]->topic_path
+                };
+                subscribe(session, params);
+        }
+
+        for(int i = 0; i < series_count; i++) {
+                backfill_series(session, series[i], page_size);
+        }
+
+        while(time(NULL) < end_time) {
+                sleep(1);
+        }
+
+        // Close the session before the series its streams update are freed.
+        session_close(session, NULL);
+        session_free(session);
+
+        for(int i = 0; i < series_count; i++) {
+                printf("%s: %ld events aggregated, %ld too late, %ld edits not applied\n",
+                       series[i]->topic_path, series[i]->events, series[i]->late_dropped, series[i]->edits_ignored);
+                series_free(series[i]);
+        }
+        free(series);
+        if(prefix != NULL) {
+                printf("Published %ld buckets, %ld failed\n", publisher.published, publisher.failed);
+        }
+
+        topic_specification_free(publisher.specification);
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
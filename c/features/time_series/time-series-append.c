@@ -21,10 +21,19 @@
 /*
  * This example creates a Time series topic (of String datatype) and periodically appends
  * data to it.
+ *
+ * If a count is given, the example instead appends that many values as
+ * fast as possible, keeping up to a window of appends in flight rather
+ * than waiting between them. Each acknowledgement is matched back to its
+ * request to measure the ack latency, and the append rate and latency
+ * percentiles are reported at the end.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef WIN32
         #include <unistd.h>
@@ -44,6 +53,8 @@ ARG_OPTS_T arg_opts[] = {
         {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
         {'t', "topic", "Topic name to create and update", ARG_OPTIONAL, ARG_HAS_VALUE, "time-series-append"},
         {'s', "seconds", "Number of seconds to run for before exiting", ARG_OPTIONAL, ARG_HAS_VALUE, "30"},
+        {'n', "count", "Number of values to append as fast as possible (0 appends once per second)", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        {'w', "window", "Maximum number of appends in flight when a count is given", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
         END_OF_ARG_OPTS
 };
 
@@ -110,6 +121,203 @@ static int on_error(
 }
 
 
+/*
+ * State for the bulk append mode. Each append is identified by its
+ * request number, which is passed as the context of the append and used
+ * to find the time at which it was sent. Requests are recorded in a ring
+ * of slots twice the size of the window, so the slot of a request whose
+ * acknowledgement never arrives is eventually reused; an acknowledgement
+ * is only matched if its slot still holds the same request.
+ */
+typedef struct bulk_request_s {
+        long request;
+        struct timespec sent;
+} BULK_REQUEST_T;
+
+
+typedef struct bulk_append_s {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long window;
+        long in_flight;
+        long acknowledged;
+        long failed;
+        long unmatched;
+        int64_t first_sequence;
+        int64_t last_sequence;
+
+        BULK_REQUEST_T *slots;
+        long slot_count;
+
+        // Ack latencies in microseconds, one per acknowledged append.
+        uint32_t *latencies;
+} BULK_APPEND_T;
+
+
+static BULK_APPEND_T g_bulk = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .first_sequence = -1
+};
+
+
+static int on_bulk_append(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        const long request = (long)(intptr_t)context;
+        const int64_t sequence = diffusion_time_series_event_metadata_get_sequence(event_metadata);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&g_bulk.lock);
+        BULK_REQUEST_T *slot = &g_bulk.slots[request % g_bulk.slot_count];
+        if(slot->request == request) {
+                const double latency = (now.tv_sec - slot->sent.tv_sec) * 1e6
+                        + (now.tv_nsec - slot->sent.tv_nsec) / 1e3;
+                g_bulk.latencies[g_bulk.acknowledged++] = (uint32_t)latency;
+                slot->request = -1;
+        }
+        else {
+                g_bulk.unmatched++;
+        }
+        if(g_bulk.first_sequence < 0 || sequence < g_bulk.first_sequence) {
+                g_bulk.first_sequence = sequence;
+        }
+        if(sequence > g_bulk.last_sequence) {
+                g_bulk.last_sequence = sequence;
+        }
+        g_bulk.in_flight--;
+        pthread_cond_signal(&g_bulk.cond);
+        pthread_mutex_unlock(&g_bulk.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bulk_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        pthread_mutex_lock(&g_bulk.lock);
+        if(g_bulk.failed++ == 0) {
+                printf("time series append error: %s\n", error->message);
+        }
+        g_bulk.in_flight--;
+        pthread_cond_signal(&g_bulk.cond);
+        pthread_mutex_unlock(&g_bulk.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+/*
+ * Append "count" values to the topic, keeping up to "window" appends in
+ * flight, then report the throughput and ack latency distribution.
+ */
+static void bulk_append(
+        SESSION_T *session,
+        const char *topic_name,
+        long count,
+        long window)
+{
+        g_bulk.window = window;
+        g_bulk.slot_count = 2 * window;
+        g_bulk.slots = malloc(g_bulk.slot_count * sizeof(BULK_REQUEST_T));
+        for(long i = 0; i < g_bulk.slot_count; i++) {
+                g_bulk.slots[i].request = -1;
+        }
+        g_bulk.latencies = malloc(count * sizeof(uint32_t));
+
+        char value_str[64];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(long request = 0; request < count; request++) {
+                snprintf(value_str, sizeof(value_str), "value %ld", request);
+
+                BUF_T *value = buf_create();
+                write_diffusion_string_value(value_str, value);
+
+                // Wait for space in the window, then record the send time.
+                pthread_mutex_lock(&g_bulk.lock);
+                while(g_bulk.in_flight >= g_bulk.window) {
+                        pthread_cond_wait(&g_bulk.cond, &g_bulk.lock);
+                }
+                g_bulk.in_flight++;
+                BULK_REQUEST_T *slot = &g_bulk.slots[request % g_bulk.slot_count];
+                slot->request = request;
+                clock_gettime(CLOCK_MONOTONIC, &slot->sent);
+                pthread_mutex_unlock(&g_bulk.lock);
+
+                DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
+                        .on_append = on_bulk_append,
+                        .on_error = on_bulk_error,
+                        .topic_path = topic_name,
+                        .datatype = DATATYPE_STRING,
+                        .value = value,
+                        .context = (void *)(intptr_t)request
+                };
+
+                diffusion_time_series_append(session, params, NULL);
+                buf_free(value);
+        }
+
+        // Wait for the outstanding appends to be acknowledged.
+        pthread_mutex_lock(&g_bulk.lock);
+        while(g_bulk.in_flight > 0) {
+                pthread_cond_wait(&g_bulk.cond, &g_bulk.lock);
+        }
+        pthread_mutex_unlock(&g_bulk.lock);
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Appended %ld values in %.3f s (%.0f appends/sec)\n",
+               count, seconds, seconds > 0 ? count / seconds : 0.0);
+        printf("  acknowledged: %ld, failed: %ld, unmatched: %ld\n",
+               g_bulk.acknowledged, g_bulk.failed, g_bulk.unmatched);
+        if(g_bulk.acknowledged > 0) {
+                qsort(g_bulk.latencies, g_bulk.acknowledged, sizeof(uint32_t), compare_latencies);
+                printf("  sequence numbers %" PRId64 " to %" PRId64 "\n",
+                       g_bulk.first_sequence, g_bulk.last_sequence);
+                printf("  ack latency (us): p50=%u p90=%u p99=%u p99.9=%u max=%u\n",
+                       percentile(g_bulk.latencies, g_bulk.acknowledged, 50),
+                       percentile(g_bulk.latencies, g_bulk.acknowledged, 90),
+                       percentile(g_bulk.latencies, g_bulk.acknowledged, 99),
+                       percentile(g_bulk.latencies, g_bulk.acknowledged, 99.9),
+                       g_bulk.latencies[g_bulk.acknowledged - 1]);
+        }
+
+        free(g_bulk.latencies);
+        free(g_bulk.slots);
+}
+
+
 // Program entry point.
 int main(int argc, char** argv)
 {
@@ -125,6 +333,12 @@ int main(int argc, char** argv)
         const char *password = hash_get(options, "credentials");
         const char *topic_name = hash_get(options, "topic");
         const long seconds = atol(hash_get(options, "seconds"));
+        const long count = atol(hash_get(options, "count"));
+        const long window = atol(hash_get(options, "window"));
+        if(count > 0 && window < 1) {
+                fprintf(stderr, "window must be at least 1\n");
+                return EXIT_FAILURE;
+        }
 
         CREDENTIALS_T *credentials = NULL;
         if(password != NULL) {
@@ -157,31 +371,36 @@ int main(int argc, char** argv)
         topic_specification_free(spec);
         hash_free(properties, NULL, NULL);
 
-        time_t end_time = time(NULL) + seconds;
+        if(count > 0) {
+                bulk_append(session, topic_name, count, window);
+        }
+        else {
+                time_t end_time = time(NULL) + seconds;
 
-        while(time(NULL) < end_time) {
+                while(time(NULL) < end_time) {
 
-                // Compose the update content
-                const time_t time_now = time(NULL);
-                const char *time_str = ctime(&time_now);
+                        // Compose the update content
+                        const time_t time_now = time(NULL);
+                        const char *time_str = ctime(&time_now);
 
-                // Create a BUF_T and write the string datatype value into it.
-                BUF_T *value = buf_create();
-                write_diffusion_string_value(time_str, value);
+                        // Create a BUF_T and write the string datatype value into it.
+                        BUF_T *value = buf_create();
+                        write_diffusion_string_value(time_str, value);
 
-                DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
-                        .on_append = on_append,
-                        .on_error = on_error,
-                        .topic_path = topic_name,
-                        .datatype = DATATYPE_STRING,
-                        .value = value
-                };
+                        DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
+                                .on_append = on_append,
+                                .on_error = on_error,
+                                .topic_path = topic_name,
+                                .datatype = DATATYPE_STRING,
+                                .value = value
+                        };
 
-                // Append to the time series topic
-                diffusion_time_series_append(session, params, NULL);
-                buf_free(value);
+                        // Append to the time series topic
+                        diffusion_time_series_append(session, params, NULL);
+                        buf_free(value);
 
-                sleep(1);
+                        sleep(1);
+                }
         }
 
         // Close session and free resources.
@@ -0,0 +1,562 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example backfills existing Time series topics from a file of
+ * historical events, appending each one with its original timestamp.
+ *
+ * The file is memory-mapped and tokenized in place: fields are described
+ * by a pointer and length into the mapping rather than being copied out.
+ * Two formats are supported:
+ *
+ * csv     One event per line: <topic path>,<timestamp ms>,<value>.
+ *         Everything after the second comma is the value; quoting is not
+ *         supported.
+ *
+ * binary  A sequence of records, all integers little-endian:
+ *         uint16 path length, path bytes, int64 timestamp in ms,
+ *         uint32 value length, value bytes.
+ *
+ * Events are split between worker threads by a hash of their topic path,
+ * so that all of the events for a topic are appended by the same worker,
+ * in file order. Each worker has its own session and keeps up to a
+ * bounded number of diffusion_time_series_timestamp_append() calls in
+ * flight.
+ *
+ * The topics must already exist, with an event value type matching the
+ * --type option. Memory-mapping requires a POSIX platform.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'f', "file", "File of events to backfill", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'F', "format", "File format: csv or binary", ARG_OPTIONAL, ARG_HAS_VALUE, "csv"},
+        {'T', "type", "Event value type: string, int64, double or binary", ARG_OPTIONAL, ARG_HAS_VALUE, "string"},
+        {'n', "threads", "Number of worker threads (one session each)", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'w', "window", "Maximum number of appends in flight per worker", ARG_OPTIONAL, ARG_HAS_VALUE, "500"},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * One event from the file. The path and value point into the mapped
+ * file and are not NUL terminated.
+ */
+typedef struct backfill_record_s {
+        const char *path;
+        size_t path_length;
+        int64_t timestamp;
+        const char *value;
+        size_t value_length;
+} BACKFILL_RECORD_T;
+
+
+typedef enum {
+        RECORD_END = 0,
+        RECORD_OK = 1,
+        RECORD_MALFORMED = -1
+} RECORD_STATUS_T;
+
+
+/*
+ * A cursor over the mapped file. Each worker has its own.
+ */
+typedef struct record_reader_s {
+        const char *cursor;
+        const char *end;
+        long record_number;
+        bool binary;
+} RECORD_READER_T;
+
+
+// Parse a signed decimal integer held in a field of the given length.
+static bool parse_int64(const char *s, size_t length, int64_t *result)
+{
+        bool negative = false;
+        size_t i = 0;
+        if(length > 0 && (s[0] == '-' || s[0] == '+')) {
+                negative = s[0] == '-';
+                i++;
+        }
+        if(i == length) {
+                return false;
+        }
+
+        int64_t value = 0;
+        for(; i < length; i++) {
+                if(s[i] < '0' || s[i] > '9') {
+                        return false;
+                }
+                value = value * 10 + (s[i] - '0');
+        }
+        *result = negative ? -value : value;
+        return true;
+}
+
+
+static RECORD_STATUS_T next_csv_record(RECORD_READER_T *reader, BACKFILL_RECORD_T *record)
+{
+        while(reader->cursor < reader->end) {
+                const char *line = reader->cursor;
+                const char *eol = memchr(line, '\n', reader->end - line);
+                if(eol == NULL) {
+                        eol = reader->end;
+                }
+                reader->cursor = eol < reader->end ? eol + 1 : eol;
+                reader->record_number++;
+
+                if(eol > line && eol[-1] == '\r') {
+                        eol--;
+                }
+                if(eol == line || *line == '#') {
+                        continue;
+                }
+
+                const char *comma1 = memchr(line, ',', eol - line);
+                const char *comma2 = comma1 == NULL ? NULL : memchr(comma1 + 1, ',', eol - comma1 - 1);
+                if(comma2 == NULL
+                   || !parse_int64(comma1 + 1, comma2 - comma1 - 1, &record->timestamp)) {
+                        return RECORD_MALFORMED;
+                }
+
+                record->path = line;
+                record->path_length = comma1 - line;
+                record->value = comma2 + 1;
+                record->value_length = eol - comma2 - 1;
+                return RECORD_OK;
+        }
+        return RECORD_END;
+}
+
+
+static uint64_t read_le(const unsigned char *p, int bytes)
+{
+        uint64_t value = 0;
+        for(int i = bytes - 1; i >= 0; i--) {
+                value = (value << 8) | p[i];
+        }
+        return value;
+}
+
+
+static RECORD_STATUS_T next_binary_record(RECORD_READER_T *reader, BACKFILL_RECORD_T *record)
+{
+        const unsigned char *p = (const unsigned char *)reader->cursor;
+        const size_t remaining = reader->end - reader->cursor;
+        if(remaining == 0) {
+                return RECORD_END;
+        }
+        reader->record_number++;
+
+        if(remaining < 2) {
+                reader->cursor = reader->end;
+                return RECORD_MALFORMED;
+        }
+        const size_t path_length = read_le(p, 2);
+        if(remaining < 2 + path_length + 8 + 4) {
+                reader->cursor = reader->end;
+                return RECORD_MALFORMED;
+        }
+        const size_t value_length = read_le(p + 2 + path_length + 8, 4);
+        const size_t record_length = 2 + path_length + 8 + 4 + value_length;
+        if(remaining < record_length) {
+                reader->cursor = reader->end;
+                return RECORD_MALFORMED;
+        }
+
+        record->path = (const char *)p + 2;
+        record->path_length = path_length;
+        record->timestamp = (int64_t)read_le(p + 2 + path_length, 8);
+        record->value = (const char *)p + 2 + path_length + 8 + 4;
+        record->value_length = value_length;
+
+        reader->cursor += record_length;
+        return RECORD_OK;
+}
+
+
+static RECORD_STATUS_T next_record(RECORD_READER_T *reader, BACKFILL_RECORD_T *record)
+{
+        return reader->binary
+                ? next_binary_record(reader, record)
+                : next_csv_record(reader, record);
+}
+
+
+// 32-bit FNV-1a, used to assign topics to workers.
+static uint32_t hash_path(const char *path, size_t length)
+{
+        uint32_t hash = 2166136261u;
+        for(size_t i = 0; i < length; i++) {
+                hash ^= (unsigned char)path[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+
+/*
+ * Per-worker state. The session's user context points back at this so
+ * the error handler can find it.
+ */
+typedef struct worker_s {
+        pthread_t thread;
+        int index;
+        int worker_count;
+        SESSION_T *session;
+        const char *data;
+        size_t size;
+        bool binary;
+        DIFFUSION_DATATYPE datatype;
+        long window;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long in_flight;
+        long sent;
+        long appended;
+        long failed;
+        long malformed;
+        long invalid_values;
+} WORKER_T;
+
+
+static int on_append(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        WORKER_T *worker = context;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->appended++;
+        worker->in_flight--;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        WORKER_T *worker = session->user_context;
+
+        pthread_mutex_lock(&worker->lock);
+        if(worker->failed++ == 0) {
+                printf("time series append error: %s\n", error->message);
+        }
+        worker->in_flight--;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+// Copy a field into a NUL terminated scratch buffer, growing it if needed.
+static const char *terminate(const char *field, size_t length, char **scratch, size_t *capacity)
+{
+        if(length + 1 > *capacity) {
+                *capacity = 2 * (length + 1);
+                *scratch = realloc(*scratch, *capacity);
+        }
+        memcpy(*scratch, field, length);
+        (*scratch)[length] = '\0';
+        return *scratch;
+}
+
+
+// Encode a value field using the worker's datatype.
+static bool write_value(
+        WORKER_T *worker,
+        const BACKFILL_RECORD_T *record,
+        BUF_T *buf,
+        char **scratch,
+        size_t *capacity)
+{
+        int64_t int64_value;
+
+        switch(worker->datatype) {
+        case DATATYPE_BINARY:
+                // Binary values are written straight from the mapping.
+                return write_diffusion_binary_value(record->value, buf, record->value_length);
+        case DATATYPE_INT64:
+                return parse_int64(record->value, record->value_length, &int64_value)
+                        && write_diffusion_int64_value(int64_value, buf);
+        case DATATYPE_DOUBLE:
+                return write_diffusion_double_value(
+                        strtod(terminate(record->value, record->value_length, scratch, capacity), NULL), buf);
+        default:
+                return write_diffusion_string_value(
+                        terminate(record->value, record->value_length, scratch, capacity), buf);
+        }
+}
+
+
+/*
+ * Each worker scans the whole mapping, which is cheap, and appends only
+ * the events for topics assigned to it.
+ */
+static void *worker_run(void *arg)
+{
+        WORKER_T *worker = arg;
+        RECORD_READER_T reader = {
+                .cursor = worker->data,
+                .end = worker->data + worker->size,
+                .binary = worker->binary
+        };
+
+        char *path_scratch = NULL;
+        size_t path_capacity = 0;
+        char *value_scratch = NULL;
+        size_t value_capacity = 0;
+
+        BACKFILL_RECORD_T record;
+        RECORD_STATUS_T status;
+        while((status = next_record(&reader, &record)) != RECORD_END) {
+                if(status == RECORD_MALFORMED) {
+                        // Only one worker reports each malformed record.
+                        if(worker->index == 0) {
+                                fprintf(stderr, "Record %ld is malformed\n", reader.record_number);
+                                worker->malformed++;
+                        }
+                        continue;
+                }
+                if(hash_path(record.path, record.path_length) % worker->worker_count != (uint32_t)worker->index) {
+                        continue;
+                }
+
+                BUF_T *value = buf_create();
+                if(!write_value(worker, &record, value, &value_scratch, &value_capacity)) {
+                        worker->invalid_values++;
+                        buf_free(value);
+                        continue;
+                }
+
+                pthread_mutex_lock(&worker->lock);
+                while(worker->in_flight >= worker->window) {
+                        pthread_cond_wait(&worker->cond, &worker->lock);
+                }
+                worker->in_flight++;
+                worker->sent++;
+                pthread_mutex_unlock(&worker->lock);
+
+                DIFFUSION_TIME_SERIES_TIMESTAMP_APPEND_PARAMS_T params = {
+                        .on_append = on_append,
+                        .on_error = on_error,
+                        .topic_path = terminate(record.path, record.path_length, &path_scratch, &path_capacity),
+                        .datatype = worker->datatype,
+                        .value = value,
+                        .timestamp = record.timestamp,
+                        .context = worker
+                };
+
+                diffusion_time_series_timestamp_append(worker->session, params, NULL);
+                buf_free(value);
+        }
+
+        // Wait for this worker's outstanding appends to complete.
+        pthread_mutex_lock(&worker->lock);
+        while(worker->in_flight > 0) {
+                pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        free(path_scratch);
+        free(value_scratch);
+        return NULL;
+}
+
+
+static bool parse_datatype(const char *name, DIFFUSION_DATATYPE *datatype)
+{
+        if(strcmp(name, "string") == 0) {
+                *datatype = DATATYPE_STRING;
+        }
+        else if(strcmp(name, "int64") == 0) {
+                *datatype = DATATYPE_INT64;
+        }
+        else if(strcmp(name, "double") == 0) {
+                *datatype = DATATYPE_DOUBLE;
+        }
+        else if(strcmp(name, "binary") == 0) {
+                *datatype = DATATYPE_BINARY;
+        }
+        else {
+                return false;
+        }
+        return true;
+}
+
+
+/*
+ * Program entry point.
+ */
+int main(int argc, char** argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+        const char *file_name = hash_get(options, "file");
+        const char *format = hash_get(options, "format");
+        const int thread_count = atoi(hash_get(options, "threads"));
+        const long window = atol(hash_get(options, "window"));
+
+        DIFFUSION_DATATYPE datatype;
+        if(!parse_datatype(hash_get(options, "type"), &datatype)) {
+                fprintf(stderr, "Unsupported event value type \"%s\"\n", (char *)hash_get(options, "type"));
+                return EXIT_FAILURE;
+        }
+        if(strcmp(format, "csv") != 0 && strcmp(format, "binary") != 0) {
+                fprintf(stderr, "Unsupported format \"%s\"\n", format);
+                return EXIT_FAILURE;
+        }
+        if(thread_count < 1 || window < 1) {
+                fprintf(stderr, "threads and window must both be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Map the file into memory.
+         */
+        int fd = open(file_name, O_RDONLY);
+        struct stat file_stat;
+        if(fd < 0 || fstat(fd, &file_stat) != 0) {
+                fprintf(stderr, "Unable to open \"%s\"\n", file_name);
+                return EXIT_FAILURE;
+        }
+        const size_t size = file_stat.st_size;
+        const char *data = NULL;
+        if(size > 0) {
+                data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(data == MAP_FAILED) {
+                        fprintf(stderr, "Unable to map \"%s\"\n", file_name);
+                        return EXIT_FAILURE;
+                }
+                posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+        }
+
+        /*
+         * Create one session per worker.
+         */
+        WORKER_T *workers = calloc(thread_count, sizeof(WORKER_T));
+        for(int i = 0; i < thread_count; i++) {
+                WORKER_T *worker = &workers[i];
+                worker->index = i;
+                worker->worker_count = thread_count;
+                worker->data = data;
+                worker->size = size;
+                worker->binary = strcmp(format, "binary") == 0;
+                worker->datatype = datatype;
+                worker->window = window;
+                pthread_mutex_init(&worker->lock, NULL);
+                pthread_cond_init(&worker->cond, NULL);
+
+                DIFFUSION_ERROR_T error = { 0 };
+                worker->session = session_create_with_user_context(url, principal, credentials, NULL, NULL, worker, &error);
+                if(worker->session == NULL) {
+                        fprintf(stderr, "TEST: Failed to create session\n");
+                        fprintf(stderr, "ERR : %s\n", error.message);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int i = 0; i < thread_count; i++) {
+                pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        }
+        for(int i = 0; i < thread_count; i++) {
+                pthread_join(workers[i].thread, NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        /*
+         * Report the results.
+         */
+        long sent = 0, appended = 0, failed = 0, malformed = 0, invalid_values = 0;
+        for(int i = 0; i < thread_count; i++) {
+                sent += workers[i].sent;
+                appended += workers[i].appended;
+                failed += workers[i].failed;
+                malformed += workers[i].malformed;
+                invalid_values += workers[i].invalid_values;
+        }
+
+        printf("Backfilled %ld events (%.1f MB) in %.3f s (%.0f appends/sec)\n",
+               sent, size / 1e6, seconds, seconds > 0 ? sent / seconds : 0.0);
+        printf("  appended: %ld, failed: %ld, malformed records: %ld, invalid values: %ld\n",
+               appended, failed, malformed, invalid_values);
+
+        /*
+         * Close sessions and free resources.
+         */
+        for(int i = 0; i < thread_count; i++) {
+                session_close(workers[i].session, NULL);
+                session_free(workers[i].session);
+                pthread_mutex_destroy(&workers[i].lock);
+                pthread_cond_destroy(&workers[i].cond);
+        }
+        free(workers);
+
+        if(data != NULL) {
+                munmap((void *)data, size);
+        }
+        close(fd);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return failed == 0 && malformed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
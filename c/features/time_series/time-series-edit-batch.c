@@ -0,0 +1,595 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example applies a batch of corrections to a Time series topic (of
+ * String datatype) and then verifies them.
+ *
+ * The corrections file has one correction per line:
+ *
+ *     <original sequence number>,<new value>
+ *
+ * The edits are pipelined, keeping up to a window of
+ * diffusion_time_series_edit() calls in flight. Once they have all
+ * completed, the edited range of the series is read back a page at a
+ * time with range queries, and the latest value of every corrected event
+ * is compared with the value it was edited to.
+ *
+ * For demonstration purposes, the topic can first be created and
+ * populated with a number of values using the --populate option.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "topic", "Time series topic to edit", ARG_OPTIONAL, ARG_HAS_VALUE, "time-series-edit-batch"},
+        {'f', "file", "File of <sequence>,<value> corrections", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'w', "window", "Maximum number of edits in flight", ARG_OPTIONAL, ARG_HAS_VALUE, "500"},
+        {'s', "page_size", "Number of events read by each verification query", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'P', "populate", "Create the topic and append this many values before editing", ARG_OPTIONAL, ARG_HAS_VALUE, "0"},
+        END_OF_ARG_OPTS
+};
+
+
+typedef struct correction_s {
+        int64_t sequence;
+        char *value;
+        long line_number;
+        bool seen;
+} CORRECTION_T;
+
+
+/*
+ * Completion tracking for pipelined operations and for the verification
+ * queries.
+ */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static long g_in_flight = 0;
+static long g_succeeded = 0;
+static long g_failed = 0;
+
+
+static void operation_complete(bool success)
+{
+        pthread_mutex_lock(&g_lock);
+        if(success) {
+                g_succeeded++;
+        }
+        else {
+                g_failed++;
+        }
+        g_in_flight--;
+        pthread_cond_signal(&g_cond);
+        pthread_mutex_unlock(&g_lock);
+}
+
+
+static void acquire_slot(long window)
+{
+        pthread_mutex_lock(&g_lock);
+        while(g_in_flight >= window) {
+                pthread_cond_wait(&g_cond, &g_lock);
+        }
+        g_in_flight++;
+        pthread_mutex_unlock(&g_lock);
+}
+
+
+static void wait_for_completion(void)
+{
+        pthread_mutex_lock(&g_lock);
+        while(g_in_flight > 0) {
+                pthread_cond_wait(&g_cond, &g_lock);
+        }
+        pthread_mutex_unlock(&g_lock);
+}
+
+
+static void reset_counts(void)
+{
+        pthread_mutex_lock(&g_lock);
+        g_succeeded = 0;
+        g_failed = 0;
+        pthread_mutex_unlock(&g_lock);
+}
+
+
+/*
+ * Handlers for add topic feature.
+ */
+static int on_topic_added_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_RESULT_CODE result_code,
+        void *context)
+{
+        printf("Added topic \"%s\"\n", (const char *)context);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_failed_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_FAIL_RESULT_CODE result_code,
+        const DIFFUSION_ERROR_T *error,
+        void *context)
+{
+        printf("Failed to add topic \"%s\" (%d)\n", (const char *)context, result_code);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_discard(SESSION_T *session, void *context)
+{
+        return HANDLER_SUCCESS;
+}
+
+
+static ADD_TOPIC_CALLBACK_T create_topic_callback(const char *topic_name)
+{
+        ADD_TOPIC_CALLBACK_T callback = {
+                .on_topic_added_with_specification = on_topic_added_with_specification,
+                .on_topic_add_failed_with_specification = on_topic_add_failed_with_specification,
+                .on_discard = on_topic_add_discard,
+                .context = (char *)topic_name
+        };
+
+        return callback;
+}
+
+
+/*
+ * Handlers for appends and edits.
+ */
+static int on_append(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_edit(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        pthread_mutex_lock(&g_lock);
+        if(g_failed == 0) {
+                printf("time series error: %s\n", error->message);
+        }
+        pthread_mutex_unlock(&g_lock);
+
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * State for verifying the corrections with range queries.
+ */
+typedef struct verification_s {
+        CORRECTION_T *corrections;
+        long count;
+        int64_t page_size;
+        int64_t next_sequence;
+        bool last_page;
+        long verified;
+        long mismatched;
+} VERIFICATION_T;
+
+
+static int compare_corrections(const void *a, const void *b)
+{
+        const int64_t x = ((const CORRECTION_T *)a)->sequence;
+        const int64_t y = ((const CORRECTION_T *)b)->sequence;
+        return (x > y) - (x < y);
+}
+
+
+// Orders corrections by sequence number, then by position in the file.
+static int compare_corrections_in_order(const void *a, const void *b)
+{
+        const int result = compare_corrections(a, b);
+        if(result != 0) {
+                return result;
+        }
+        const long x = ((const CORRECTION_T *)a)->line_number;
+        const long y = ((const CORRECTION_T *)b)->line_number;
+        return (x > y) - (x < y);
+}
+
+
+/*
+ * The sequence number of the original event that an event stands for. In
+ * the value view an edit replaces its original but keeps its own sequence
+ * number, so for an edit the original's is read from its metadata.
+ */
+static int64_t original_sequence(const DIFFUSION_TIME_SERIES_EVENT_T *event)
+{
+        if(!diffusion_time_series_event_is_edit_event(event)) {
+                return diffusion_time_series_event_get_sequence(event);
+        }
+        DIFFUSION_TIME_SERIES_EVENT_METADATA_T *original = diffusion_time_series_event_get_original_event(event);
+        const int64_t sequence = diffusion_time_series_event_metadata_get_sequence(original);
+        diffusion_time_series_event_metadata_free(original);
+        return sequence;
+}
+
+
+static int on_query_result(
+        const DIFFUSION_TIME_SERIES_QUERY_RESULT_T *query_result,
+        void *context)
+{
+        VERIFICATION_T *verification = context;
+
+        LIST_T *events = diffusion_time_series_query_result_get_events(query_result);
+        const int size = list_get_size(events);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TIME_SERIES_EVENT_T *event = list_get_data_indexed(events, i);
+
+                CORRECTION_T key = { .sequence = original_sequence(event) };
+                CORRECTION_T *correction = bsearch(&key, verification->corrections, verification->count,
+                                                   sizeof(CORRECTION_T), compare_corrections);
+                if(correction == NULL) {
+                        continue;
+                }
+
+                char *val;
+                DIFFUSION_VALUE_T *value = diffusion_time_series_event_get_value(event);
+                read_diffusion_string_value(value, &val, NULL);
+
+                correction->seen = true;
+                if(strcmp(val, correction->value) == 0) {
+                        verification->verified++;
+                }
+                else {
+                        printf("Sequence %" PRId64 ": expected \"%s\", found \"%s\"\n",
+                               correction->sequence, correction->value, val);
+                        verification->mismatched++;
+                }
+
+                diffusion_value_free(value);
+                free(val);
+        }
+
+        if(size < verification->page_size) {
+                verification->last_page = true;
+        }
+        else {
+                DIFFUSION_TIME_SERIES_EVENT_T *last = list_get_data_indexed(events, size - 1);
+                verification->next_sequence = original_sequence(last) + 1;
+        }
+
+        list_free(events, (void (*)(void *))diffusion_time_series_event_free);
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Read back the edited range of the series a page at a time. The default
+ * value view of a range query selects by original event, showing the
+ * latest edit of each in place of the original, so pages are both
+ * matched and resumed by original sequence number.
+ */
+static void verify_corrections(
+        SESSION_T *session,
+        const char *topic_name,
+        VERIFICATION_T *verification)
+{
+        const int64_t last_sequence = verification->corrections[verification->count - 1].sequence;
+        verification->next_sequence = verification->corrections[0].sequence;
+
+        while(!verification->last_page && verification->next_sequence <= last_sequence) {
+                DIFFUSION_TIME_SERIES_RANGE_QUERY_T *range_query = diffusion_time_series_range_query();
+                diffusion_time_series_range_query_from(range_query, verification->next_sequence, NULL);
+                diffusion_time_series_range_query_next(range_query, verification->page_size - 1, NULL);
+
+                DIFFUSION_TIME_SERIES_RANGE_QUERY_PARAMS_T params = {
+                        .topic_path = topic_name,
+                        .range_query = range_query,
+                        .on_query_result = on_query_result,
+                        .on_error = on_error,
+                        .context = verification
+                };
+
+                acquire_slot(1);
+                diffusion_time_series_select_from(session, params, NULL);
+                wait_for_completion();
+
+                diffusion_time_series_range_query_free(range_query);
+
+                if(g_failed > 0) {
+                        break;
+                }
+        }
+}
+
+
+/*
+ * Read the corrections file. Returns the number of corrections read, or
+ * -1 if the file can't be read.
+ */
+static long read_corrections(const char *file_name, CORRECTION_T **corrections)
+{
+        FILE *file = fopen(file_name, "r");
+        if(file == NULL) {
+                return -1;
+        }
+
+        long count = 0;
+        long capacity = 1024;
+        *corrections = malloc(capacity * sizeof(CORRECTION_T));
+
+        char *line = NULL;
+        size_t line_capacity = 0;
+        long line_number = 0;
+        while(getline(&line, &line_capacity, file) != -1) {
+                line_number++;
+                line[strcspn(line, "\r\n")] = '\0';
+                if(*line == '\0' || *line == '#') {
+                        continue;
+                }
+
+                char *end;
+                const long long sequence = strtoll(line, &end, 10);
+                if(end == line || *end != ',' || sequence < 0) {
+                        fprintf(stderr, "Line %ld: expected <sequence>,<value>\n", line_number);
+                        continue;
+                }
+
+                if(count == capacity) {
+                        capacity *= 2;
+                        *corrections = realloc(*corrections, capacity * sizeof(CORRECTION_T));
+                }
+                (*corrections)[count].sequence = sequence;
+                (*corrections)[count].value = strdup(end + 1);
+                (*corrections)[count].line_number = line_number;
+                (*corrections)[count].seen = false;
+                count++;
+        }
+
+        free(line);
+        fclose(file);
+        return count;
+}
+
+
+/*
+ * Program entry point.
+ */
+int main(int argc, char** argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+        const char *topic_name = hash_get(options, "topic");
+        const char *file_name = hash_get(options, "file");
+        const long window = atol(hash_get(options, "window"));
+        const long page_size = atol(hash_get(options, "page_size"));
+        const long populate = atol(hash_get(options, "populate"));
+        if(window < 1 || page_size < 1) {
+                fprintf(stderr, "window and page_size must both be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        CORRECTION_T *corrections;
+        const long count = read_corrections(file_name, &corrections);
+        if(count < 0) {
+                fprintf(stderr, "Unable to read corrections from \"%s\"\n", file_name);
+                return EXIT_FAILURE;
+        }
+        if(count == 0) {
+                fprintf(stderr, "No corrections in \"%s\"\n", file_name);
+                free(corrections);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Sort by sequence number so the results can be looked up during
+         * verification. Where a sequence number is corrected more than
+         * once, only the last correction in the file is applied.
+         */
+        qsort(corrections, count, sizeof(CORRECTION_T), compare_corrections_in_order);
+
+        long unique = 0;
+        for(long i = 0; i < count; i++) {
+                if(unique > 0 && corrections[unique - 1].sequence == corrections[i].sequence) {
+                        free(corrections[unique - 1].value);
+                        corrections[unique - 1] = corrections[i];
+                }
+                else {
+                        corrections[unique++] = corrections[i];
+                }
+        }
+
+        /*
+         * Create a session with the Diffusion server.
+         */
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        if(populate > 0) {
+                ADD_TOPIC_CALLBACK_T callback = create_topic_callback(topic_name);
+
+                char retained_range[32];
+                snprintf(retained_range, sizeof(retained_range), "limit %ld", 2 * populate + unique);
+
+                HASH_T *properties = hash_new(2);
+                hash_add(properties, DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE, "string");
+                hash_add(properties, DIFFUSION_TIME_SERIES_RETAINED_RANGE, retained_range);
+
+                TOPIC_SPECIFICATION_T *spec = topic_specification_init(TOPIC_TYPE_TIME_SERIES);
+                topic_specification_set_properties(spec, properties);
+
+                add_topic_from_specification(session, topic_name, spec, callback);
+
+                // Sleep for a while
+                sleep(5);
+
+                topic_specification_free(spec);
+                hash_free(properties, NULL, NULL);
+
+                for(long i = 0; i < populate; i++) {
+                        char value[32];
+                        snprintf(value, sizeof(value), "value %ld", i);
+
+                        BUF_T *buf = buf_create();
+                        write_diffusion_string_value(value, buf);
+
+                        DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
+                                .on_append = on_append,
+                                .on_error = on_error,
+                                .topic_path = topic_name,
+                                .datatype = DATATYPE_STRING,
+                                .value = buf
+                        };
+
+                        acquire_slot(window);
+                        diffusion_time_series_append(session, params, NULL);
+                        buf_free(buf);
+                }
+                wait_for_completion();
+                printf("Appended %ld values (%ld failed)\n", g_succeeded, g_failed);
+                reset_counts();
+        }
+
+        /*
+         * Apply the edits.
+         */
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(long i = 0; i < unique; i++) {
+                BUF_T *buf = buf_create();
+                write_diffusion_string_value(corrections[i].value, buf);
+
+                DIFFUSION_TIME_SERIES_EDIT_PARAMS_T edit_params = {
+                        .on_edit = on_edit,
+                        .on_error = on_error,
+                        .topic_path = topic_name,
+                        .original_sequence = corrections[i].sequence,
+                        .datatype = DATATYPE_STRING,
+                        .value = buf
+                };
+
+                acquire_slot(window);
+                diffusion_time_series_edit(session, edit_params, NULL);
+                buf_free(buf);
+        }
+        wait_for_completion();
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Edited %ld events in %.3f s (%.0f edits/sec), %ld failed\n",
+               unique, seconds, seconds > 0 ? unique / seconds : 0.0, g_failed);
+        reset_counts();
+
+        /*
+         * Verify the edits.
+         */
+        VERIFICATION_T verification = {
+                .corrections = corrections,
+                .count = unique,
+                .page_size = page_size
+        };
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        verify_corrections(session, topic_name, &verification);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        long missing = 0;
+        for(long i = 0; i < unique; i++) {
+                if(!corrections[i].seen) {
+                        missing++;
+                }
+        }
+
+        printf("Verified in %.3f s: %ld correct, %ld mismatched, %ld not found%s\n",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+               verification.verified, verification.mismatched, missing,
+               g_failed > 0 ? " (query failed)" : "");
+
+        /*
+         * Close session and free resources.
+         */
+        session_close(session, NULL);
+        session_free(session);
+
+        for(long i = 0; i < unique; i++) {
+                free(corrections[i].value);
+        }
+        free(corrections);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return verification.mismatched == 0 && missing == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,552 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example measures how the cost of a Time series range query scales
+ * with the retained range of the topic and the number of events selected.
+ *
+ * For each retained range limit, a topic is created and filled to that
+ * limit. Range queries of each shape below are then timed for result
+ * sizes of 1, 10, 100, ... up to the limit:
+ *
+ *   from       from(limit - n), to the end of the series
+ *   next       from start, next(n - 1)
+ *   previous   from(limit - 1), previous(n - 1)
+ *   untilLast  from start, untilLast(limit - n)
+ *   latest     fromLast(n), the latest n events
+ *
+ * Each query is issued on its own and waited for, so the figures are the
+ * round trip latency from diffusion_time_series_select_from() to the
+ * result handler. Any topics left under the root by an earlier run are
+ * removed first, since the queries assume each series holds exactly
+ * sequences 0 to limit - 1, and the topics are removed again at the end.
+ * A warning is printed if a query selects other than n events.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "topic", "Root of the topics to create", ARG_OPTIONAL, ARG_HAS_VALUE, "time-series-range-query-benchmark"},
+        {'l', "limits", "Comma separated list of retained range limits", ARG_OPTIONAL, ARG_HAS_VALUE, "100,1000,10000"},
+        {'r', "repeat", "Number of times each query is timed", ARG_OPTIONAL, ARG_HAS_VALUE, "20"},
+        {'w', "window", "Maximum number of appends in flight while filling", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        END_OF_ARG_OPTS
+};
+
+
+typedef enum {
+        SHAPE_FROM,
+        SHAPE_NEXT,
+        SHAPE_PREVIOUS,
+        SHAPE_UNTIL_LAST,
+        SHAPE_LATEST,
+        SHAPE_COUNT
+} QUERY_SHAPE_T;
+
+static const char *SHAPE_NAMES[SHAPE_COUNT] = { "from", "next", "previous", "untilLast", "latest" };
+
+
+/*
+ * State shared with the handlers. Only one operation of each kind is
+ * waited for at a time.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        bool done;
+        bool failed;
+
+        // Result of the last range query.
+        int events;
+        struct timespec received;
+
+        long appends_in_flight;
+        long append_failures;
+} g_bench = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void complete(bool failed)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.done = true;
+        g_bench.failed = failed;
+        pthread_cond_signal(&g_bench.cond);
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static void reset(void)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.done = false;
+        g_bench.failed = false;
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static bool await_completion(void)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        while(!g_bench.done) {
+                pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+        }
+        const bool failed = g_bench.failed;
+        pthread_mutex_unlock(&g_bench.lock);
+        return !failed;
+}
+
+
+// Handlers for add topic feature.
+static int on_topic_added_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_RESULT_CODE result_code,
+        void *context)
+{
+        // Appending to an existing series would shift its sequences.
+        if(result_code == TOPIC_ADD_EXISTS) {
+                printf("Topic \"%s\" already exists\n", (const char *)context);
+                complete(true);
+                return HANDLER_SUCCESS;
+        }
+        complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_failed_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_FAIL_RESULT_CODE result_code,
+        const DIFFUSION_ERROR_T *error,
+        void *context)
+{
+        printf("Failed to add topic \"%s\" (%d)\n", (const char *)context, result_code);
+        complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_discard(SESSION_T *session, void *context)
+{
+        complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+// Handlers for topic removal.
+static int on_topic_removed(
+        SESSION_T *session,
+        const DIFFUSION_TOPIC_REMOVAL_RESULT_T *response,
+        void *context)
+{
+        complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_remove_discard(SESSION_T *session, void *context)
+{
+        complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+// Handlers for appending values to the time series topic.
+static void append_complete(bool failed)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.appends_in_flight--;
+        if(failed) {
+                g_bench.append_failures++;
+        }
+        pthread_cond_signal(&g_bench.cond);
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static int on_append(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        append_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_append_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        append_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+// Handlers for range queries.
+static int on_query_result(
+        const DIFFUSION_TIME_SERIES_QUERY_RESULT_T *query_result,
+        void *context)
+{
+        struct timespec received;
+        clock_gettime(CLOCK_MONOTONIC, &received);
+
+        LIST_T *events = diffusion_time_series_query_result_get_events(query_result);
+        const int size = list_get_size(events);
+        list_free(events, (void (*)(void *))diffusion_time_series_event_free);
+
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.events = size;
+        g_bench.received = received;
+        pthread_mutex_unlock(&g_bench.lock);
+
+        complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_query_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        printf("time series range query error: %s\n", error->message);
+        complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static void remove_topics(SESSION_T *session, const char *root)
+{
+        char selector[256];
+        snprintf(selector, sizeof(selector), "?%s//", root);
+
+        TOPIC_REMOVAL_PARAMS_T remove_params = {
+                .on_removed = on_topic_removed,
+                .on_discard = on_topic_remove_discard,
+                .topic_selector = selector
+        };
+
+        reset();
+        topic_removal(session, remove_params);
+        await_completion();
+}
+
+
+static bool create_topic(SESSION_T *session, const char *topic_path, long limit)
+{
+        char retained_range[32];
+        snprintf(retained_range, sizeof(retained_range), "limit %ld", limit);
+
+        HASH_T *properties = hash_new(2);
+        hash_add(properties, DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE, "string");
+        hash_add(properties, DIFFUSION_TIME_SERIES_RETAINED_RANGE, retained_range);
+
+        TOPIC_SPECIFICATION_T *spec = topic_specification_init(TOPIC_TYPE_TIME_SERIES);
+        topic_specification_set_properties(spec, properties);
+
+        ADD_TOPIC_CALLBACK_T callback = {
+                .on_topic_added_with_specification = on_topic_added_with_specification,
+                .on_topic_add_failed_with_specification = on_topic_add_failed_with_specification,
+                .on_discard = on_topic_add_discard,
+                .context = (char *)topic_path
+        };
+
+        reset();
+        add_topic_from_specification(session, topic_path, spec, callback);
+        const bool added = await_completion();
+
+        topic_specification_free(spec);
+        hash_free(properties, NULL, NULL);
+        return added;
+}
+
+
+// Append "count" values, keeping up to "window" appends in flight.
+static void fill_topic(SESSION_T *session, const char *topic_path, long count, long window)
+{
+        for(long i = 0; i < count; i++) {
+                pthread_mutex_lock(&g_bench.lock);
+                while(g_bench.appends_in_flight >= window) {
+                        pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+                }
+                g_bench.appends_in_flight++;
+                pthread_mutex_unlock(&g_bench.lock);
+
+                char value[32];
+                snprintf(value, sizeof(value), "value %ld", i);
+
+                BUF_T *buf = buf_create();
+                write_diffusion_string_value(value, buf);
+
+                DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
+                        .on_append = on_append,
+                        .on_error = on_append_error,
+                        .topic_path = topic_path,
+                        .datatype = DATATYPE_STRING,
+                        .value = buf
+                };
+                diffusion_time_series_append(session, params, NULL);
+                buf_free(buf);
+        }
+
+        pthread_mutex_lock(&g_bench.lock);
+        while(g_bench.appends_in_flight > 0) {
+                pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+        }
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+/*
+ * Build a range query of the given shape selecting "n" events from a
+ * series holding sequences 0 to limit - 1.
+ */
+static DIFFUSION_TIME_SERIES_RANGE_QUERY_T *create_query(QUERY_SHAPE_T shape, long limit, long n)
+{
+        DIFFUSION_TIME_SERIES_RANGE_QUERY_T *range_query = diffusion_time_series_range_query();
+
+        switch(shape) {
+        case SHAPE_FROM:
+                diffusion_time_series_range_query_from(range_query, limit - n, NULL);
+                break;
+        case SHAPE_NEXT:
+                diffusion_time_series_range_query_from_start(range_query, NULL);
+                diffusion_time_series_range_query_next(range_query, n - 1, NULL);
+                break;
+        case SHAPE_PREVIOUS:
+                diffusion_time_series_range_query_from(range_query, limit - 1, NULL);
+                diffusion_time_series_range_query_previous(range_query, n - 1, NULL);
+                break;
+        case SHAPE_UNTIL_LAST:
+                diffusion_time_series_range_query_from_start(range_query, NULL);
+                diffusion_time_series_range_query_until_last(range_query, limit - n, NULL);
+                break;
+        default:
+                diffusion_time_series_range_query_from_last(range_query, n, NULL);
+                break;
+        }
+        return range_query;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+/*
+ * Time "repeat" queries of one shape and size, and print a row of the
+ * results table.
+ */
+static void time_query(
+        SESSION_T *session,
+        const char *topic_path,
+        QUERY_SHAPE_T shape,
+        long limit,
+        long n,
+        int repeat,
+        uint32_t *latencies)
+{
+        DIFFUSION_TIME_SERIES_RANGE_QUERY_T *range_query = create_query(shape, limit, n);
+
+        DIFFUSION_TIME_SERIES_RANGE_QUERY_PARAMS_T params = {
+                .topic_path = topic_path,
+                .range_query = range_query,
+                .on_query_result = on_query_result,
+                .on_error = on_query_error
+        };
+
+        int timed = 0;
+        int events = 0;
+        double total_us = 0;
+
+        for(int i = 0; i < repeat; i++) {
+                struct timespec start;
+
+                reset();
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                diffusion_time_series_select_from(session, params, NULL);
+                if(!await_completion()) {
+                        continue;
+                }
+
+                pthread_mutex_lock(&g_bench.lock);
+                const int64_t us = (g_bench.received.tv_sec - start.tv_sec) * 1000000LL
+                        + (g_bench.received.tv_nsec - start.tv_nsec) / 1000;
+                events = g_bench.events;
+                pthread_mutex_unlock(&g_bench.lock);
+
+                latencies[timed++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+                total_us += us;
+        }
+
+        diffusion_time_series_range_query_free(range_query);
+
+        if(timed == 0) {
+                printf("%8ld  %-9s  %8ld  all queries failed\n", limit, SHAPE_NAMES[shape], n);
+                return;
+        }
+
+        qsort(latencies, timed, sizeof(uint32_t), compare_latencies);
+        const double mean_us = total_us / timed;
+
+        printf("%8ld  %-9s  %8ld  %8d  %10.0f  %10u  %10u  %10u  %10.3f\n",
+               limit, SHAPE_NAMES[shape], n, events, mean_us,
+               percentile(latencies, timed, 50),
+               percentile(latencies, timed, 99),
+               latencies[timed - 1],
+               events > 0 ? mean_us / events : 0.0);
+        if(events != n) {
+                printf("Warning: %s query selected %d events, expected %ld\n", SHAPE_NAMES[shape], events, n);
+        }
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *root = hash_get(options, "topic");
+        const char *limits = hash_get(options, "limits");
+        const int repeat = atoi(hash_get(options, "repeat"));
+        const long window = atol(hash_get(options, "window"));
+        if(repeat < 1 || window < 1) {
+                fprintf(stderr, "repeat and window must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // Create a session with the Diffusion server.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        // Start from empty series, whatever an interrupted run left behind.
+        remove_topics(session, root);
+
+        uint32_t *latencies = malloc(repeat * sizeof(uint32_t));
+
+        printf("%8s  %-9s  %8s  %8s  %10s  %10s  %10s  %10s  %10s\n",
+               "retained", "shape", "n", "events", "mean us", "p50 us", "p99 us", "max us", "us/event");
+
+        char *limit_list = strdup(limits);
+        for(char *token = strtok(limit_list, ","); token != NULL; token = strtok(NULL, ",")) {
+                const long limit = atol(token);
+                if(limit < 1) {
+                        continue;
+                }
+
+                char topic_path[256];
+                snprintf(topic_path, sizeof(topic_path), "%s/limit-%ld", root, limit);
+
+                if(!create_topic(session, topic_path, limit)) {
+                        continue;
+                }
+
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                fill_topic(session, topic_path, limit, window);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                fprintf(stderr, "Filled %s with %ld events in %.3f s (%ld failed)\n",
+                        topic_path, limit,
+                        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+                        g_bench.append_failures);
+
+                for(int shape = 0; shape < SHAPE_COUNT; shape++) {
+                        long n = 1;
+                        for(;;) {
+                                time_query(session, topic_path, shape, limit, n, repeat, latencies);
+                                if(n == limit) {
+                                        break;
+                                }
+                                n = n * 10 < limit ? n * 10 : limit;
+                        }
+                }
+        }
+        free(limit_list);
+        free(latencies);
+
+        // Remove the benchmark topics.
+        remove_topics(session, root);
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+        return EXIT_SUCCESS;
+}
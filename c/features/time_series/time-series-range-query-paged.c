@@ -0,0 +1,475 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example creates a Time series topic (of String datatype), appends a
+ * sequence of values to it and reads them back a page at a time.
+ *
+ * A single range query returns every selected event in one LIST_T, so
+ * reading a long series that way holds all of it in memory at once. The
+ * page iterator below instead issues a series of range queries, each
+ * selecting at most a page of events starting after the last event of
+ * the previous page, and hands the pages to the caller one by one.
+ *
+ * With prefetching enabled, the query for the following page is issued as
+ * soon as a page is handed to the caller, so it is fetched while the
+ * current page is processed. At most two pages are held at any time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "topic", "Topic name to create and update", ARG_OPTIONAL, ARG_HAS_VALUE, "time-series-range-query-paged"},
+        {'n', "count", "Number of values to append before querying", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        {'s', "page_size", "Maximum number of events in each page", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'f', "prefetch", "Fetch the next page while the current one is processed", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * Iterates over the events of a time series topic a page at a time.
+ */
+typedef struct time_series_page_iterator_s {
+        SESSION_T *session;
+        char *topic_path;
+        int64_t page_size;
+        bool prefetch;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        // Sequence number at which the next page starts.
+        int64_t next_sequence;
+
+        // A page which has been received but not yet handed out.
+        LIST_T *ready;
+
+        bool query_in_flight;
+        bool exhausted;
+        bool failed;
+} TIME_SERIES_PAGE_ITERATOR_T;
+
+
+/*
+ * In the value view an edit event takes the place of the event it edits
+ * but keeps its own, later, sequence number. Pages are positioned by the
+ * original event's sequence number, so that paging doesn't skip the
+ * events between an original and its edit.
+ */
+static int64_t original_sequence(const DIFFUSION_TIME_SERIES_EVENT_T *event)
+{
+        if(!diffusion_time_series_event_is_edit_event(event)) {
+                return diffusion_time_series_event_get_sequence(event);
+        }
+        DIFFUSION_TIME_SERIES_EVENT_METADATA_T *original = diffusion_time_series_event_get_original_event(event);
+        const int64_t sequence = diffusion_time_series_event_metadata_get_sequence(original);
+        diffusion_time_series_event_metadata_free(original);
+        return sequence;
+}
+
+
+static int on_page_result(
+        const DIFFUSION_TIME_SERIES_QUERY_RESULT_T *query_result,
+        void *context)
+{
+        TIME_SERIES_PAGE_ITERATOR_T *iterator = context;
+
+        LIST_T *events = diffusion_time_series_query_result_get_events(query_result);
+        const int size = list_get_size(events);
+
+        pthread_mutex_lock(&iterator->lock);
+        if(size < iterator->page_size) {
+                // A short page means we've reached the end of the series.
+                iterator->exhausted = true;
+        }
+        if(size > 0) {
+                DIFFUSION_TIME_SERIES_EVENT_T *last = list_get_data_indexed(events, size - 1);
+                iterator->next_sequence = original_sequence(last) + 1;
+                iterator->ready = events;
+        }
+        else {
+                list_free(events, (void (*)(void *))diffusion_time_series_event_free);
+        }
+        iterator->query_in_flight = false;
+        pthread_cond_broadcast(&iterator->cond);
+        pthread_mutex_unlock(&iterator->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_page_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        TIME_SERIES_PAGE_ITERATOR_T *iterator = error->context;
+        printf("time series range query error: %s\n", error->message);
+
+        pthread_mutex_lock(&iterator->lock);
+        iterator->failed = true;
+        iterator->query_in_flight = false;
+        pthread_cond_broadcast(&iterator->cond);
+        pthread_mutex_unlock(&iterator->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Issue the query for the page starting at next_sequence. Must be called
+ * with the iterator's lock held, and only when no query is in flight.
+ */
+static void issue_page_query(TIME_SERIES_PAGE_ITERATOR_T *iterator)
+{
+        // "from" anchors the range at the first event at or after the
+        // sequence number, and "next" selects the events following it.
+        DIFFUSION_TIME_SERIES_RANGE_QUERY_T *range_query = diffusion_time_series_range_query();
+        diffusion_time_series_range_query_from(range_query, iterator->next_sequence, NULL);
+        diffusion_time_series_range_query_next(range_query, iterator->page_size - 1, NULL);
+
+        DIFFUSION_TIME_SERIES_RANGE_QUERY_PARAMS_T params = {
+                .topic_path = iterator->topic_path,
+                .range_query = range_query,
+                .on_query_result = on_page_result,
+                .on_error = on_page_error,
+                .context = iterator
+        };
+
+        iterator->query_in_flight = true;
+        if(!diffusion_time_series_select_from(iterator->session, params, NULL)) {
+                iterator->query_in_flight = false;
+                iterator->failed = true;
+        }
+
+        diffusion_time_series_range_query_free(range_query);
+}
+
+
+/*
+ * Create an iterator over the events of a time series topic, starting at
+ * the first event with a sequence number at or after "from_sequence".
+ */
+static TIME_SERIES_PAGE_ITERATOR_T *time_series_page_iterator_create(
+        SESSION_T *session,
+        const char *topic_path,
+        int64_t from_sequence,
+        int64_t page_size,
+        bool prefetch)
+{
+        TIME_SERIES_PAGE_ITERATOR_T *iterator = calloc(1, sizeof(TIME_SERIES_PAGE_ITERATOR_T));
+        iterator->session = session;
+        iterator->topic_path = strdup(topic_path);
+        iterator->page_size = page_size < 1 ? 1 : page_size;
+        iterator->prefetch = prefetch;
+        iterator->next_sequence = from_sequence;
+        pthread_mutex_init(&iterator->lock, NULL);
+        pthread_cond_init(&iterator->cond, NULL);
+
+        if(prefetch) {
+                pthread_mutex_lock(&iterator->lock);
+                issue_page_query(iterator);
+                pthread_mutex_unlock(&iterator->lock);
+        }
+
+        return iterator;
+}
+
+
+/*
+ * Return the next page of events, blocking until it is available. The
+ * caller owns the returned list and must free it with list_free(), using
+ * diffusion_time_series_event_free() to free each event. Returns NULL when
+ * there are no more events, or if a query failed.
+ */
+static LIST_T *time_series_page_iterator_next(TIME_SERIES_PAGE_ITERATOR_T *iterator)
+{
+        pthread_mutex_lock(&iterator->lock);
+
+        if(iterator->ready == NULL && !iterator->query_in_flight
+           && !iterator->exhausted && !iterator->failed) {
+                issue_page_query(iterator);
+        }
+        while(iterator->ready == NULL && iterator->query_in_flight) {
+                pthread_cond_wait(&iterator->cond, &iterator->lock);
+        }
+
+        LIST_T *page = iterator->ready;
+        iterator->ready = NULL;
+
+        if(page != NULL && iterator->prefetch && !iterator->exhausted && !iterator->failed) {
+                issue_page_query(iterator);
+        }
+
+        pthread_mutex_unlock(&iterator->lock);
+        return page;
+}
+
+
+/*
+ * Free the iterator, waiting for any query still in flight to complete.
+ */
+static void time_series_page_iterator_free(TIME_SERIES_PAGE_ITERATOR_T *iterator)
+{
+        pthread_mutex_lock(&iterator->lock);
+        while(iterator->query_in_flight) {
+                pthread_cond_wait(&iterator->cond, &iterator->lock);
+        }
+        if(iterator->ready != NULL) {
+                list_free(iterator->ready, (void (*)(void *))diffusion_time_series_event_free);
+        }
+        pthread_mutex_unlock(&iterator->lock);
+
+        pthread_mutex_destroy(&iterator->lock);
+        pthread_cond_destroy(&iterator->cond);
+        free(iterator->topic_path);
+        free(iterator);
+}
+
+
+// Handlers for add topic feature.
+static int on_topic_added_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_RESULT_CODE result_code,
+        void *context)
+{
+        printf("Added topic \"%s\"\n", (const char *)context);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_failed_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_FAIL_RESULT_CODE result_code,
+        const DIFFUSION_ERROR_T *error,
+        void *context)
+{
+        printf("Failed to add topic \"%s\" (%d)\n", (const char *)context, result_code);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_discard(SESSION_T *session, void *context)
+{
+        return HANDLER_SUCCESS;
+}
+
+
+static ADD_TOPIC_CALLBACK_T create_topic_callback(const char *topic_name)
+{
+        ADD_TOPIC_CALLBACK_T callback = {
+                .on_topic_added_with_specification = on_topic_added_with_specification,
+                .on_topic_add_failed_with_specification = on_topic_add_failed_with_specification,
+                .on_discard = on_topic_add_discard,
+                .context = (char *)topic_name
+        };
+
+        return callback;
+}
+
+
+// Handlers for appending values to the time series topic.
+static pthread_mutex_t g_append_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_append_cond = PTHREAD_COND_INITIALIZER;
+static long g_appends_outstanding = 0;
+
+
+static void append_complete(void)
+{
+        pthread_mutex_lock(&g_append_lock);
+        g_appends_outstanding--;
+        pthread_cond_signal(&g_append_cond);
+        pthread_mutex_unlock(&g_append_lock);
+}
+
+
+static int on_append(
+        const DIFFUSION_TIME_SERIES_EVENT_METADATA_T *event_metadata,
+        void *context)
+{
+        append_complete();
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_append_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        printf("time series append error: %s\n", error->message);
+        append_complete();
+        return HANDLER_SUCCESS;
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *topic_name = hash_get(options, "topic");
+        const long count = atol(hash_get(options, "count"));
+        const long page_size = atol(hash_get(options, "page_size"));
+        const bool prefetch = hash_get(options, "prefetch") != NULL;
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // Create a session with the Diffusion server.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        ADD_TOPIC_CALLBACK_T callback = create_topic_callback(topic_name);
+
+        // Retain every value we append, so that they can all be queried.
+        char retained_range[32];
+        snprintf(retained_range, sizeof(retained_range), "limit %ld", count);
+
+        HASH_T *properties = hash_new(2);
+        hash_add(properties, DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE, "string");
+        hash_add(properties, DIFFUSION_TIME_SERIES_RETAINED_RANGE, retained_range);
+
+        TOPIC_SPECIFICATION_T *spec = topic_specification_init(TOPIC_TYPE_TIME_SERIES);
+        topic_specification_set_properties(spec, properties);
+
+        add_topic_from_specification(session, topic_name, spec, callback);
+
+        // Sleep for a while
+        sleep(5);
+
+        topic_specification_free(spec);
+        hash_free(properties, NULL, NULL);
+
+        // Append the values, then wait for them all to be acknowledged.
+        g_appends_outstanding = count;
+        for(long i = 0; i < count; i++) {
+                char value[32];
+                snprintf(value, sizeof(value), "value %ld", i);
+
+                BUF_T *buf = buf_create();
+                write_diffusion_string_value(value, buf);
+
+                DIFFUSION_TIME_SERIES_APPEND_PARAMS_T params = {
+                        .on_append = on_append,
+                        .on_error = on_append_error,
+                        .topic_path = topic_name,
+                        .datatype = DATATYPE_STRING,
+                        .value = buf
+                };
+                diffusion_time_series_append(session, params, NULL);
+                buf_free(buf);
+        }
+
+        pthread_mutex_lock(&g_append_lock);
+        while(g_appends_outstanding > 0) {
+                pthread_cond_wait(&g_append_cond, &g_append_lock);
+        }
+        pthread_mutex_unlock(&g_append_lock);
+
+        // Read the series back a page at a time.
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        TIME_SERIES_PAGE_ITERATOR_T *iterator =
+                time_series_page_iterator_create(session, topic_name, 0, page_size, prefetch);
+
+        long pages = 0;
+        long events_read = 0;
+        LIST_T *page;
+        while((page = time_series_page_iterator_next(iterator)) != NULL) {
+                const int size = list_get_size(page);
+
+                DIFFUSION_TIME_SERIES_EVENT_T *first = list_get_data_indexed(page, 0);
+                DIFFUSION_TIME_SERIES_EVENT_T *last = list_get_data_indexed(page, size - 1);
+                printf("Page %ld: %d events, sequences %" PRId64 " to %" PRId64 "\n",
+                       pages, size,
+                       diffusion_time_series_event_get_sequence(first),
+                       diffusion_time_series_event_get_sequence(last));
+
+                for(int i = 0; i < size; i++) {
+                        DIFFUSION_TIME_SERIES_EVENT_T *event = list_get_data_indexed(page, i);
+
+                        char *val;
+                        DIFFUSION_VALUE_T *value = diffusion_time_series_event_get_value(event);
+                        read_diffusion_string_value(value, &val, NULL);
+
+                        // Process the event here.
+
+                        diffusion_value_free(value);
+                        free(val);
+                }
+
+                events_read += size;
+                pages++;
+                list_free(page, (void (*)(void *))diffusion_time_series_event_free);
+        }
+
+        const bool failed = iterator->failed;
+        time_series_page_iterator_free(iterator);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Read %ld events in %ld pages in %.3f s%s (at most %ld events held at once)\n",
+               events_read, pages, seconds, failed ? ", query failed" : "",
+               prefetch ? 2 * page_size : page_size);
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+        return EXIT_SUCCESS;
+}
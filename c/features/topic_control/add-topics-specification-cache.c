@@ -0,0 +1,513 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example shows how to intern topic specifications when creating
+ * many topics that share the same type and properties.
+ *
+ * Building a TOPIC_SPECIFICATION_T (and the HASH_T of its properties)
+ * for every topic and freeing it again afterwards is wasted work when the
+ * specifications are identical. The specification cache below keys each
+ * specification on its topic type and properties and hands back the same
+ * object for every request, so it is built only once.
+ *
+ * The example creates the same number of topics with and without the
+ * cache, and reports the time spent building specifications and the
+ * overall creation throughput for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+// Initial number of slots in the cache; must be a power of two.
+#define SPECIFICATION_CACHE_INITIAL_SLOTS 64
+
+// Maximum length of a cache key (type and properties).
+#define SPECIFICATION_CACHE_MAX_KEY 1024
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'r', "topic_root", "Root of the topics created by the benchmark", ARG_OPTIONAL, ARG_HAS_VALUE, "specification-cache"},
+        {'n', "count", "Number of topics to create in each run", ARG_OPTIONAL, ARG_HAS_VALUE, "10000"},
+        {'w', "window", "Maximum number of topic additions in flight", ARG_OPTIONAL, ARG_HAS_VALUE, "500"},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * A cached specification, together with the properties it was created
+ * from, which must outlive it.
+ */
+typedef struct specification_cache_entry_s {
+        char *key;
+        unsigned long hash;
+        TOPIC_SPECIFICATION_T *specification;
+        HASH_T *properties;
+} SPECIFICATION_CACHE_ENTRY_T;
+
+
+/*
+ * An open addressing hash table of interned specifications. Lookups are
+ * serialised with a mutex so the cache can be shared between threads.
+ */
+typedef struct specification_cache_s {
+        pthread_mutex_t lock;
+        SPECIFICATION_CACHE_ENTRY_T *entries;
+        unsigned long slots;
+        unsigned long size;
+        unsigned long hits;
+        unsigned long misses;
+} SPECIFICATION_CACHE_T;
+
+
+static SPECIFICATION_CACHE_T *specification_cache_create(void)
+{
+        SPECIFICATION_CACHE_T *cache = calloc(1, sizeof(SPECIFICATION_CACHE_T));
+        pthread_mutex_init(&cache->lock, NULL);
+        cache->slots = SPECIFICATION_CACHE_INITIAL_SLOTS;
+        cache->entries = calloc(cache->slots, sizeof(SPECIFICATION_CACHE_ENTRY_T));
+        return cache;
+}
+
+
+static void specification_cache_free(SPECIFICATION_CACHE_T *cache)
+{
+        for(unsigned long i = 0; i < cache->slots; i++) {
+                SPECIFICATION_CACHE_ENTRY_T *entry = &cache->entries[i];
+                if(entry->key != NULL) {
+                        topic_specification_free(entry->specification);
+                        hash_free(entry->properties, NULL, NULL);
+                        free(entry->key);
+                }
+        }
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->entries);
+        free(cache);
+}
+
+
+// 64-bit FNV-1a.
+static unsigned long hash_key(const char *key, size_t length)
+{
+        unsigned long long hash = 14695981039346656037ULL;
+        for(size_t i = 0; i < length; i++) {
+                hash ^= (unsigned char)key[i];
+                hash *= 1099511628211ULL;
+        }
+        return (unsigned long)hash;
+}
+
+
+static int compare_property_names(const void *a, const void *b)
+{
+        return strcmp(**(const char * const * const *)a, **(const char * const * const *)b);
+}
+
+
+/*
+ * Build the canonical key for a topic type and a NULL terminated list of
+ * property name/value pairs. Properties are sorted by name so that the
+ * order they are supplied in doesn't matter. Returns the key length, or
+ * -1 if the key doesn't fit.
+ */
+static int build_key(
+        TOPIC_TYPE_T topic_type,
+        const char **properties,
+        char *key,
+        size_t capacity)
+{
+        const char **pairs[32];
+        int count = 0;
+        for(const char **p = properties; p != NULL && *p != NULL; p += 2) {
+                if(count == sizeof(pairs) / sizeof(pairs[0])) {
+                        return -1;
+                }
+                pairs[count++] = p;
+        }
+        qsort(pairs, count, sizeof(pairs[0]), compare_property_names);
+
+        int length = snprintf(key, capacity, "%d", topic_type);
+        for(int i = 0; i < count && length >= 0 && (size_t)length < capacity; i++) {
+                // Separate fields with characters which can't appear in them.
+                length += snprintf(key + length, capacity - length, "\x1f%s\x1e%s", pairs[i][0], pairs[i][1]);
+        }
+        if(length < 0 || (size_t)length >= capacity) {
+                return -1;
+        }
+        return length;
+}
+
+
+static void specification_cache_grow(SPECIFICATION_CACHE_T *cache)
+{
+        SPECIFICATION_CACHE_ENTRY_T *old_entries = cache->entries;
+        unsigned long old_slots = cache->slots;
+
+        cache->slots *= 2;
+        cache->entries = calloc(cache->slots, sizeof(SPECIFICATION_CACHE_ENTRY_T));
+        for(unsigned long i = 0; i < old_slots; i++) {
+                if(old_entries[i].key != NULL) {
+                        unsigned long slot = old_entries[i].hash & (cache->slots - 1);
+                        while(cache->entries[slot].key != NULL) {
+                                slot = (slot + 1) & (cache->slots - 1);
+                        }
+                        cache->entries[slot] = old_entries[i];
+                }
+        }
+        free(old_entries);
+}
+
+
+/*
+ * Return the interned specification for a topic type and a NULL
+ * terminated list of property name/value pairs, creating it on first
+ * use. The specification is owned by the cache and must not be freed by
+ * the caller. Returns NULL if the properties are too large to be cached.
+ */
+static const TOPIC_SPECIFICATION_T *specification_cache_get(
+        SPECIFICATION_CACHE_T *cache,
+        TOPIC_TYPE_T topic_type,
+        const char **properties)
+{
+        char key[SPECIFICATION_CACHE_MAX_KEY];
+        int length = build_key(topic_type, properties, key, sizeof(key));
+        if(length < 0) {
+                return NULL;
+        }
+        unsigned long hash = hash_key(key, length);
+
+        pthread_mutex_lock(&cache->lock);
+
+        unsigned long slot = hash & (cache->slots - 1);
+        while(cache->entries[slot].key != NULL) {
+                SPECIFICATION_CACHE_ENTRY_T *entry = &cache->entries[slot];
+                if(entry->hash == hash && strcmp(entry->key, key) == 0) {
+                        cache->hits++;
+                        pthread_mutex_unlock(&cache->lock);
+                        return entry->specification;
+                }
+                slot = (slot + 1) & (cache->slots - 1);
+        }
+
+        // Not found; create and insert it, keeping the load factor under 0.5.
+        cache->misses++;
+
+        HASH_T *properties_hash = hash_new(8);
+        for(const char **p = properties; p != NULL && *p != NULL; p += 2) {
+                hash_add(properties_hash, p[0], p[1]);
+        }
+
+        SPECIFICATION_CACHE_ENTRY_T *entry = &cache->entries[slot];
+        entry->key = strdup(key);
+        entry->hash = hash;
+        entry->properties = properties_hash;
+        entry->specification = topic_specification_init_with_properties(topic_type, properties_hash);
+        const TOPIC_SPECIFICATION_T *specification = entry->specification;
+
+        if(++cache->size * 2 > cache->slots) {
+                specification_cache_grow(cache);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        return specification;
+}
+
+
+/*
+ * Tracks the topic additions in flight for a benchmark run.
+ */
+typedef struct run_state_s {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long in_flight;
+        long added;
+        long failed;
+        int removed;
+} RUN_STATE_T;
+
+
+static RUN_STATE_T g_run = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void complete_add(bool success)
+{
+        pthread_mutex_lock(&g_run.lock);
+        if(success) {
+                g_run.added++;
+        }
+        else {
+                g_run.failed++;
+        }
+        g_run.in_flight--;
+        pthread_cond_signal(&g_run.cond);
+        pthread_mutex_unlock(&g_run.lock);
+}
+
+
+static int on_topic_added_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_RESULT_CODE result_code,
+        void *context)
+{
+        complete_add(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_failed_with_specification(
+        SESSION_T *session,
+        TOPIC_ADD_FAIL_RESULT_CODE result_code,
+        const DIFFUSION_ERROR_T *error,
+        void *context)
+{
+        complete_add(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_add_discard(SESSION_T *session, void *context)
+{
+        complete_add(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_removed(
+        SESSION_T *session,
+        const DIFFUSION_TOPIC_REMOVAL_RESULT_T *response,
+        void *context)
+{
+        pthread_mutex_lock(&g_run.lock);
+        g_run.removed = 1;
+        pthread_cond_signal(&g_run.cond);
+        pthread_mutex_unlock(&g_run.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_remove_discard(SESSION_T *session, void *context)
+{
+        return on_topic_removed(session, NULL, context);
+}
+
+
+static double elapsed_seconds(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/*
+ * Create "count" time series topics below "root", either building a new
+ * specification for each one or taking it from the cache, and report
+ * the results.
+ */
+static void run_benchmark(
+        SESSION_T *session,
+        const char *root,
+        long count,
+        long window,
+        SPECIFICATION_CACHE_T *cache)
+{
+        const char *mode = cache == NULL ? "uncached" : "cached";
+
+        // The same properties are used for every topic.
+        const char *properties[] = {
+                DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE, "string",
+                DIFFUSION_TIME_SERIES_RETAINED_RANGE, "limit 10",
+                DIFFUSION_VALIDATE_VALUES, "true",
+                NULL
+        };
+
+        ADD_TOPIC_CALLBACK_T callback = {
+                .on_topic_added_with_specification = on_topic_added_with_specification,
+                .on_topic_add_failed_with_specification = on_topic_add_failed_with_specification,
+                .on_discard = on_topic_add_discard
+        };
+
+        g_run.added = 0;
+        g_run.failed = 0;
+        double specification_seconds = 0;
+        char topic_path[256];
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(long i = 0; i < count; i++) {
+                snprintf(topic_path, sizeof(topic_path), "%s/%s/%ld", root, mode, i);
+
+                pthread_mutex_lock(&g_run.lock);
+                while(g_run.in_flight >= window) {
+                        pthread_cond_wait(&g_run.cond, &g_run.lock);
+                }
+                g_run.in_flight++;
+                pthread_mutex_unlock(&g_run.lock);
+
+                struct timespec specification_start;
+                clock_gettime(CLOCK_MONOTONIC, &specification_start);
+
+                // The cache declines specifications it can't key, so fall
+                // back to building one for this topic.
+                const TOPIC_SPECIFICATION_T *cached = NULL;
+                if(cache != NULL) {
+                        cached = specification_cache_get(cache, TOPIC_TYPE_TIME_SERIES, properties);
+                }
+
+                if(cached != NULL) {
+                        specification_seconds += elapsed_seconds(&specification_start);
+
+                        add_topic_from_specification(session, topic_path, cached, callback);
+                }
+                else {
+                        HASH_T *properties_hash = hash_new(8);
+                        for(const char **p = properties; *p != NULL; p += 2) {
+                                hash_add(properties_hash, p[0], p[1]);
+                        }
+                        TOPIC_SPECIFICATION_T *specification =
+                                topic_specification_init_with_properties(TOPIC_TYPE_TIME_SERIES, properties_hash);
+                        specification_seconds += elapsed_seconds(&specification_start);
+
+                        add_topic_from_specification(session, topic_path, specification, callback);
+
+                        clock_gettime(CLOCK_MONOTONIC, &specification_start);
+                        topic_specification_free(specification);
+                        hash_free(properties_hash, NULL, NULL);
+                        specification_seconds += elapsed_seconds(&specification_start);
+                }
+        }
+
+        // Wait for the remaining additions to complete.
+        pthread_mutex_lock(&g_run.lock);
+        while(g_run.in_flight > 0) {
+                pthread_cond_wait(&g_run.cond, &g_run.lock);
+        }
+        pthread_mutex_unlock(&g_run.lock);
+
+        const double seconds = elapsed_seconds(&start);
+
+        printf("%-8s: %ld topics in %.3f s (%.0f topics/sec), %ld failed\n",
+               mode, count, seconds, seconds > 0 ? count / seconds : 0.0, g_run.failed);
+        printf("%-8s  specification handling %.3f ms total, %.3f us/topic\n",
+               "", specification_seconds * 1e3, specification_seconds * 1e6 / count);
+
+        // Remove the topics again before the next run.
+        char selector[256];
+        snprintf(selector, sizeof(selector), "?%s/%s//", root, mode);
+
+        TOPIC_REMOVAL_PARAMS_T remove_params = {
+                .on_removed = on_topic_removed,
+                .on_discard = on_topic_remove_discard,
+                .topic_selector = selector
+        };
+
+        pthread_mutex_lock(&g_run.lock);
+        g_run.removed = 0;
+        pthread_mutex_unlock(&g_run.lock);
+
+        topic_removal(session, remove_params);
+
+        pthread_mutex_lock(&g_run.lock);
+        while(!g_run.removed) {
+                pthread_cond_wait(&g_run.cond, &g_run.lock);
+        }
+        pthread_mutex_unlock(&g_run.lock);
+}
+
+
+int main(int argc, char** argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+        const char *topic_root = hash_get(options, "topic_root");
+        const long count = atol(hash_get(options, "count"));
+        const long window = atol(hash_get(options, "window"));
+        if(count < 1 || window < 1) {
+                fprintf(stderr, "count and window must both be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        // Setup for session
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Create the topics building a specification for each one,
+         * then again using interned specifications.
+         */
+        run_benchmark(session, topic_root, count, window, NULL);
+
+        SPECIFICATION_CACHE_T *cache = specification_cache_create();
+        run_benchmark(session, topic_root, count, window, cache);
+        printf("Specification cache: %lu entries, %lu hits, %lu misses\n",
+               cache->size, cache->hits, cache->misses);
+        specification_cache_free(cache);
+
+        /*
+         * Close our session, and release resources and memory.
+         */
+        session_close(session, NULL);
+        session_free(session);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,696 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example creates topics on demand when sessions subscribe to paths
+ * that don't exist, loading their values from a backing store.
+ *
+ * The missing topic handler does no work itself. It records the path in a
+ * table of pending paths and queues it for a pool of worker threads, so
+ * repeated notifications for a path that is already being created are
+ * coalesced into one. The handler runs on the session's callback thread,
+ * so it never waits: if the queue is full the notification is dropped and
+ * counted, and the topic is created on a later notification for the path.
+ * A worker looks the value up in an LRU cache, falling
+ * back to the backing store on a miss, then creates the topic with its
+ * value using add-and-set. The time from notification to the topic being
+ * created is recorded, and percentiles are reported periodically.
+ *
+ * Backing stores implement the BACKING_STORE_T interface. Two are
+ * provided:
+ *
+ *   dir:<directory>  reads the JSON value of topic a/b/c from the file
+ *                    <directory>/a/b/c.json
+ *   synthetic:<ms>   generates a JSON value for any path, taking the given
+ *                    number of milliseconds, as a stand-in for a database
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'r', "topic_root", "Topic root to process missing topic notifications on", ARG_OPTIONAL, ARG_HAS_VALUE, "foo"},
+        {'b', "store", "Backing store, dir:<directory> or synthetic:<milliseconds>", ARG_OPTIONAL, ARG_HAS_VALUE, "synthetic:1"},
+        {'w', "workers", "Number of worker threads", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'l', "cache", "Number of values held in the LRU cache", ARG_OPTIONAL, ARG_HAS_VALUE, "10000"},
+        {'q', "queue", "Maximum number of notifications waiting for a worker; more are dropped", ARG_OPTIONAL, ARG_HAS_VALUE, "10000"},
+        {'i', "interval", "Seconds between reports", ARG_OPTIONAL, ARG_HAS_VALUE, "10"},
+        {'s', "seconds", "Number of seconds to run for before exiting", ARG_OPTIONAL, ARG_HAS_VALUE, "300"},
+        END_OF_ARG_OPTS
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * Backing stores.
+ */
+typedef struct backing_store_s BACKING_STORE_T;
+
+struct backing_store_s {
+        /*
+         * Load the value for a topic path. On success, stores a JSON string
+         * that the caller must free in *value and returns true. Returns
+         * false if the store has no value for the path. Must be safe to
+         * call from several threads at once.
+         */
+        bool (*load)(BACKING_STORE_T *store, const char *topic_path, char **value);
+        void (*close)(BACKING_STORE_T *store);
+        void *state;
+};
+
+
+static bool directory_store_load(BACKING_STORE_T *store, const char *topic_path, char **value)
+{
+        // Don't let topic paths reach outside the directory.
+        if(strstr(topic_path, "..") != NULL) {
+                return false;
+        }
+
+        const char *directory = store->state;
+        char *file_name = malloc(strlen(directory) + strlen(topic_path) + 7);
+        sprintf(file_name, "%s/%s.json", directory, topic_path);
+
+        FILE *file = fopen(file_name, "rb");
+        free(file_name);
+        if(file == NULL) {
+                return false;
+        }
+
+        size_t length = 0;
+        size_t capacity = 1024;
+        char *contents = malloc(capacity);
+        size_t read;
+        while((read = fread(contents + length, 1, capacity - length - 1, file)) > 0) {
+                length += read;
+                if(length == capacity - 1) {
+                        capacity *= 2;
+                        contents = realloc(contents, capacity);
+                }
+        }
+        contents[length] = '\0';
+        fclose(file);
+
+        *value = contents;
+        return true;
+}
+
+
+static void directory_store_close(BACKING_STORE_T *store)
+{
+        free(store->state);
+}
+
+
+static bool synthetic_store_load(BACKING_STORE_T *store, const char *topic_path, char **value)
+{
+        const long delay_ms = (long)(intptr_t)store->state;
+        if(delay_ms > 0) {
+                const struct timespec delay = { delay_ms / 1000, (delay_ms % 1000) * 1000000 };
+                nanosleep(&delay, NULL);
+        }
+
+        *value = malloc(strlen(topic_path) + 64);
+        sprintf(*value, "{\"path\":\"%s\",\"loaded\":%lld}", topic_path, (long long)time(NULL));
+        return true;
+}
+
+
+static void synthetic_store_close(BACKING_STORE_T *store)
+{
+}
+
+
+static bool backing_store_open(const char *description, BACKING_STORE_T *store)
+{
+        if(strncmp(description, "dir:", 4) == 0) {
+                store->load = directory_store_load;
+                store->close = directory_store_close;
+                store->state = strdup(description + 4);
+                return true;
+        }
+        if(strncmp(description, "synthetic:", 10) == 0) {
+                store->load = synthetic_store_load;
+                store->close = synthetic_store_close;
+                store->state = (void *)(intptr_t)atol(description + 10);
+                return true;
+        }
+        return false;
+}
+
+
+/*
+ * LRU cache of topic values, in front of the backing store. Entries are
+ * chained in a hash table for lookup and in a doubly linked list in order
+ * of use, so lookups, insertions and evictions are all constant time.
+ */
+typedef struct cache_entry_s {
+        char *topic_path;
+        char *value;
+        uint32_t hash;
+        struct cache_entry_s *bucket_next;
+        struct cache_entry_s *newer;
+        struct cache_entry_s *older;
+} CACHE_ENTRY_T;
+
+
+typedef struct lru_cache_s {
+        pthread_mutex_t lock;
+        CACHE_ENTRY_T **buckets;
+        uint32_t bucket_count;
+        long size;
+        long capacity;
+        CACHE_ENTRY_T *newest;
+        CACHE_ENTRY_T *oldest;
+        long hits;
+        long misses;
+} LRU_CACHE_T;
+
+
+static uint32_t hash_string(const char *s)
+{
+        uint32_t hash = 2166136261u;
+        while(*s != '\0') {
+                hash = (hash ^ (unsigned char)*s++) * 16777619u;
+        }
+        return hash;
+}
+
+
+static void lru_cache_init(LRU_CACHE_T *cache, long capacity)
+{
+        memset(cache, 0, sizeof(LRU_CACHE_T));
+        pthread_mutex_init(&cache->lock, NULL);
+        cache->capacity = capacity;
+        cache->bucket_count = 16;
+        while(cache->bucket_count < capacity) {
+                cache->bucket_count *= 2;
+        }
+        cache->buckets = calloc(cache->bucket_count, sizeof(CACHE_ENTRY_T *));
+}
+
+
+static void lru_unlink(LRU_CACHE_T *cache, CACHE_ENTRY_T *entry)
+{
+        if(entry->newer != NULL) {
+                entry->newer->older = entry->older;
+        }
+        else {
+                cache->newest = entry->older;
+        }
+        if(entry->older != NULL) {
+                entry->older->newer = entry->newer;
+        }
+        else {
+                cache->oldest = entry->newer;
+        }
+}
+
+
+static void lru_push_newest(LRU_CACHE_T *cache, CACHE_ENTRY_T *entry)
+{
+        entry->newer = NULL;
+        entry->older = cache->newest;
+        if(cache->newest != NULL) {
+                cache->newest->newer = entry;
+        }
+        cache->newest = entry;
+        if(cache->oldest == NULL) {
+                cache->oldest = entry;
+        }
+}
+
+
+// Returns a copy of the cached value, or NULL.
+static char *lru_cache_get(LRU_CACHE_T *cache, const char *topic_path)
+{
+        const uint32_t hash = hash_string(topic_path);
+        char *value = NULL;
+
+        pthread_mutex_lock(&cache->lock);
+        for(CACHE_ENTRY_T *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+            entry != NULL;
+            entry = entry->bucket_next) {
+                if(entry->hash == hash && strcmp(entry->topic_path, topic_path) == 0) {
+                        lru_unlink(cache, entry);
+                        lru_push_newest(cache, entry);
+                        value = strdup(entry->value);
+                        break;
+                }
+        }
+        if(value != NULL) {
+                cache->hits++;
+        }
+        else {
+                cache->misses++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return value;
+}
+
+
+static void lru_cache_put(LRU_CACHE_T *cache, const char *topic_path, const char *value)
+{
+        if(cache->capacity < 1) {
+                return;
+        }
+
+        const uint32_t hash = hash_string(topic_path);
+
+        pthread_mutex_lock(&cache->lock);
+        CACHE_ENTRY_T **bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+        for(CACHE_ENTRY_T *entry = *bucket; entry != NULL; entry = entry->bucket_next) {
+                if(entry->hash == hash && strcmp(entry->topic_path, topic_path) == 0) {
+                        free(entry->value);
+                        entry->value = strdup(value);
+                        lru_unlink(cache, entry);
+                        lru_push_newest(cache, entry);
+                        pthread_mutex_unlock(&cache->lock);
+                        return;
+                }
+        }
+
+        if(cache->size == cache->capacity) {
+                // Evict the least recently used entry.
+                CACHE_ENTRY_T *oldest = cache->oldest;
+                lru_unlink(cache, oldest);
+                CACHE_ENTRY_T **link = &cache->buckets[oldest->hash & (cache->bucket_count - 1)];
+                while(*link != oldest) {
+                        link = &(*link)->bucket_next;
+                }
+                *link = oldest->bucket_next;
+                free(oldest->topic_path);
+                free(oldest->value);
+                free(oldest);
+                cache->size--;
+        }
+
+        CACHE_ENTRY_T *entry = calloc(1, sizeof(CACHE_ENTRY_T));
+        entry->topic_path = strdup(topic_path);
+        entry->value = strdup(value);
+        entry->hash = hash;
+        entry->bucket_next = *bucket;
+        *bucket = entry;
+        lru_push_newest(cache, entry);
+        cache->size++;
+        pthread_mutex_unlock(&cache->lock);
+}
+
+
+static void lru_cache_free(LRU_CACHE_T *cache)
+{
+        CACHE_ENTRY_T *entry = cache->newest;
+        while(entry != NULL) {
+                CACHE_ENTRY_T *older = entry->older;
+                free(entry->topic_path);
+                free(entry->value);
+                free(entry);
+                entry = older;
+        }
+        free(cache->buckets);
+        pthread_mutex_destroy(&cache->lock);
+}
+
+
+/*
+ * The materializer: a queue of paths to create, the workers that take
+ * from it, and the table of paths queued or being created.
+ */
+typedef struct job_s {
+        char *topic_path;
+        int64_t notified_ns;
+} JOB_T;
+
+
+#define MAX_LATENCIES 1000000
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+
+        JOB_T *queue;
+        long queue_capacity;
+        long queue_head;
+        long queue_length;
+        bool stopping;
+
+        // Paths queued or being created, to coalesce duplicate notifications.
+        HASH_T *pending;
+
+        SESSION_T *session;
+        TOPIC_SPECIFICATION_T *specification;
+        BACKING_STORE_T store;
+        LRU_CACHE_T cache;
+
+        long notifications;
+        long coalesced;
+        long dropped;
+        long created;
+        long not_found;
+        long failed;
+
+        // Notification to creation latencies since the last report, in microseconds.
+        uint32_t *latencies;
+        long latency_count;
+} g_materializer = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER
+};
+
+
+// Called with the lock held once a path has been dealt with.
+static void job_finished(JOB_T *job)
+{
+        hash_del(g_materializer.pending, job->topic_path);
+        free(job->topic_path);
+        free(job);
+}
+
+
+static int on_topic_materialized(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        JOB_T *job = context;
+        const int64_t us = (monotonic_ns() - job->notified_ns) / 1000;
+
+        pthread_mutex_lock(&g_materializer.lock);
+        g_materializer.created++;
+        if(g_materializer.latency_count < MAX_LATENCIES) {
+                g_materializer.latencies[g_materializer.latency_count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+        }
+        job_finished(job);
+        pthread_mutex_unlock(&g_materializer.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_materialize_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        JOB_T *job = error->context;
+        printf("Failed to create \"%s\": %s\n", job->topic_path, error->message);
+
+        pthread_mutex_lock(&g_materializer.lock);
+        g_materializer.failed++;
+        job_finished(job);
+        pthread_mutex_unlock(&g_materializer.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_materialize_discard(SESSION_T *session, void *context)
+{
+        pthread_mutex_lock(&g_materializer.lock);
+        g_materializer.failed++;
+        job_finished(context);
+        pthread_mutex_unlock(&g_materializer.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static void *worker_run(void *arg)
+{
+        for(;;) {
+                pthread_mutex_lock(&g_materializer.lock);
+                while(g_materializer.queue_length == 0 && !g_materializer.stopping) {
+                        pthread_cond_wait(&g_materializer.not_empty, &g_materializer.lock);
+                }
+                if(g_materializer.queue_length == 0) {
+                        pthread_mutex_unlock(&g_materializer.lock);
+                        return NULL;
+                }
+                JOB_T *job = malloc(sizeof(JOB_T));
+                *job = g_materializer.queue[g_materializer.queue_head];
+                g_materializer.queue_head = (g_materializer.queue_head + 1) % g_materializer.queue_capacity;
+                g_materializer.queue_length--;
+                pthread_mutex_unlock(&g_materializer.lock);
+
+                char *value = lru_cache_get(&g_materializer.cache, job->topic_path);
+                if(value == NULL && g_materializer.store.load(&g_materializer.store, job->topic_path, &value)) {
+                        lru_cache_put(&g_materializer.cache, job->topic_path, value);
+                }
+
+                if(value == NULL) {
+                        pthread_mutex_lock(&g_materializer.lock);
+                        g_materializer.not_found++;
+                        job_finished(job);
+                        pthread_mutex_unlock(&g_materializer.lock);
+                        continue;
+                }
+
+                BUF_T *update_buf = buf_create();
+                write_diffusion_json_value(value, update_buf);
+                free(value);
+
+                DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T params = {
+                        .topic_path = job->topic_path,
+                        .specification = g_materializer.specification,
+                        .datatype = DATATYPE_JSON,
+                        .update = update_buf,
+                        .on_topic_update_add_and_set = on_topic_materialized,
+                        .on_error = on_materialize_error,
+                        .on_discard = on_materialize_discard,
+                        .context = job
+                };
+                diffusion_topic_update_add_and_set(g_materializer.session, params);
+                buf_free(update_buf);
+        }
+}
+
+
+/*
+ * A request has been made for a topic that doesn't exist. Queue it for
+ * the workers, unless it's already queued or being created.
+ */
+static int on_missing_topic(
+        SESSION_T *session,
+        const SVC_MISSING_TOPIC_REQUEST_T *request,
+        void *context)
+{
+        const int64_t notified_ns = monotonic_ns();
+
+        // Selectors for missing topics are path selectors, ">path".
+        const char *topic_path = request->topic_selector + 1;
+
+        pthread_mutex_lock(&g_materializer.lock);
+        g_materializer.notifications++;
+
+        if(hash_get(g_materializer.pending, topic_path) != NULL) {
+                g_materializer.coalesced++;
+                pthread_mutex_unlock(&g_materializer.lock);
+                return HANDLER_SUCCESS;
+        }
+
+        // Never block the callback thread; it also delivers the add-and-set
+        // completions that let the workers make progress.
+        if(g_materializer.queue_length == g_materializer.queue_capacity) {
+                g_materializer.dropped++;
+                pthread_mutex_unlock(&g_materializer.lock);
+                return HANDLER_SUCCESS;
+        }
+
+        hash_add(g_materializer.pending, topic_path, "");
+
+        const long tail = (g_materializer.queue_head + g_materializer.queue_length) % g_materializer.queue_capacity;
+        g_materializer.queue[tail].topic_path = strdup(topic_path);
+        g_materializer.queue[tail].notified_ns = notified_ns;
+        g_materializer.queue_length++;
+        pthread_cond_signal(&g_materializer.not_empty);
+        pthread_mutex_unlock(&g_materializer.lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+static void report(void)
+{
+        pthread_mutex_lock(&g_materializer.lock);
+        const long count = g_materializer.latency_count;
+        qsort(g_materializer.latencies, count, sizeof(uint32_t), compare_latencies);
+
+        printf("notifications %ld, coalesced %ld, dropped %ld, created %ld, not found %ld, failed %ld, queued %ld\n",
+               g_materializer.notifications, g_materializer.coalesced, g_materializer.dropped, g_materializer.created,
+               g_materializer.not_found, g_materializer.failed, g_materializer.queue_length);
+        if(count > 0) {
+                printf("  notification to topic (us): p50 %u, p99 %u, p99.9 %u, max %u over %ld topics\n",
+                       percentile(g_materializer.latencies, count, 50),
+                       percentile(g_materializer.latencies, count, 99),
+                       percentile(g_materializer.latencies, count, 99.9),
+                       g_materializer.latencies[count - 1], count);
+        }
+        g_materializer.latency_count = 0;
+        pthread_mutex_unlock(&g_materializer.lock);
+
+        pthread_mutex_lock(&g_materializer.cache.lock);
+        printf("  cache: %ld entries, %ld hits, %ld misses\n",
+               g_materializer.cache.size, g_materializer.cache.hits, g_materializer.cache.misses);
+        pthread_mutex_unlock(&g_materializer.cache.lock);
+}
+
+
+// Entry point for the example.
+int main(int argc, char **argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *topic_root = hash_get(options, "topic_root");
+        const char *password = hash_get(options, "credentials");
+        const int worker_count = atoi(hash_get(options, "workers"));
+        const long cache_size = atol(hash_get(options, "cache"));
+        const long queue_size = atol(hash_get(options, "queue"));
+        const long interval = atol(hash_get(options, "interval"));
+        const long seconds = atol(hash_get(options, "seconds"));
+
+        if(worker_count < 1 || queue_size < 1 || interval < 1) {
+                fprintf(stderr, "workers, queue and interval must all be at least 1\n");
+                return EXIT_FAILURE;
+        }
+        if(!backing_store_open(hash_get(options, "store"), &g_materializer.store)) {
+                fprintf(stderr, "Unknown backing store \"%s\"\n", (char *)hash_get(options, "store"));
+                return EXIT_FAILURE;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session != NULL) {
+                char *session_id = session_id_to_string(session->id);
+                printf("Session created (state=%d, id=%s)\n",
+                       session_state_get(session), session_id);
+                free(session_id);
+        }
+        else {
+                printf("Failed to create session: %s\n", error.message);
+                free(error.message);
+                return EXIT_FAILURE;
+        }
+
+        g_materializer.session = session;
+        g_materializer.specification = topic_specification_init(TOPIC_TYPE_JSON);
+        g_materializer.queue = calloc(queue_size, sizeof(JOB_T));
+        g_materializer.queue_capacity = queue_size;
+        g_materializer.pending = hash_new(queue_size > 16 ? queue_size : 16);
+        g_materializer.latencies = malloc(MAX_LATENCIES * sizeof(uint32_t));
+        lru_cache_init(&g_materializer.cache, cache_size);
+
+        pthread_t *workers = calloc(worker_count, sizeof(pthread_t));
+        for(int i = 0; i < worker_count; i++) {
+                pthread_create(&workers[i], NULL, worker_run, NULL);
+        }
+
+        // Register the missing topic handler
+        MISSING_TOPIC_PARAMS_T handler = {
+                .on_missing_topic = on_missing_topic,
+                .topic_path = topic_root,
+                .context = NULL
+        };
+
+        missing_topic_register_handler(session, handler);
+
+        // Report periodically until it's time to stop.
+        const time_t end_time = time(NULL) + seconds;
+        while(time(NULL) < end_time) {
+                sleep(interval);
+                report();
+        }
+
+        // Let the workers drain the queue, then stop them.
+        pthread_mutex_lock(&g_materializer.lock);
+        g_materializer.stopping = true;
+        pthread_cond_broadcast(&g_materializer.not_empty);
+        pthread_mutex_unlock(&g_materializer.lock);
+
+        for(int i = 0; i < worker_count; i++) {
+                pthread_join(workers[i], NULL);
+        }
+        free(workers);
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        g_materializer.store.close(&g_materializer.store);
+        lru_cache_free(&g_materializer.cache);
+        topic_specification_free(g_materializer.specification);
+        hash_free(g_materializer.pending, NULL, NULL);
+        free(g_materializer.queue);
+        free(g_materializer.latencies);
+
+        hash_free(options, NULL, free);
+        credentials_free(credentials);
+
+        return EXIT_SUCCESS;
+}
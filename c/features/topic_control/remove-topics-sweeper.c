@@ -0,0 +1,590 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example removes a large number of topics, read from a file with
+ * one entry per line, using as few removal requests as it can.
+ *
+ * Each line is one of:
+ *
+ *   a/b/c  or  >a/b/c    remove the topic a/b/c
+ *   a/b//  or  ?a/b//    remove a/b and every topic beneath it
+ *   any other selector   passed to the server unchanged
+ *
+ * The paths are loaded into a trie keyed on path segments. A subtree
+ * removal covers everything beneath it, so entries below one are
+ * dropped. Topics that share a parent are merged into a single selector
+ * matching any of their names, for example ?a/b/(c|d|e). The resulting
+ * selectors are then packed into selector sets and the removals are sent
+ * concurrently, with a limit on the number outstanding.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+
+// Topic selector, selector set delimiter
+#define DELIM "////"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'f', "file", "File of topic paths and selectors to remove, - for stdin", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'a', "alternatives", "Maximum number of sibling topics merged into one selector", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'s', "set_size", "Maximum number of selectors in each removal request", ARG_OPTIONAL, ARG_HAS_VALUE, "20"},
+        {'w', "window", "Maximum number of removal requests outstanding", ARG_OPTIONAL, ARG_HAS_VALUE, "16"},
+        {'d', "dry_run", "Print the selectors without removing anything", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * Path segment trie. Children are kept in a list; because the input is
+ * sorted before it's inserted, a new segment is almost always the same
+ * as, or follows, the most recently added child, which is checked first.
+ */
+typedef struct trie_node_s {
+        char *segment;
+        struct trie_node_s *first_child;
+        struct trie_node_s *last_child;
+        struct trie_node_s *next_sibling;
+        bool remove_topic;      // Remove the topic at this path
+        bool remove_subtree;    // Remove this path and everything beneath it
+} TRIE_NODE_T;
+
+
+static TRIE_NODE_T *trie_child(TRIE_NODE_T *node, const char *segment, size_t length)
+{
+        TRIE_NODE_T *child = node->last_child;
+        if(child == NULL
+           || strncmp(child->segment, segment, length) != 0
+           || child->segment[length] != '\0') {
+                for(child = node->first_child; child != NULL; child = child->next_sibling) {
+                        if(strncmp(child->segment, segment, length) == 0 && child->segment[length] == '\0') {
+                                return child;
+                        }
+                }
+                child = calloc(1, sizeof(TRIE_NODE_T));
+                child->segment = strndup(segment, length);
+                if(node->last_child != NULL) {
+                        node->last_child->next_sibling = child;
+                }
+                else {
+                        node->first_child = child;
+                }
+                node->last_child = child;
+        }
+        return child;
+}
+
+
+/*
+ * Adds a path to the trie. Returns false if the path was already covered
+ * by an earlier entry.
+ */
+static bool trie_add(TRIE_NODE_T *root, const char *path, bool subtree)
+{
+        TRIE_NODE_T *node = root;
+        const char *segment = path;
+
+        while(*segment != '\0') {
+                if(node->remove_subtree) {
+                        return false;
+                }
+                const char *end = strchr(segment, '/');
+                const size_t length = end == NULL ? strlen(segment) : (size_t)(end - segment);
+                if(length > 0) {
+                        node = trie_child(node, segment, length);
+                }
+                segment += length;
+                if(*segment == '/') {
+                        segment++;
+                }
+        }
+
+        if(node->remove_subtree || (node->remove_topic && !subtree)) {
+                return false;
+        }
+        if(subtree) {
+                node->remove_subtree = true;
+        }
+        else {
+                node->remove_topic = true;
+        }
+        return true;
+}
+
+
+static void trie_free(TRIE_NODE_T *node)
+{
+        TRIE_NODE_T *child = node->first_child;
+        while(child != NULL) {
+                TRIE_NODE_T *next = child->next_sibling;
+                trie_free(child);
+                child = next;
+        }
+        free(node->segment);
+        free(node);
+}
+
+
+/*
+ * A growable list of selectors.
+ */
+typedef struct selectors_s {
+        char **items;
+        long count;
+        long capacity;
+} SELECTORS_T;
+
+
+static void selectors_add(SELECTORS_T *selectors, char *selector)
+{
+        if(selectors->count == selectors->capacity) {
+                selectors->capacity = selectors->capacity == 0 ? 256 : selectors->capacity * 2;
+                selectors->items = realloc(selectors->items, selectors->capacity * sizeof(char *));
+        }
+        selectors->items[selectors->count++] = selector;
+}
+
+
+/*
+ * Appends a path or segment to a buffer, escaping characters that are
+ * significant in the regular expressions of ? selectors.
+ */
+static void append_escaped(BUF_T *buf, const char *text)
+{
+        for(const char *c = text; *c != '\0'; c++) {
+                if(strchr("\\.[]{}()<>*+-=!?^$|", *c) != NULL) {
+                        buf_sprintf(buf, "\\");
+                }
+                buf_sprintf(buf, "%c", *c);
+        }
+}
+
+
+static char *buf_to_string(BUF_T *buf)
+{
+        char *s = buf_as_string(buf);
+        buf_free(buf);
+        return s;
+}
+
+
+static bool is_leaf_topic(const TRIE_NODE_T *node)
+{
+        return node->remove_topic && !node->remove_subtree && node->first_child == NULL;
+}
+
+
+/*
+ * Walks the trie, producing the selectors that cover it. "group" has room
+ * for max_alternatives nodes; it's only used before recursing, so one
+ * array serves every level.
+ */
+static void trie_collect(
+        const TRIE_NODE_T *node,
+        const char *path,
+        long max_alternatives,
+        const TRIE_NODE_T **group,
+        SELECTORS_T *selectors)
+{
+        if(node->remove_subtree) {
+                BUF_T *buf = buf_create();
+                buf_sprintf(buf, "?");
+                append_escaped(buf, path);
+                buf_sprintf(buf, "//");
+                selectors_add(selectors, buf_to_string(buf));
+                return;
+        }
+
+        if(node->remove_topic && *path != '\0') {
+                BUF_T *buf = buf_create();
+                buf_sprintf(buf, ">");
+                buf_sprintf(buf, "%s", path);
+                selectors_add(selectors, buf_to_string(buf));
+        }
+
+        // Merge children that are single topics into groups of alternatives.
+        const TRIE_NODE_T *child = node->first_child;
+        while(child != NULL) {
+                if(!is_leaf_topic(child)) {
+                        child = child->next_sibling;
+                        continue;
+                }
+
+                long group_size = 0;
+                for(; child != NULL && group_size < max_alternatives; child = child->next_sibling) {
+                        if(is_leaf_topic(child)) {
+                                group[group_size++] = child;
+                        }
+                }
+
+                BUF_T *buf = buf_create();
+                if(group_size == 1) {
+                        buf_sprintf(buf, ">");
+                        if(*path != '\0') {
+                                buf_sprintf(buf, "%s", path);
+                                buf_sprintf(buf, "/");
+                        }
+                        buf_sprintf(buf, "%s", group[0]->segment);
+                }
+                else {
+                        buf_sprintf(buf, "?");
+                        if(*path != '\0') {
+                                append_escaped(buf, path);
+                                buf_sprintf(buf, "/");
+                        }
+                        buf_sprintf(buf, "(");
+                        for(long i = 0; i < group_size; i++) {
+                                if(i > 0) {
+                                        buf_sprintf(buf, "|");
+                                }
+                                append_escaped(buf, group[i]->segment);
+                        }
+                        buf_sprintf(buf, ")");
+                }
+                selectors_add(selectors, buf_to_string(buf));
+        }
+
+        // Then everything else.
+        for(child = node->first_child; child != NULL; child = child->next_sibling) {
+                if(is_leaf_topic(child)) {
+                        continue;
+                }
+                char *child_path = malloc(strlen(path) + strlen(child->segment) + 2);
+                if(*path != '\0') {
+                        sprintf(child_path, "%s/%s", path, child->segment);
+                }
+                else {
+                        strcpy(child_path, child->segment);
+                }
+                trie_collect(child, child_path, max_alternatives, group, selectors);
+                free(child_path);
+        }
+}
+
+
+static int compare_strings(const void *a, const void *b)
+{
+        return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/*
+ * Reads the input, returning the selectors needed to cover it.
+ */
+static bool read_removals(
+        FILE *input,
+        long max_alternatives,
+        SELECTORS_T *selectors,
+        long *entry_count,
+        long *covered_count)
+{
+        SELECTORS_T lines = { 0 };
+        char line[4096];
+
+        while(fgets(line, sizeof(line), input) != NULL) {
+                size_t length = strcspn(line, "\r\n");
+                if(line[length] == '\0' && !feof(input)) {
+                        fprintf(stderr, "Line too long: %.40s...\n", line);
+                        return false;
+                }
+                line[length] = '\0';
+                if(length > 0) {
+                        selectors_add(&lines, strdup(line));
+                }
+        }
+        *entry_count = lines.count;
+
+        qsort(lines.items, lines.count, sizeof(char *), compare_strings);
+
+        TRIE_NODE_T *root = calloc(1, sizeof(TRIE_NODE_T));
+        root->segment = strdup("");
+        *covered_count = 0;
+
+        for(long i = 0; i < lines.count; i++) {
+                char *entry = lines.items[i];
+                size_t length = strlen(entry);
+                bool subtree = false;
+
+                if(entry[0] == '>') {
+                        entry++;
+                        length--;
+                }
+                else if(entry[0] == '?' && length > 3 && strcmp(entry + length - 2, "//") == 0
+                        && strcspn(entry + 1, "\\.[]{}()<>*+-=!?^$|") == length - 1) {
+                        // A subtree selector with no regular expression in it.
+                        entry++;
+                        length--;
+                }
+                else if(entry[0] == '?' || entry[0] == '*' || entry[0] == '#') {
+                        selectors_add(selectors, lines.items[i]);
+                        lines.items[i] = NULL;
+                        continue;
+                }
+
+                if(length >= 2 && strcmp(entry + length - 2, "//") == 0) {
+                        entry[length - 2] = '\0';
+                        subtree = true;
+                }
+                if(!trie_add(root, entry, subtree)) {
+                        (*covered_count)++;
+                }
+        }
+
+        const TRIE_NODE_T **group = malloc(max_alternatives * sizeof(TRIE_NODE_T *));
+        const bool collected = group != NULL;
+        if(collected) {
+                trie_collect(root, "", max_alternatives, group, selectors);
+                free(group);
+        }
+        else {
+                fprintf(stderr, "Unable to allocate %ld alternatives\n", max_alternatives);
+        }
+        trie_free(root);
+
+        for(long i = 0; i < lines.count; i++) {
+                free(lines.items[i]);
+        }
+        free(lines.items);
+        return collected;
+}
+
+
+/*
+ * Removal requests outstanding, and the results so far.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long outstanding;
+        long removed;
+        long completed;
+        long failed;
+} g_removal = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void removal_finished(long removed, bool failed)
+{
+        pthread_mutex_lock(&g_removal.lock);
+        g_removal.outstanding--;
+        g_removal.removed += removed;
+        if(failed) {
+                g_removal.failed++;
+        }
+        else {
+                g_removal.completed++;
+        }
+        pthread_cond_broadcast(&g_removal.cond);
+        pthread_mutex_unlock(&g_removal.lock);
+}
+
+
+static int on_topics_removed(SESSION_T *session, const DIFFUSION_TOPIC_REMOVAL_RESULT_T *response, void *context)
+{
+        removal_finished(diffusion_topic_removal_result_removed_count(response), false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_remove_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("Removal failed: %s\n", error->message);
+        removal_finished(0, true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_remove_discard(SESSION_T *session, void *context)
+{
+        puts("Removal discarded");
+        removal_finished(0, true);
+        return HANDLER_SUCCESS;
+}
+
+
+static double elapsed_seconds(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+int main(int argc, char **argv)
+{
+        /*
+         * Standard command-line parsing.
+         */
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *file_name = hash_get(options, "file");
+        const long max_alternatives = atol(hash_get(options, "alternatives"));
+        const long set_size = atol(hash_get(options, "set_size"));
+        const long window = atol(hash_get(options, "window"));
+        const bool dry_run = hash_get(options, "dry_run") != NULL;
+
+        if(max_alternatives < 1 || set_size < 1 || window < 1) {
+                fprintf(stderr, "alternatives, set_size and window must all be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        FILE *input = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "r");
+        if(input == NULL) {
+                fprintf(stderr, "Unable to open \"%s\"\n", file_name);
+                return EXIT_FAILURE;
+        }
+
+        SELECTORS_T selectors = { 0 };
+        long entry_count;
+        long covered_count;
+        const bool read_ok = read_removals(input, max_alternatives, &selectors, &entry_count, &covered_count);
+        if(input != stdin) {
+                fclose(input);
+        }
+        if(!read_ok) {
+                return EXIT_FAILURE;
+        }
+
+        printf("%ld entries, %ld already covered, reduced to %ld selectors\n",
+               entry_count, covered_count, selectors.count);
+
+        if(dry_run) {
+                for(long i = 0; i < selectors.count; i++) {
+                        puts(selectors.items[i]);
+                        free(selectors.items[i]);
+                }
+                free(selectors.items);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        /*
+         * Create a session with Diffusion.
+         */
+        DIFFUSION_ERROR_T error = { 0 };
+        SESSION_T *session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Send the selectors in sets of up to set_size, keeping at most
+         * window requests outstanding.
+         */
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long requests = 0;
+
+        for(long i = 0; i < selectors.count; i += set_size) {
+                const long end = i + set_size < selectors.count ? i + set_size : selectors.count;
+
+                BUF_T *buf = buf_create();
+                if(end - i > 1) {
+                        buf_sprintf(buf, "#");
+                }
+                for(long j = i; j < end; j++) {
+                        if(j > i) {
+                                buf_sprintf(buf, "%s", DELIM);
+                        }
+                        buf_sprintf(buf, "%s", selectors.items[j]);
+                }
+                char *selector = buf_to_string(buf);
+
+                pthread_mutex_lock(&g_removal.lock);
+                while(g_removal.outstanding >= window) {
+                        pthread_cond_wait(&g_removal.cond, &g_removal.lock);
+                }
+                g_removal.outstanding++;
+                pthread_mutex_unlock(&g_removal.lock);
+
+                TOPIC_REMOVAL_PARAMS_T remove_params = {
+                        .topic_selector = selector,
+                        .on_removed = on_topics_removed,
+                        .on_error = on_remove_error,
+                        .on_discard = on_remove_discard
+                };
+                topic_removal(session, remove_params);
+                free(selector);
+                requests++;
+        }
+
+        pthread_mutex_lock(&g_removal.lock);
+        while(g_removal.outstanding > 0) {
+                pthread_cond_wait(&g_removal.cond, &g_removal.lock);
+        }
+        pthread_mutex_unlock(&g_removal.lock);
+
+        const double seconds = elapsed_seconds(&start);
+        printf("%ld removal requests (%ld failed), %ld topics removed in %.3fs\n",
+               requests, g_removal.failed, g_removal.removed, seconds);
+        if(seconds > 0) {
+                printf("%.0f requests/sec, %.0f topics/sec\n",
+                       requests / seconds, g_removal.removed / seconds);
+        }
+
+        /*
+         * Close our session, and release resources and memory.
+         */
+        session_close(session, NULL);
+        session_free(session);
+
+        for(long i = 0; i < selectors.count; i++) {
+                free(selectors.items[i]);
+        }
+        free(selectors.items);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return g_removal.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,476 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example uses the topic update API to provision a large number of
+ * topics from a manifest file.
+ *
+ * Each line of the manifest describes one topic:
+ *
+ *     <topic path>,<type>,<initial value>
+ *
+ * where <type> is one of "string", "int64", "double", "json" or "binary".
+ * Everything after the second comma is taken as the value. Blank lines and
+ * lines starting with '#' are ignored.
+ *
+ * Rather than waiting for each topic to be created before adding the next,
+ * the manifest is shared between a number of worker threads, each with its
+ * own session. Every worker keeps up to a bounded number of
+ * diffusion_topic_update_add_and_set() calls in flight, so the server is
+ * kept busy without the client queueing an unbounded number of requests.
+ *
+ * On completion, the number of topics per second and a breakdown of
+ * failures by error code are reported. For add-and-set, a failure to add
+ * the topic is reported with the TOPIC_ADD_FAIL_RESULT_CODE as its code.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+// Error codes above this are counted together in the final bucket.
+#define MAX_ERROR_CODE 32
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'f', "file", "Manifest of topics to provision", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'n', "threads", "Number of worker threads (one session each)", ARG_OPTIONAL, ARG_HAS_VALUE, "4"},
+        {'w', "window", "Maximum number of requests in flight per worker", ARG_OPTIONAL, ARG_HAS_VALUE, "256"},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * Names of the TOPIC_ADD_FAIL_RESULT_CODE values, used when reporting
+ * failures.
+ */
+static const char *add_fail_result_code_name(int code)
+{
+        switch(code) {
+        case TOPIC_ADD_FAIL_UNEXPECTED_ERROR:
+                return "UNEXPECTED_ERROR";
+        case TOPIC_ADD_FAIL_EXISTS:
+                return "EXISTS";
+        case TOPIC_ADD_FAIL_INVALID_NAME:
+                return "INVALID_NAME";
+        case TOPIC_ADD_FAIL_PERMISSIONS_FAILURE:
+                return "PERMISSIONS_FAILURE";
+        case TOPIC_ADD_FAIL_INVALID_DETAILS:
+                return "INVALID_DETAILS";
+        case TOPIC_ADD_FAIL_CLUSTER_REPARTITION:
+                return "CLUSTER_REPARTITION";
+        case TOPIC_ADD_FAIL_EXCEEDED_LICENSE_LIMIT:
+                return "EXCEEDED_LICENSE_LIMIT";
+        case TOPIC_ADD_FAIL_INCOMPATIBLE_PARENT:
+                return "INCOMPATIBLE_PARENT";
+        case TOPIC_ADD_FAIL_INCOMPATIBLE_MASTER:
+                return "INCOMPATIBLE_MASTER";
+        case TOPIC_ADD_FAIL_EXISTS_INCOMPATIBLE:
+                return "EXISTS_INCOMPATIBLE";
+        default:
+                return "OTHER";
+        }
+}
+
+
+/*
+ * The manifest is read a line at a time by whichever worker is next
+ * ready to send.
+ */
+typedef struct manifest_s {
+        FILE *file;
+        pthread_mutex_t lock;
+        long line_number;
+        long invalid;
+} MANIFEST_T;
+
+
+/*
+ * Per-worker state. The session's user context points back at this, so
+ * that callbacks can release the worker's in-flight slots.
+ */
+typedef struct worker_s {
+        pthread_t thread;
+        SESSION_T *session;
+        MANIFEST_T *manifest;
+        TOPIC_SPECIFICATION_T **specifications;
+        long window;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long in_flight;
+        long sent;
+        long created;
+        long existed;
+        long failed;
+        long failures_by_code[MAX_ERROR_CODE + 1];
+} WORKER_T;
+
+
+static double elapsed_seconds(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static int on_topic_update_add_and_set(
+        DIFFUSION_TOPIC_CREATION_RESULT_T result,
+        void *context)
+{
+        WORKER_T *worker = context;
+
+        pthread_mutex_lock(&worker->lock);
+        if(result == TOPIC_CREATED) {
+                worker->created++;
+        }
+        else {
+                worker->existed++;
+        }
+        worker->in_flight--;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_error(
+        SESSION_T *session,
+        const DIFFUSION_ERROR_T *error)
+{
+        WORKER_T *worker = session->user_context;
+        int code = error->code;
+        if(code < 0 || code > MAX_ERROR_CODE) {
+                code = MAX_ERROR_CODE;
+        }
+
+        pthread_mutex_lock(&worker->lock);
+        worker->failed++;
+        worker->failures_by_code[code]++;
+        worker->in_flight--;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Map a manifest type name onto a topic type, or return
+ * TOPIC_TYPE_UNKNOWN if the type isn't supported by this tool.
+ */
+static TOPIC_TYPE_T parse_topic_type(const char *name)
+{
+        if(strcmp(name, "string") == 0) {
+                return TOPIC_TYPE_STRING;
+        }
+        if(strcmp(name, "int64") == 0) {
+                return TOPIC_TYPE_INT64;
+        }
+        if(strcmp(name, "double") == 0) {
+                return TOPIC_TYPE_DOUBLE;
+        }
+        if(strcmp(name, "json") == 0) {
+                return TOPIC_TYPE_JSON;
+        }
+        if(strcmp(name, "binary") == 0) {
+                return TOPIC_TYPE_BINARY;
+        }
+        return TOPIC_TYPE_UNKNOWN;
+}
+
+
+/*
+ * Write the textual value from the manifest into a BUF_T using the
+ * datatype matching the topic type.
+ */
+static bool write_value(
+        TOPIC_TYPE_T topic_type,
+        const char *value,
+        BUF_T *buf,
+        DIFFUSION_DATATYPE *datatype)
+{
+        switch(topic_type) {
+        case TOPIC_TYPE_STRING:
+                *datatype = DATATYPE_STRING;
+                return write_diffusion_string_value(value, buf);
+        case TOPIC_TYPE_INT64:
+                *datatype = DATATYPE_INT64;
+                return write_diffusion_int64_value(strtoll(value, NULL, 10), buf);
+        case TOPIC_TYPE_DOUBLE:
+                *datatype = DATATYPE_DOUBLE;
+                return write_diffusion_double_value(strtod(value, NULL), buf);
+        case TOPIC_TYPE_JSON:
+                *datatype = DATATYPE_JSON;
+                return write_diffusion_json_value(value, buf);
+        case TOPIC_TYPE_BINARY:
+                *datatype = DATATYPE_BINARY;
+                return write_diffusion_binary_value(value, buf, strlen(value));
+        default:
+                return false;
+        }
+}
+
+
+/*
+ * Read the next usable line from the manifest into the caller's line
+ * buffer, splitting it in place into path, type and value. Returns false
+ * once the manifest is exhausted.
+ */
+static bool next_manifest_entry(
+        MANIFEST_T *manifest,
+        char **line,
+        size_t *line_capacity,
+        char **path,
+        TOPIC_TYPE_T *topic_type,
+        char **value)
+{
+        bool found = false;
+
+        pthread_mutex_lock(&manifest->lock);
+        while(!found && getline(line, line_capacity, manifest->file) != -1) {
+                manifest->line_number++;
+
+                char *s = *line;
+                s[strcspn(s, "\r\n")] = '\0';
+                if(*s == '\0' || *s == '#') {
+                        continue;
+                }
+
+                char *type = strchr(s, ',');
+                char *v = type == NULL ? NULL : strchr(type + 1, ',');
+                if(v == NULL) {
+                        fprintf(stderr, "Line %ld: expected <path>,<type>,<value>\n", manifest->line_number);
+                        manifest->invalid++;
+                        continue;
+                }
+                *type++ = '\0';
+                *v++ = '\0';
+
+                *topic_type = parse_topic_type(type);
+                if(*topic_type == TOPIC_TYPE_UNKNOWN) {
+                        fprintf(stderr, "Line %ld: unsupported topic type \"%s\"\n", manifest->line_number, type);
+                        manifest->invalid++;
+                        continue;
+                }
+
+                *path = s;
+                *value = v;
+                found = true;
+        }
+        pthread_mutex_unlock(&manifest->lock);
+
+        return found;
+}
+
+
+static void *worker_run(void *arg)
+{
+        WORKER_T *worker = arg;
+        char *line = NULL;
+        size_t line_capacity = 0;
+        char *path;
+        char *value;
+        TOPIC_TYPE_T topic_type;
+
+        while(next_manifest_entry(worker->manifest, &line, &line_capacity, &path, &topic_type, &value)) {
+                BUF_T *update_buf = buf_create();
+                DIFFUSION_DATATYPE datatype;
+                if(!write_value(topic_type, value, update_buf, &datatype)) {
+                        fprintf(stderr, "Unable to encode value for \"%s\"\n", path);
+                        buf_free(update_buf);
+                        continue;
+                }
+
+                // Wait for a free slot in this worker's window.
+                pthread_mutex_lock(&worker->lock);
+                while(worker->in_flight >= worker->window) {
+                        pthread_cond_wait(&worker->cond, &worker->lock);
+                }
+                worker->in_flight++;
+                worker->sent++;
+                pthread_mutex_unlock(&worker->lock);
+
+                DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T topic_update_params = {
+                        .topic_path = path,
+                        .specification = worker->specifications[topic_type],
+                        .datatype = datatype,
+                        .update = update_buf,
+                        .on_topic_update_add_and_set = on_topic_update_add_and_set,
+                        .on_error = on_error,
+                        .context = worker
+                };
+
+                diffusion_topic_update_add_and_set(worker->session, topic_update_params);
+                buf_free(update_buf);
+        }
+        free(line);
+
+        // Wait for all outstanding requests from this worker to complete.
+        pthread_mutex_lock(&worker->lock);
+        while(worker->in_flight > 0) {
+                pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        return NULL;
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        CREDENTIALS_T *credentials = NULL;
+        const char *password = hash_get(options, "credentials");
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+        const char *file_name = hash_get(options, "file");
+        const int thread_count = atoi(hash_get(options, "threads"));
+        const long window = atol(hash_get(options, "window"));
+        if(thread_count < 1 || window < 1) {
+                fprintf(stderr, "threads and window must both be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        MANIFEST_T manifest = { 0 };
+        manifest.file = fopen(file_name, "r");
+        if(manifest.file == NULL) {
+                fprintf(stderr, "Unable to open manifest \"%s\"\n", file_name);
+                return EXIT_FAILURE;
+        }
+        pthread_mutex_init(&manifest.lock, NULL);
+
+        // One specification per topic type, shared by every request.
+        TOPIC_SPECIFICATION_T *specifications[TOPIC_TYPE_UNKNOWN + 1] = { 0 };
+        specifications[TOPIC_TYPE_STRING] = topic_specification_init(TOPIC_TYPE_STRING);
+        specifications[TOPIC_TYPE_INT64] = topic_specification_init(TOPIC_TYPE_INT64);
+        specifications[TOPIC_TYPE_DOUBLE] = topic_specification_init(TOPIC_TYPE_DOUBLE);
+        specifications[TOPIC_TYPE_JSON] = topic_specification_init(TOPIC_TYPE_JSON);
+        specifications[TOPIC_TYPE_BINARY] = topic_specification_init(TOPIC_TYPE_BINARY);
+
+        // Create one session per worker, each with its own window.
+        WORKER_T *workers = calloc(thread_count, sizeof(WORKER_T));
+        for(int i = 0; i < thread_count; i++) {
+                WORKER_T *worker = &workers[i];
+                worker->manifest = &manifest;
+                worker->specifications = specifications;
+                worker->window = window;
+                pthread_mutex_init(&worker->lock, NULL);
+                pthread_cond_init(&worker->cond, NULL);
+
+                DIFFUSION_ERROR_T error = { 0 };
+                worker->session = session_create_with_user_context(url, principal, credentials, NULL, NULL, worker, &error);
+                if(worker->session == NULL) {
+                        fprintf(stderr, "TEST: Failed to create session\n");
+                        fprintf(stderr, "ERR : %s\n", error.message);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int i = 0; i < thread_count; i++) {
+                pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        }
+        for(int i = 0; i < thread_count; i++) {
+                pthread_join(workers[i].thread, NULL);
+        }
+
+        const double seconds = elapsed_seconds(&start);
+
+        // Aggregate and report the results.
+        long sent = 0, created = 0, existed = 0, failed = 0;
+        long failures_by_code[MAX_ERROR_CODE + 1] = { 0 };
+        for(int i = 0; i < thread_count; i++) {
+                sent += workers[i].sent;
+                created += workers[i].created;
+                existed += workers[i].existed;
+                failed += workers[i].failed;
+                for(int code = 0; code <= MAX_ERROR_CODE; code++) {
+                        failures_by_code[code] += workers[i].failures_by_code[code];
+                }
+        }
+
+        printf("Provisioned %ld topics in %.3f s (%.0f topics/sec)\n",
+               sent, seconds, seconds > 0 ? sent / seconds : 0.0);
+        printf("  created:         %ld\n", created);
+        printf("  already existed: %ld\n", existed);
+        printf("  failed:          %ld\n", failed);
+        printf("  invalid lines:   %ld\n", manifest.invalid);
+        for(int code = 0; code <= MAX_ERROR_CODE; code++) {
+                if(failures_by_code[code] > 0) {
+                        printf("    %-24s (%d%s): %ld\n",
+                               add_fail_result_code_name(code), code,
+                               code == MAX_ERROR_CODE ? "+" : "",
+                               failures_by_code[code]);
+                }
+        }
+
+        // Close sessions and free resources.
+        for(int i = 0; i < thread_count; i++) {
+                session_close(workers[i].session, NULL);
+                session_free(workers[i].session);
+                pthread_mutex_destroy(&workers[i].lock);
+                pthread_cond_destroy(&workers[i].cond);
+        }
+        free(workers);
+
+        for(int i = 0; i <= TOPIC_TYPE_UNKNOWN; i++) {
+                if(specifications[i] != NULL) {
+                        topic_specification_free(specifications[i]);
+                }
+        }
+
+        pthread_mutex_destroy(&manifest.lock);
+        fclose(manifest.file);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
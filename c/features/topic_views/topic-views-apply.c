@@ -0,0 +1,468 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example applies a file of topic view definitions to the server,
+ * changing only the views that differ.
+ *
+ * Each line of the file is a view name followed by whitespace and its
+ * specification, for example:
+ *
+ *   prices-by-id  map ?prices// to views/prices/<path(1)>
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * The current views are read with `diffusion_topic_views_list_topic_views`
+ * and compared with the file. Views that are missing or whose
+ * specification differs are created (creating a view replaces any view of
+ * the same name). With --prune, views that are not in the file and whose
+ * names start with the given prefix are removed. The creates and removes
+ * are issued together, keeping a window of them in flight, and the
+ * operations/sec achieved is reported.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'f', "file", "File of view names and specifications", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'x', "prune", "Remove views that are not in the file", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        {'P', "prefix", "Only remove views whose names start with this prefix", ARG_OPTIONAL, ARG_HAS_VALUE, ""},
+        {'w', "window", "Maximum number of operations in flight", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'d', "dry-run", "Print the changes without applying them", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+typedef struct view_definition_s {
+        char *name;
+        char *specification;
+} VIEW_DEFINITION_T;
+
+
+typedef struct view_list_s {
+        VIEW_DEFINITION_T *views;
+        int count;
+        int capacity;
+} VIEW_LIST_T;
+
+
+static void view_list_add(VIEW_LIST_T *list, char *name, char *specification)
+{
+        if(list->count == list->capacity) {
+                list->capacity = list->capacity * 2 + 64;
+                list->views = realloc(list->views, list->capacity * sizeof(VIEW_DEFINITION_T));
+        }
+        list->views[list->count].name = name;
+        list->views[list->count].specification = specification;
+        list->count++;
+}
+
+
+static void view_list_free(VIEW_LIST_T *list)
+{
+        for(int i = 0; i < list->count; i++) {
+                free(list->views[i].name);
+                free(list->views[i].specification);
+        }
+        free(list->views);
+}
+
+
+static int compare_views(const void *a, const void *b)
+{
+        return strcmp(((const VIEW_DEFINITION_T *)a)->name, ((const VIEW_DEFINITION_T *)b)->name);
+}
+
+
+// Read the view definitions file, sorted by name.
+static bool read_definitions(const char *file_name, VIEW_LIST_T *list)
+{
+        FILE *file = fopen(file_name, "r");
+        if(file == NULL) {
+                fprintf(stderr, "Unable to open \"%s\"\n", file_name);
+                return false;
+        }
+
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+        int line_number = 0;
+        bool ok = true;
+
+        while((length = getline(&line, &capacity, file)) != -1) {
+                line_number++;
+                while(length > 0 && isspace((unsigned char)line[length - 1])) {
+                        line[--length] = '\0';
+                }
+
+                char *name = line;
+                while(isspace((unsigned char)*name)) {
+                        name++;
+                }
+                if(*name == '\0' || *name == '#') {
+                        continue;
+                }
+
+                char *specification = name;
+                while(*specification != '\0' && !isspace((unsigned char)*specification)) {
+                        specification++;
+                }
+                if(*specification != '\0') {
+                        *specification++ = '\0';
+                }
+                while(isspace((unsigned char)*specification)) {
+                        specification++;
+                }
+                if(*specification == '\0') {
+                        fprintf(stderr, "%s:%d: view \"%s\" has no specification\n", file_name, line_number, name);
+                        ok = false;
+                        continue;
+                }
+
+                view_list_add(list, strdup(name), strdup(specification));
+        }
+
+        free(line);
+        fclose(file);
+
+        qsort(list->views, list->count, sizeof(VIEW_DEFINITION_T), compare_views);
+        for(int i = 1; i < list->count; i++) {
+                if(strcmp(list->views[i - 1].name, list->views[i].name) == 0) {
+                        fprintf(stderr, "%s: view \"%s\" is defined more than once\n", file_name, list->views[i].name);
+                        ok = false;
+                }
+        }
+        return ok;
+}
+
+
+/*
+ * State shared with the handlers.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        bool listed;
+        bool list_failed;
+        VIEW_LIST_T *current;
+
+        long in_flight;
+        long succeeded;
+        long failed;
+} g_apply = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static int on_topic_views_list(const LIST_T *topic_views, void *context)
+{
+        const int size = list_get_size(topic_views);
+
+        pthread_mutex_lock(&g_apply.lock);
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_VIEW_T *topic_view = list_get_data_indexed(topic_views, i);
+                view_list_add(g_apply.current,
+                              diffusion_topic_view_get_name(topic_view),
+                              diffusion_topic_view_get_specification(topic_view));
+        }
+        g_apply.listed = true;
+        pthread_cond_signal(&g_apply.cond);
+        pthread_mutex_unlock(&g_apply.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_error_list(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("An error has occured while listing Topic Views: (%d) %s\n", error->code, error->message);
+
+        pthread_mutex_lock(&g_apply.lock);
+        g_apply.listed = true;
+        g_apply.list_failed = true;
+        pthread_cond_signal(&g_apply.cond);
+        pthread_mutex_unlock(&g_apply.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+// Read the current views from the server, sorted by name.
+static bool list_current_views(SESSION_T *session, VIEW_LIST_T *current)
+{
+        g_apply.current = current;
+
+        DIFFUSION_TOPIC_VIEWS_LIST_PARAMS_T params_list = {
+                .on_topic_views_list = on_topic_views_list,
+                .on_error = on_error_list
+        };
+        diffusion_topic_views_list_topic_views(session, params_list, NULL);
+
+        pthread_mutex_lock(&g_apply.lock);
+        while(!g_apply.listed) {
+                pthread_cond_wait(&g_apply.cond, &g_apply.lock);
+        }
+        const bool ok = !g_apply.list_failed;
+        pthread_mutex_unlock(&g_apply.lock);
+
+        qsort(current->views, current->count, sizeof(VIEW_DEFINITION_T), compare_views);
+        return ok;
+}
+
+
+static void operation_complete(bool failed)
+{
+        pthread_mutex_lock(&g_apply.lock);
+        g_apply.in_flight--;
+        if(failed) {
+                g_apply.failed++;
+        }
+        else {
+                g_apply.succeeded++;
+        }
+        pthread_cond_signal(&g_apply.cond);
+        pthread_mutex_unlock(&g_apply.lock);
+}
+
+
+static int on_topic_view_created(const DIFFUSION_TOPIC_VIEW_T *topic_view, void *context)
+{
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topic_view_removed(void *context)
+{
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("Error: %s\n", error->message);
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_discard(SESSION_T *session, void *context)
+{
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+// Wait until fewer than "window" operations are in flight.
+static void await_window(long window)
+{
+        pthread_mutex_lock(&g_apply.lock);
+        while(g_apply.in_flight >= window) {
+                pthread_cond_wait(&g_apply.cond, &g_apply.lock);
+        }
+        g_apply.in_flight++;
+        pthread_mutex_unlock(&g_apply.lock);
+}
+
+
+static void create_view(SESSION_T *session, const VIEW_DEFINITION_T *view, long window)
+{
+        await_window(window);
+
+        DIFFUSION_CREATE_TOPIC_VIEW_PARAMS_T topic_view_params = {
+                .view = view->name,
+                .specification = view->specification,
+                .on_topic_view_created = on_topic_view_created,
+                .on_error = on_error,
+                .on_discard = on_discard
+        };
+        diffusion_topic_views_create_topic_view(session, topic_view_params, NULL);
+}
+
+
+static void remove_view(SESSION_T *session, const VIEW_DEFINITION_T *view, long window)
+{
+        await_window(window);
+
+        DIFFUSION_REMOVE_TOPIC_VIEW_PARAMS_T params_remove = {
+                .view = view->name,
+                .on_topic_view_removed = on_topic_view_removed,
+                .on_error = on_error,
+                .on_discard = on_discard
+        };
+        diffusion_topic_views_remove_topic_view(session, params_remove, NULL);
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *file_name = hash_get(options, "file");
+        const bool prune = hash_get(options, "prune") != NULL;
+        const char *prefix = hash_get(options, "prefix");
+        const long window = atol(hash_get(options, "window"));
+        const bool dry_run = hash_get(options, "dry-run") != NULL;
+        if(window < 1) {
+                fprintf(stderr, "window must be at least 1\n");
+                return EXIT_FAILURE;
+        }
+
+        VIEW_LIST_T desired = { 0 };
+        if(!read_definitions(file_name, &desired)) {
+                view_list_free(&desired);
+                return EXIT_FAILURE;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // Create a session with the Diffusion server.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        VIEW_LIST_T current = { 0 };
+        bool ok = list_current_views(session, &current);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /*
+         * Both lists are sorted by name, so the differences are found in a
+         * single merge pass.
+         */
+        long creates = 0;
+        long replaces = 0;
+        long removes = 0;
+        long unchanged = 0;
+        long unmanaged = 0;
+        const size_t prefix_length = strlen(prefix);
+
+        for(int d = 0, c = 0; ok && (d < desired.count || c < current.count);) {
+                const int comparison =
+                        d == desired.count ? 1 :
+                        c == current.count ? -1 :
+                        strcmp(desired.views[d].name, current.views[c].name);
+
+                if(comparison < 0) {
+                        printf("create  %s: %s\n", desired.views[d].name, desired.views[d].specification);
+                        if(!dry_run) {
+                                create_view(session, &desired.views[d], window);
+                        }
+                        creates++;
+                        d++;
+                }
+                else if(comparison > 0) {
+                        if(prune && strncmp(current.views[c].name, prefix, prefix_length) == 0) {
+                                printf("remove  %s\n", current.views[c].name);
+                                if(!dry_run) {
+                                        remove_view(session, &current.views[c], window);
+                                }
+                                removes++;
+                        }
+                        else {
+                                unmanaged++;
+                        }
+                        c++;
+                }
+                else {
+                        if(strcmp(desired.views[d].specification, current.views[c].specification) != 0) {
+                                printf("replace %s: %s\n", desired.views[d].name, desired.views[d].specification);
+                                if(!dry_run) {
+                                        create_view(session, &desired.views[d], window);
+                                }
+                                replaces++;
+                        }
+                        else {
+                                unchanged++;
+                        }
+                        d++;
+                        c++;
+                }
+        }
+
+        // Wait for the outstanding operations.
+        pthread_mutex_lock(&g_apply.lock);
+        while(g_apply.in_flight > 0) {
+                pthread_cond_wait(&g_apply.cond, &g_apply.lock);
+        }
+        pthread_mutex_unlock(&g_apply.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        const long operations = g_apply.succeeded + g_apply.failed;
+
+        if(ok) {
+                printf("%ld to create, %ld to replace, %ld to remove, %ld unchanged, %ld not in file%s\n",
+                       creates, replaces, removes, unchanged, unmanaged, prune ? "" : " (not pruned)");
+                if(!dry_run) {
+                        printf("%ld operations in %.3f s (%.0f operations/sec), %ld failed\n",
+                               operations, seconds, seconds > 0 ? operations / seconds : 0.0, g_apply.failed);
+                }
+        }
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        view_list_free(&current);
+        view_list_free(&desired);
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return ok && g_apply.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -20,10 +20,22 @@
 
 /*
  * This example creates a topic view.
+ *
+ * With --benchmark, it instead measures the cost of topic views. A set of
+ * source topics is created along with a number of views, each mapping
+ * every source topic to a reference topic of its own, so that each source
+ * update fans out to one reference update per view. Timestamped values
+ * are published to the sources at a fixed rate while a second session
+ * subscribes to the reference topics, and the throughput and source to
+ * reference latency percentiles are reported. This is repeated for each
+ * number of views given.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef WIN32
         #include <unistd.h>
@@ -44,6 +56,10 @@ ARG_OPTS_T arg_opts[] = {
         {'t', "topic", "Topic name to create and update", ARG_OPTIONAL, ARG_HAS_VALUE, "source"},
         {'r', "reference-topic", "Reference topic name to be mapped", ARG_OPTIONAL, ARG_HAS_VALUE, "reference"},
         {'s', "seconds", "Number of seconds to run for before exiting", ARG_OPTIONAL, ARG_HAS_VALUE, "30"},
+        {'b', "benchmark", "Measure topic view propagation latency and throughput", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        {'v', "views", "Comma separated list of numbers of views to benchmark", ARG_OPTIONAL, ARG_HAS_VALUE, "1,4,16"},
+        {'n', "sources", "Number of source topics to benchmark", ARG_OPTIONAL, ARG_HAS_VALUE, "100"},
+        {'a', "rate", "Source updates per second when benchmarking", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
         END_OF_ARG_OPTS
 };
 
@@ -148,6 +164,367 @@ static int on_error(
 }
 
 
+/*
+ * Benchmark mode.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long in_flight;
+        long failed;
+
+        // Source to reference latencies in microseconds.
+        uint32_t *latencies;
+        long latency_count;
+        long latency_capacity;
+        long received;
+} g_bench = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static int64_t monotonic_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+static void bench_operation_complete(bool failed)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.in_flight--;
+        if(failed) {
+                g_bench.failed++;
+        }
+        pthread_cond_signal(&g_bench.cond);
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static void bench_operation_start(void)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.in_flight++;
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static void bench_await_operations(void)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        while(g_bench.in_flight > 0) {
+                pthread_cond_wait(&g_bench.cond, &g_bench.lock);
+        }
+        pthread_mutex_unlock(&g_bench.lock);
+}
+
+
+static int on_bench_topic_set(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        bench_operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_view_created(const DIFFUSION_TOPIC_VIEW_T *topic_view, void *context)
+{
+        bench_operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_view_removed(void *context)
+{
+        bench_operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_topics_removed(
+        SESSION_T *session,
+        const DIFFUSION_TOPIC_REMOVAL_RESULT_T *result,
+        void *context)
+{
+        bench_operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        if(g_bench.failed == 0) {
+                printf("Error: %s\n", error->message);
+        }
+        bench_operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_update(void *context)
+{
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_bench_update_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.failed++;
+        pthread_mutex_unlock(&g_bench.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * Source values are the time at which they were sent, so the latency can
+ * be measured when the value arrives on a reference topic.
+ */
+static int on_bench_value(
+        const char *const topic_path,
+        const TOPIC_SPECIFICATION_T *const specification,
+        DIFFUSION_DATATYPE datatype,
+        const DIFFUSION_VALUE_T *const old_value,
+        const DIFFUSION_VALUE_T *const new_value,
+        void *context)
+{
+        const int64_t now = monotonic_ns();
+
+        char *result;
+        if(!read_diffusion_string_value(new_value, &result, NULL)) {
+                return HANDLER_SUCCESS;
+        }
+        const int64_t sent = strtoll(result, NULL, 10);
+        free(result);
+
+        // Ignore the initial values of the reference topics.
+        if(sent == 0) {
+                return HANDLER_SUCCESS;
+        }
+
+        const int64_t us = (now - sent) / 1000;
+
+        pthread_mutex_lock(&g_bench.lock);
+        g_bench.received++;
+        if(g_bench.latency_count < g_bench.latency_capacity) {
+                g_bench.latencies[g_bench.latency_count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+        }
+        pthread_mutex_unlock(&g_bench.lock);
+        return HANDLER_SUCCESS;
+}
+
+
+static int compare_latencies(const void *a, const void *b)
+{
+        const uint32_t x = *(const uint32_t *)a;
+        const uint32_t y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array.
+static uint32_t percentile(const uint32_t *sorted, long count, double p)
+{
+        long rank = (long)(p / 100.0 * count + 0.5);
+        if(rank < 1) {
+                rank = 1;
+        }
+        if(rank > count) {
+                rank = count;
+        }
+        return sorted[rank - 1];
+}
+
+
+/*
+ * Create the source topics and "view_count" views, each mapping every
+ * source topic to a reference topic of its own, then publish timestamped
+ * values to the sources at "rate" updates per second for "seconds"
+ * seconds while a second session, which already has a value stream for
+ * them, subscribes to all of the reference topics. Each source update
+ * fans out to one reference update per view.
+ */
+static void run_benchmark(
+        SESSION_T *session,
+        SESSION_T *subscriber,
+        const char *source_root,
+        const char *reference_root,
+        int view_count,
+        int source_count,
+        long rate,
+        long seconds)
+{
+        char selector[256];
+
+        g_bench.failed = 0;
+
+        // Create the source topics.
+        TOPIC_SPECIFICATION_T *spec = topic_specification_init(TOPIC_TYPE_STRING);
+        for(int i = 0; i < source_count; i++) {
+                char topic_path[256];
+                snprintf(topic_path, sizeof(topic_path), "%s/benchmark/%d", source_root, i);
+
+                BUF_T *value = buf_create();
+                write_diffusion_string_value("0", value);
+
+                DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T params = {
+                        .topic_path = topic_path,
+                        .specification = spec,
+                        .datatype = DATATYPE_STRING,
+                        .update = value,
+                        .on_topic_update_add_and_set = on_bench_topic_set,
+                        .on_error = on_bench_error
+                };
+                bench_operation_start();
+                diffusion_topic_update_add_and_set(session, params);
+                buf_free(value);
+        }
+        topic_specification_free(spec);
+        bench_await_operations();
+
+        // Create the views.
+        for(int v = 0; v < view_count; v++) {
+                char view_name[64];
+                snprintf(view_name, sizeof(view_name), "benchmark-view-%d", v);
+
+                BUF_T *buf = buf_create();
+                buf_sprintf(buf, "map ?%s/benchmark// to %s/%d/<path(0)>", source_root, reference_root, v);
+                char *topic_view_spec = buf_as_string(buf);
+                buf_free(buf);
+
+                DIFFUSION_CREATE_TOPIC_VIEW_PARAMS_T topic_view_params = {
+                        .view = view_name,
+                        .specification = topic_view_spec,
+                        .on_topic_view_created = on_bench_view_created,
+                        .on_error = on_bench_error
+                };
+                bench_operation_start();
+                diffusion_topic_views_create_topic_view(session, topic_view_params, NULL);
+                free(topic_view_spec);
+        }
+        bench_await_operations();
+
+        // Subscribe to every reference topic, and give the views time to
+        // create them.
+        snprintf(selector, sizeof(selector), "?%s//", reference_root);
+
+        SUBSCRIPTION_PARAMS_T subscribe_params = {
+                .topic_selector = selector
+        };
+        subscribe(subscriber, subscribe_params);
+
+        sleep(2);
+
+        const long expected = rate * seconds * view_count;
+        pthread_mutex_lock(&g_bench.lock);
+        free(g_bench.latencies);
+        g_bench.latency_capacity = expected < 10000000 ? expected : 10000000;
+        g_bench.latencies = malloc(g_bench.latency_capacity * sizeof(uint32_t));
+        g_bench.latency_count = 0;
+        g_bench.received = 0;
+        pthread_mutex_unlock(&g_bench.lock);
+
+        /*
+         * Publish at a fixed rate, independent of how fast the updates
+         * are delivered.
+         */
+        const int64_t interval_ns = 1000000000LL / rate;
+        const int64_t start = monotonic_ns();
+        int64_t next_send = start;
+        long sent = 0;
+
+        while(sent < rate * seconds) {
+                const int64_t now = monotonic_ns();
+                if(now < next_send) {
+                        const struct timespec pause = {
+                                .tv_sec = (next_send - now) / 1000000000LL,
+                                .tv_nsec = (next_send - now) % 1000000000LL
+                        };
+                        nanosleep(&pause, NULL);
+                        continue;
+                }
+
+                char topic_path[256];
+                snprintf(topic_path, sizeof(topic_path), "%s/benchmark/%ld", source_root, sent % source_count);
+
+                char timestamp[32];
+                snprintf(timestamp, sizeof(timestamp), "%lld", (long long)monotonic_ns());
+
+                BUF_T *value = buf_create();
+                write_diffusion_string_value(timestamp, value);
+
+                DIFFUSION_TOPIC_UPDATE_SET_PARAMS_T topic_update_params = {
+                        .topic_path = topic_path,
+                        .datatype = DATATYPE_STRING,
+                        .update = value,
+                        .on_topic_update = on_bench_update,
+                        .on_error = on_bench_update_error
+                };
+                diffusion_topic_update_set(session, topic_update_params);
+                buf_free(value);
+
+                sent++;
+                next_send += interval_ns;
+        }
+
+        const double publish_seconds = (monotonic_ns() - start) / 1e9;
+
+        // Allow the last updates to arrive.
+        sleep(2);
+
+        UNSUBSCRIPTION_PARAMS_T unsubscribe_params = {
+                .topic_selector = selector
+        };
+        unsubscribe(subscriber, unsubscribe_params);
+
+        pthread_mutex_lock(&g_bench.lock);
+        const long received = g_bench.received;
+        const long count = g_bench.latency_count;
+        qsort(g_bench.latencies, count, sizeof(uint32_t), compare_latencies);
+        pthread_mutex_unlock(&g_bench.lock);
+
+        printf("%5d  %7d  %8ld  %9ld  %9ld  %11.0f", view_count, source_count, sent, sent * view_count,
+               received, publish_seconds > 0 ? received / publish_seconds : 0.0);
+        if(count > 0) {
+                printf("  %8u  %8u  %8u  %8u\n",
+                       percentile(g_bench.latencies, count, 50),
+                       percentile(g_bench.latencies, count, 99),
+                       percentile(g_bench.latencies, count, 99.9),
+                       g_bench.latencies[count - 1]);
+        }
+        else {
+                printf("  no updates received\n");
+        }
+
+        // Remove the views, then the source topics.
+        for(int v = 0; v < view_count; v++) {
+                char view_name[64];
+                snprintf(view_name, sizeof(view_name), "benchmark-view-%d", v);
+
+                DIFFUSION_REMOVE_TOPIC_VIEW_PARAMS_T remove_params = {
+                        .view = view_name,
+                        .on_topic_view_removed = on_bench_view_removed,
+                        .on_error = on_bench_error
+                };
+                bench_operation_start();
+                diffusion_topic_views_remove_topic_view(session, remove_params, NULL);
+        }
+        bench_await_operations();
+
+        snprintf(selector, sizeof(selector), "?%s/benchmark//", source_root);
+        TOPIC_REMOVAL_PARAMS_T topic_removal_params = {
+                .topic_selector = selector,
+                .on_removed = on_bench_topics_removed,
+                .on_error = on_bench_error
+        };
+        bench_operation_start();
+        topic_removal(session, topic_removal_params);
+        bench_await_operations();
+}
+
+
 // Program entry point.
 int main(int argc, char** argv)
 {
@@ -179,6 +556,56 @@ int main(int argc, char** argv)
                 return EXIT_FAILURE;
         }
 
+        if(hash_get(options, "benchmark") != NULL) {
+                const int source_count = atoi(hash_get(options, "sources"));
+                const long rate = atol(hash_get(options, "rate"));
+                if(source_count < 1 || rate < 1 || seconds < 1) {
+                        fprintf(stderr, "sources, rate and seconds must all be at least 1\n");
+                        return EXIT_FAILURE;
+                }
+
+                // Subscribe with a separate session, as a client of the views would.
+                SESSION_T *subscriber = session_create(url, principal, credentials, NULL, NULL, &error);
+                if(subscriber == NULL) {
+                        fprintf(stderr, "TEST: Failed to create session\n");
+                        fprintf(stderr, "ERR : %s\n", error.message);
+                        return EXIT_FAILURE;
+                }
+
+                // One value stream receives the reference topics of every run.
+                char selector[256];
+                snprintf(selector, sizeof(selector), "?%s//", reference_topic_name);
+
+                VALUE_STREAM_T value_stream = {
+                        .datatype = DATATYPE_STRING,
+                        .on_value = on_bench_value
+                };
+                add_stream(subscriber, selector, &value_stream);
+
+                printf("%5s  %7s  %8s  %9s  %9s  %11s  %8s  %8s  %8s  %8s\n",
+                       "views", "sources", "sent", "expected", "received", "received/s",
+                       "p50 us", "p99 us", "p99.9 us", "max us");
+
+                char *view_counts = strdup(hash_get(options, "views"));
+                for(char *token = strtok(view_counts, ","); token != NULL; token = strtok(NULL, ",")) {
+                        if(atoi(token) > 0) {
+                                run_benchmark(session, subscriber, topic_name, reference_topic_name,
+                                              atoi(token), source_count, rate, seconds);
+                        }
+                }
+                free(view_counts);
+                free(g_bench.latencies);
+
+                session_close(subscriber, NULL);
+                session_free(subscriber);
+                session_close(session, NULL);
+                session_free(session);
+
+                credentials_free(credentials);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
         ADD_TOPIC_CALLBACK_T callback = create_topic_callback(topic_name);
         TOPIC_SPECIFICATION_T *spec = topic_specification_init(TOPIC_TYPE_STRING);
 
@@ -24,9 +24,28 @@
  *
  * 1. Connect to Diffusion with a username and password.
  * 2. Fetch topic state using a user-specified topic path.
+ *
+ * With --snapshot, the client instead fetches the state of every topic in
+ * the tree. The top level branches of the tree are discovered first, then
+ * a pool of worker threads, each with its own session, fetches the
+ * branches concurrently. Each branch is read a page at a time, every page
+ * starting after the last path of the previous one, and the topics/sec and
+ * bytes/sec achieved are reported at the end.
+ *
+ * Fetched values are read through a table of typed decoders, one per
+ * topic type, rather than by converting values to JSON text. Numbers are
+ * read directly; for strings and the serialised form of binary, JSON and
+ * RecordV2 values the SDK allocates a copy of each value. With
+ * --benchmark, topics of mixed types are created and fetched, and the
+ * cost of decoding them through JSON text is compared with the typed
+ * decoders.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #ifndef WIN32
 #include <unistd.h>
 #else
@@ -39,9 +58,14 @@
 ARG_OPTS_T arg_opts[] = {
         ARG_OPTS_HELP,
         {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
-        {'t', "topic_path", "Topic path", ARG_REQUIRED, ARG_HAS_VALUE, NULL},
+        {'t', "topic_path", "Topic path (required unless taking a snapshot)", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
         {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "client"},
         {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'s', "snapshot", "Fetch the state of every topic in the tree", ARG_OPTIONAL, ARG_NO_VALUE, NULL},
+        {'w', "workers", "Number of branches fetched concurrently in a snapshot", ARG_OPTIONAL, ARG_HAS_VALUE, "8"},
+        {'n', "page_size", "Maximum number of topics in each snapshot page", ARG_OPTIONAL, ARG_HAS_VALUE, "5000"},
+        {'m', "max_result_size", "Maximum size in bytes of each snapshot page", ARG_OPTIONAL, ARG_HAS_VALUE, "4000000"},
+        {'b', "benchmark", "Create this many topics of each type and time decoding them", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
         END_OF_ARG_OPTS
 };
 
@@ -63,67 +87,791 @@ on_session_state_changed(SESSION_T *session, const SESSION_STATE_T old_state, co
         }
 }
 
+/*
+ * Typed decoding of fetched values. Each topic type maps to a decoder
+ * that reads the value into a DECODED_VALUE_T provided by the caller,
+ * without going through a JSON text representation.
+ */
+typedef struct decoded_value_s {
+        int64_t int64_value;
+        double double_value;
+
+        /*
+         * String values, and the serialised form of binary, JSON and
+         * RecordV2 values. The SDK allocates a new copy for each value
+         * decoded, which replaces the previous one; the caller frees the
+         * last.
+         */
+        char *bytes;
+        size_t length;
+} DECODED_VALUE_T;
+
+typedef bool (*VALUE_DECODER_T)(const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded);
+
+static bool
+decode_int64(const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded)
+{
+        return read_diffusion_int64_value(value, &decoded->int64_value, NULL);
+}
+
+static bool
+decode_double(const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded)
+{
+        return read_diffusion_double_value(value, &decoded->double_value, NULL);
+}
+
+static bool
+decode_string(const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded)
+{
+        char *string_value;
+        if(!read_diffusion_string_value(value, &string_value, NULL)) {
+                return false;
+        }
+        free(decoded->bytes);
+        decoded->bytes = string_value;
+        decoded->length = strlen(string_value);
+        return true;
+}
+
+static bool
+decode_bytes(const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded)
+{
+        free(decoded->bytes);
+        decoded->bytes = NULL;
+        decoded->length = 0;
+        return diffusion_value_get_raw_bytes(value, &decoded->bytes, &decoded->length);
+}
+
+static const struct {
+        const char *name;
+        VALUE_DECODER_T decode;
+} VALUE_DECODERS[] = {
+        [TOPIC_TYPE_JSON] = { "JSON", decode_bytes },
+        [TOPIC_TYPE_INT64] = { "Int64", decode_int64 },
+        [TOPIC_TYPE_BINARY] = { "Binary", decode_bytes },
+        [TOPIC_TYPE_DOUBLE] = { "Double", decode_double },
+        [TOPIC_TYPE_STRING] = { "String", decode_string },
+        [TOPIC_TYPE_RECORDV2] = { "RecordV2", decode_bytes }
+};
+
+/*
+ * Decodes a value of the given topic type. Returns false if there is no
+ * decoder for the type or the value can't be read.
+ */
+static bool
+decode_value(TOPIC_TYPE_T topic_type, const DIFFUSION_VALUE_T *value, DECODED_VALUE_T *decoded)
+{
+        if((size_t)topic_type >= sizeof(VALUE_DECODERS) / sizeof(VALUE_DECODERS[0])
+           || VALUE_DECODERS[topic_type].decode == NULL) {
+                return false;
+        }
+        return VALUE_DECODERS[topic_type].decode(value, decoded);
+}
+
 static int
 on_fetch_result(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
 {
         LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        DECODED_VALUE_T decoded = { 0 };
+
+        const int size = list_get_size(results);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+
+                char *topic_path = diffusion_topic_result_get_path(topic_result);
+                printf("Fetching value from \"%s\"\n", topic_path);
+                free(topic_path);
+
+                const TOPIC_TYPE_T topic_type = diffusion_topic_result_get_topic_type(topic_result);
+
+                if(value != NULL && decode_value(topic_type, value, &decoded)) {
+                        const char *name = VALUE_DECODERS[topic_type].name;
+                        char *text = NULL;
+
+                        switch(topic_type) {
+                        case TOPIC_TYPE_INT64:
+                                printf("%s topic type, fetch value: " "%"PRId64 "\n", name, decoded.int64_value);
+                                break;
+                        case TOPIC_TYPE_DOUBLE:
+                                printf("%s topic type, fetch value: %f\n", name, decoded.double_value);
+                                break;
+                        case TOPIC_TYPE_STRING:
+                                printf("%s topic type, fetch value: %s\n", name, decoded.bytes);
+                                break;
+                        case TOPIC_TYPE_BINARY:
+                                printf("%s topic type, fetch value: %.*s\n", name, (int)decoded.length, decoded.bytes);
+                                break;
+                        case TOPIC_TYPE_JSON:
+                                // The serialised form is CBOR, so convert it to text for display.
+                                if(to_diffusion_json_string(value, &text, NULL)) {
+                                        printf("%s topic type, fetch value: %s\n", name, text);
+                                }
+                                break;
+                        case TOPIC_TYPE_RECORDV2:
+                                if(diffusion_recordv2_to_string(value, &text, NULL)) {
+                                        printf("%s topic type, fetch value: %s\n", name, text);
+                                }
+                                break;
+                        default:
+                                printf("%s topic type, fetch value: %zu bytes\n", name, decoded.length);
+                                break;
+                        }
+                        free(text);
+                }
+                else {
+                        printf("No fetch value\n");
+                }
+        }
+
+        free(decoded.bytes);
+        list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        return HANDLER_SUCCESS;
+}
+
+/*
+ * State shared by the snapshot worker threads.
+ */
+typedef struct snapshot_s {
+        const char *url;
+        const char *principal;
+        CREDENTIALS_T *credentials;
+        int page_size;
+        uint32_t max_result_size;
+
+        pthread_mutex_t lock;
+
+        /*
+         * The first path segment of each top level branch, in path
+         * order, and the index of the next one to be fetched.
+         */
+        char **branches;
+        int branch_count;
+        int branch_capacity;
+        int next_branch;
+
+        long topics;
+        long bytes;
+        long pages;
+        long failed_branches;
+} SNAPSHOT_T;
+
+/*
+ * A single page of a fetch, waited for by the thread that issued it.
+ */
+typedef struct fetch_page_s {
+        SNAPSHOT_T *snapshot;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool done;
+        bool failed;
+
+        bool has_more;
+        char *last_path;
+        long topics;
+        long bytes;
+} FETCH_PAGE_T;
+
+static void
+fetch_page_complete(FETCH_PAGE_T *page, bool failed)
+{
+        pthread_mutex_lock(&page->lock);
+        page->done = true;
+        page->failed = failed;
+        pthread_cond_signal(&page->cond);
+        pthread_mutex_unlock(&page->lock);
+}
+
+/*
+ * Records the path of the last result in a page, from which the next page
+ * starts.
+ */
+static void
+fetch_page_set_last_path(FETCH_PAGE_T *page, LIST_T *results)
+{
+        const int size = list_get_size(results);
+        if(size > 0) {
+                free(page->last_path);
+                page->last_path = diffusion_topic_result_get_path(list_get_data_indexed(results, size - 1));
+        }
+}
+
+/*
+ * Collects the top level branches named in a page of the branch
+ * discovery fetch. Results arrive in path order, so a branch only needs
+ * comparing with the last one recorded.
+ */
+static int
+on_branch_page(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
+{
+        FETCH_PAGE_T *page = context;
+        SNAPSHOT_T *snapshot = page->snapshot;
+
+        LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        const int size = list_get_size(results);
+
+        for(int i = 0; i < size; i++) {
+                char *topic_path = diffusion_topic_result_get_path(list_get_data_indexed(results, i));
+                char *separator = strchr(topic_path, '/');
+                if(separator != NULL) {
+                        *separator = '\0';
+                }
+
+                if(snapshot->branch_count == 0 ||
+                   strcmp(snapshot->branches[snapshot->branch_count - 1], topic_path) != 0) {
+                        if(snapshot->branch_count == snapshot->branch_capacity) {
+                                snapshot->branch_capacity = snapshot->branch_capacity * 2 + 16;
+                                snapshot->branches = realloc(snapshot->branches,
+                                                             snapshot->branch_capacity * sizeof(char *));
+                        }
+                        snapshot->branches[snapshot->branch_count++] = strdup(topic_path);
+                }
+                free(topic_path);
+        }
+
+        fetch_page_set_last_path(page, results);
+        page->has_more = diffusion_fetch_result_has_more(fetch_result);
+
+        list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        fetch_page_complete(page, false);
+        return HANDLER_SUCCESS;
+}
+
+/*
+ * Walks every result in a page of a branch, counting the topics and the
+ * bytes of their values.
+ */
+static int
+on_snapshot_page(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
+{
+        FETCH_PAGE_T *page = context;
+
+        LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        const int size = list_get_size(results);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+
+                if(value != NULL) {
+                        char *bytes;
+                        size_t length;
+                        if(diffusion_value_get_raw_bytes(value, &bytes, &length)) {
+                                /*
+                                 * A cache being warmed would take its copy
+                                 * of the value here.
+                                 */
+                                page->bytes += length;
+                                free(bytes);
+                        }
+                }
+                page->topics++;
+        }
+
+        fetch_page_set_last_path(page, results);
+        page->has_more = diffusion_fetch_result_has_more(fetch_result);
+
+        list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        fetch_page_complete(page, false);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_fetch_page_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("Fetch failed: %s\n", error->message);
+        fetch_page_complete(error->context, true);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_fetch_page_discard(SESSION_T *session, void *context)
+{
+        fetch_page_complete(context, true);
+        return HANDLER_SUCCESS;
+}
+
+/*
+ * Fetches every page of a selector, starting at "from" or at the start of
+ * the tree if that is NULL. Returns false if any page fails.
+ */
+static bool
+fetch_all_pages(
+        SESSION_T *session,
+        const char *selector,
+        const char *from,
+        bool with_values,
+        int (*on_page)(const DIFFUSION_FETCH_RESULT_T *, void *),
+        FETCH_PAGE_T *page)
+{
+        SNAPSHOT_T *snapshot = page->snapshot;
+
+        do {
+                DIFFUSION_FETCH_REQUEST_T *fetch_request = diffusion_fetch_request_init(session);
+                if(with_values) {
+                        diffusion_fetch_request_with_values(fetch_request, NULL, NULL);
+                        diffusion_fetch_request_maximum_result_size(fetch_request, snapshot->max_result_size, NULL);
+                }
+                else {
+                        /*
+                         * Only one topic from each top level branch is
+                         * needed to discover the branches.
+                         */
+                        diffusion_fetch_request_limit_deep_branches(fetch_request, 1, 1, NULL);
+                }
+                if(page->last_path != NULL) {
+                        diffusion_fetch_request_after(fetch_request, page->last_path, NULL);
+                }
+                else if(from != NULL) {
+                        diffusion_fetch_request_from(fetch_request, from, NULL);
+                }
+                diffusion_fetch_request_first(fetch_request, snapshot->page_size, NULL);
+
+                DIFFUSION_FETCH_REQUEST_PARAMS_T params = {
+                        .topic_selector = selector,
+                        .fetch_request = fetch_request,
+                        .on_fetch_result = on_page,
+                        .on_error = on_fetch_page_error,
+                        .on_discard = on_fetch_page_discard,
+                        .context = page
+                };
+
+                pthread_mutex_lock(&page->lock);
+                page->done = false;
+                page->has_more = false;
+                pthread_mutex_unlock(&page->lock);
+
+                diffusion_fetch_request_fetch(session, params);
+
+                pthread_mutex_lock(&page->lock);
+                while(!page->done) {
+                        pthread_cond_wait(&page->cond, &page->lock);
+                }
+                pthread_mutex_unlock(&page->lock);
+
+                diffusion_fetch_request_free(fetch_request);
+
+                pthread_mutex_lock(&snapshot->lock);
+                snapshot->pages++;
+                pthread_mutex_unlock(&snapshot->lock);
+        } while(!page->failed && page->has_more);
+
+        return !page->failed;
+}
+
+static void
+fetch_page_init(FETCH_PAGE_T *page, SNAPSHOT_T *snapshot)
+{
+        memset(page, 0, sizeof(FETCH_PAGE_T));
+        page->snapshot = snapshot;
+        pthread_mutex_init(&page->lock, NULL);
+        pthread_cond_init(&page->cond, NULL);
+}
+
+static void
+fetch_page_destroy(FETCH_PAGE_T *page)
+{
+        free(page->last_path);
+        pthread_mutex_destroy(&page->lock);
+        pthread_cond_destroy(&page->cond);
+}
+
+/*
+ * Each worker connects its own session and fetches branches until there
+ * are none left.
+ */
+static void *
+snapshot_worker(void *arg)
+{
+        SNAPSHOT_T *snapshot = arg;
 
-        DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, 0);
-        DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+        DIFFUSION_ERROR_T error = { 0 };
+        SESSION_T *session = session_create(snapshot->url, snapshot->principal, snapshot->credentials,
+                                            NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return NULL;
+        }
+
+        for(;;) {
+                pthread_mutex_lock(&snapshot->lock);
+                const int index = snapshot->next_branch < snapshot->branch_count ? snapshot->next_branch++ : -1;
+                pthread_mutex_unlock(&snapshot->lock);
+                if(index < 0) {
+                        break;
+                }
+
+                const char *branch = snapshot->branches[index];
+                char *selector = malloc(strlen(branch) + 4);
+                sprintf(selector, ">%s//", branch);
+
+                FETCH_PAGE_T page;
+                fetch_page_init(&page, snapshot);
+                const bool fetched = fetch_all_pages(session, selector, branch, true, on_snapshot_page, &page);
+
+                pthread_mutex_lock(&snapshot->lock);
+                snapshot->topics += page.topics;
+                snapshot->bytes += page.bytes;
+                if(!fetched) {
+                        snapshot->failed_branches++;
+                }
+                pthread_mutex_unlock(&snapshot->lock);
+
+                fetch_page_destroy(&page);
+                free(selector);
+        }
+
+        session_close(session, NULL);
+        session_free(session);
+        return NULL;
+}
+
+/*
+ * Fetches the value of every topic in the tree and reports the rate.
+ */
+static void
+take_snapshot(
+        SESSION_T *session,
+        const char *url,
+        const char *principal,
+        CREDENTIALS_T *credentials,
+        int workers,
+        int page_size,
+        uint32_t max_result_size)
+{
+        SNAPSHOT_T snapshot = {
+                .url = url,
+                .principal = principal,
+                .credentials = credentials,
+                .page_size = page_size,
+                .max_result_size = max_result_size
+        };
+        pthread_mutex_init(&snapshot.lock, NULL);
+
+        struct timespec start, discovered, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        FETCH_PAGE_T page;
+        fetch_page_init(&page, &snapshot);
+        const bool discovered_branches = fetch_all_pages(session, "?.*//", NULL, false, on_branch_page, &page);
+        fetch_page_destroy(&page);
+
+        clock_gettime(CLOCK_MONOTONIC, &discovered);
+        printf("Discovered %d top level branches in %.3f s\n",
+               snapshot.branch_count,
+               (discovered.tv_sec - start.tv_sec) + (discovered.tv_nsec - start.tv_nsec) / 1e9);
+
+        if(discovered_branches) {
+                pthread_t *threads = calloc(workers, sizeof(pthread_t));
+                for(int i = 0; i < workers; i++) {
+                        pthread_create(&threads[i], NULL, snapshot_worker, &snapshot);
+                }
+                for(int i = 0; i < workers; i++) {
+                        pthread_join(threads[i], NULL);
+                }
+                free(threads);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Fetched %ld topics, %ld value bytes in %ld pages in %.3f s\n",
+               snapshot.topics, snapshot.bytes, snapshot.pages, seconds);
+        printf("%.0f topics/sec, %.0f bytes/sec, %ld failed branches\n",
+               seconds > 0 ? snapshot.topics / seconds : 0.0,
+               seconds > 0 ? snapshot.bytes / seconds : 0.0,
+               snapshot.failed_branches + (discovered_branches ? 0 : 1));
+
+        for(int i = 0; i < snapshot.branch_count; i++) {
+                free(snapshot.branches[i]);
+        }
+        free(snapshot.branches);
+        pthread_mutex_destroy(&snapshot.lock);
+}
+
+/*
+ * The decoding benchmark creates topics of each type under this root.
+ */
+#define BENCHMARK_ROOT "fetch-request-benchmark"
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        long in_flight;
+        long failed;
+
+        long values;
+        double text_seconds;
+        double typed_seconds;
+
+        // Keeps the decoded values live so the work isn't optimised away.
+        int64_t checksum;
+} g_benchmark = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void
+benchmark_update_complete(bool failed)
+{
+        pthread_mutex_lock(&g_benchmark.lock);
+        g_benchmark.in_flight--;
+        if(failed) {
+                g_benchmark.failed++;
+        }
+        pthread_cond_signal(&g_benchmark.cond);
+        pthread_mutex_unlock(&g_benchmark.lock);
+}
+
+static int
+on_benchmark_topic_set(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        benchmark_update_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_benchmark_topic_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        benchmark_update_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_benchmark_topics_removed(SESSION_T *session, const DIFFUSION_TOPIC_REMOVAL_RESULT_T *result, void *context)
+{
+        benchmark_update_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+static int
+on_benchmark_remove_discard(SESSION_T *session, void *context)
+{
+        benchmark_update_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+/*
+ * Creates "count" topics of each of the JSON, string, int64, double and
+ * binary types, keeping up to 1000 updates in flight.
+ */
+static void
+create_benchmark_topics(SESSION_T *session, long count)
+{
+        static const TOPIC_TYPE_T topic_types[] = {
+                TOPIC_TYPE_JSON, TOPIC_TYPE_STRING, TOPIC_TYPE_INT64, TOPIC_TYPE_DOUBLE, TOPIC_TYPE_BINARY
+        };
+        static const DIFFUSION_DATATYPE datatypes[] = {
+                DATATYPE_JSON, DATATYPE_STRING, DATATYPE_INT64, DATATYPE_DOUBLE, DATATYPE_BINARY
+        };
+
+        for(int t = 0; t < 5; t++) {
+                TOPIC_SPECIFICATION_T *specification = topic_specification_init(topic_types[t]);
+
+                for(long i = 0; i < count; i++) {
+                        pthread_mutex_lock(&g_benchmark.lock);
+                        while(g_benchmark.in_flight >= 1000) {
+                                pthread_cond_wait(&g_benchmark.cond, &g_benchmark.lock);
+                        }
+                        g_benchmark.in_flight++;
+                        pthread_mutex_unlock(&g_benchmark.lock);
+
+                        char topic_path[128];
+                        snprintf(topic_path, sizeof(topic_path), "%s/%s/%ld",
+                                 BENCHMARK_ROOT, VALUE_DECODERS[topic_types[t]].name, i);
+
+                        char text[64];
+                        BUF_T *update_buf = buf_create();
+                        switch(topic_types[t]) {
+                        case TOPIC_TYPE_JSON:
+                                snprintf(text, sizeof(text), "{\"id\":%ld,\"name\":\"value %ld\"}", i, i);
+                                write_diffusion_json_value(text, update_buf);
+                                break;
+                        case TOPIC_TYPE_STRING:
+                                snprintf(text, sizeof(text), "value %ld", i);
+                                write_diffusion_string_value(text, update_buf);
+                                break;
+                        case TOPIC_TYPE_INT64:
+                                write_diffusion_int64_value(i, update_buf);
+                                break;
+                        case TOPIC_TYPE_DOUBLE:
+                                write_diffusion_double_value(i * 0.5, update_buf);
+                                break;
+                        default:
+                                snprintf(text, sizeof(text), "binary value %ld", i);
+                                write_diffusion_binary_value(text, update_buf, strlen(text));
+                                break;
+                        }
 
-        char *topic_path = diffusion_topic_result_get_path(topic_result);
-        printf("Fetching value from \"%s\"\n", topic_path);
+                        DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T params = {
+                                .topic_path = topic_path,
+                                .specification = specification,
+                                .datatype = datatypes[t],
+                                .update = update_buf,
+                                .on_topic_update_add_and_set = on_benchmark_topic_set,
+                                .on_error = on_benchmark_topic_error
+                        };
+                        diffusion_topic_update_add_and_set(session, params);
+                        buf_free(update_buf);
+                }
+
+                topic_specification_free(specification);
+        }
 
-        if(value != NULL) {
-                switch(diffusion_topic_result_get_topic_type(topic_result)) {
+        pthread_mutex_lock(&g_benchmark.lock);
+        while(g_benchmark.in_flight > 0) {
+                pthread_cond_wait(&g_benchmark.cond, &g_benchmark.lock);
+        }
+        pthread_mutex_unlock(&g_benchmark.lock);
+}
+
+static double
+seconds_between(const struct timespec *start, const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Decodes every value in a page twice: once by converting it to JSON text
+ * and parsing the numbers back out, as a generic handler would, and once
+ * with the typed decoders.
+ */
+static int
+on_benchmark_page(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
+{
+        FETCH_PAGE_T *page = context;
+
+        LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        const int size = list_get_size(results);
+        int64_t checksum = 0;
+
+        struct timespec start, text_end, typed_end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+                const TOPIC_TYPE_T topic_type = diffusion_topic_result_get_topic_type(topic_result);
+                if(value == NULL) {
+                        continue;
+                }
 
                 char *json_value;
-                int64_t int64_value;
                 void *binary_value;
-                double double_value;
-                char *string_value;
-                char *recordv2_value;
 
-                case TOPIC_TYPE_JSON:
-                        to_diffusion_json_string(value, &json_value, NULL);
-                        printf("JSON topic type, fetch value: %s\n", json_value);
+                if(topic_type == TOPIC_TYPE_BINARY) {
+                        if(read_diffusion_binary_value(value, &binary_value, NULL)) {
+                                checksum += ((unsigned char *)binary_value)[0];
+                                free(binary_value);
+                        }
+                }
+                else if(to_diffusion_json_string(value, &json_value, NULL)) {
+                        if(topic_type == TOPIC_TYPE_INT64) {
+                                checksum += strtoll(json_value, NULL, 10);
+                        }
+                        else if(topic_type == TOPIC_TYPE_DOUBLE) {
+                                checksum += (int64_t)strtod(json_value, NULL);
+                        }
+                        else {
+                                checksum += strlen(json_value);
+                        }
                         free(json_value);
-                        break;
-                case TOPIC_TYPE_INT64:
-                        read_diffusion_int64_value(value, &int64_value, NULL);
-                        printf("Int64 topic type, fetch value: " "%"PRId64 "\n", int64_value);
-                        break;
-                case TOPIC_TYPE_BINARY:
-                        read_diffusion_binary_value(value, &binary_value, NULL);
-                        printf("Binary topic type, fetch value: %s\n", (char *)binary_value);
-                        free(binary_value);
-                        break;
-                case TOPIC_TYPE_DOUBLE:
-                        read_diffusion_double_value(value, &double_value, NULL);
-                        printf("Double topic type, fetch value: %f\n", double_value);
-                        break;
-                case TOPIC_TYPE_STRING:
-                        read_diffusion_string_value(value, &string_value, NULL);
-                        printf("String topic type, fetch value: %s\n", string_value);
-                        free(string_value);
-                        break;
-                case TOPIC_TYPE_RECORDV2:
-                        diffusion_recordv2_to_string(value, &recordv2_value, NULL);
-                        printf("RecordV2 topic type, fetch value: %s\n", recordv2_value);
-                        free(recordv2_value);
-                        break;
-                default:
-                        break;
                 }
         }
-        else {
-                printf("No fetch value\n");
+
+        clock_gettime(CLOCK_MONOTONIC, &text_end);
+
+        DECODED_VALUE_T decoded = { 0 };
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+                const TOPIC_TYPE_T topic_type = diffusion_topic_result_get_topic_type(topic_result);
+
+                if(value != NULL && decode_value(topic_type, value, &decoded)) {
+                        switch(topic_type) {
+                        case TOPIC_TYPE_INT64:
+                                checksum -= decoded.int64_value;
+                                break;
+                        case TOPIC_TYPE_DOUBLE:
+                                checksum -= (int64_t)decoded.double_value;
+                                break;
+                        default:
+                                checksum -= decoded.length;
+                                break;
+                        }
+                }
         }
+        free(decoded.bytes);
+
+        clock_gettime(CLOCK_MONOTONIC, &typed_end);
+
+        pthread_mutex_lock(&g_benchmark.lock);
+        g_benchmark.values += size;
+        g_benchmark.text_seconds += seconds_between(&start, &text_end);
+        g_benchmark.typed_seconds += seconds_between(&text_end, &typed_end);
+        g_benchmark.checksum += checksum;
+        pthread_mutex_unlock(&g_benchmark.lock);
+
+        fetch_page_set_last_path(page, results);
+        page->has_more = diffusion_fetch_result_has_more(fetch_result);
 
         list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        fetch_page_complete(page, false);
         return HANDLER_SUCCESS;
 }
 
+/*
+ * Compares decoding a mixed-type result set through JSON text with the
+ * typed decoders.
+ */
+static void
+run_decode_benchmark(SESSION_T *session, long count, int page_size, uint32_t max_result_size)
+{
+        SNAPSHOT_T snapshot = {
+                .page_size = page_size,
+                .max_result_size = max_result_size
+        };
+        pthread_mutex_init(&snapshot.lock, NULL);
+
+        create_benchmark_topics(session, count);
+        printf("Created %ld topics of each type, %ld failed\n", count, g_benchmark.failed);
+
+        FETCH_PAGE_T page;
+        fetch_page_init(&page, &snapshot);
+        fetch_all_pages(session, "?" BENCHMARK_ROOT "//", NULL, true, on_benchmark_page, &page);
+        fetch_page_destroy(&page);
+
+        const long values = g_benchmark.values;
+        printf("Decoded %ld values in %ld pages\n", values, snapshot.pages);
+        if(values > 0) {
+                printf("JSON text: %.1f ns/value\n", g_benchmark.text_seconds * 1e9 / values);
+                printf("Typed    : %.1f ns/value\n", g_benchmark.typed_seconds * 1e9 / values);
+        }
+
+        TOPIC_REMOVAL_PARAMS_T remove_params = {
+                .on_removed = on_benchmark_topics_removed,
+                .on_discard = on_benchmark_remove_discard,
+                .topic_selector = "?" BENCHMARK_ROOT "//"
+        };
+
+        pthread_mutex_lock(&g_benchmark.lock);
+        g_benchmark.in_flight = 1;
+        pthread_mutex_unlock(&g_benchmark.lock);
+
+        topic_removal(session, remove_params);
+
+        pthread_mutex_lock(&g_benchmark.lock);
+        while(g_benchmark.in_flight > 0) {
+                pthread_cond_wait(&g_benchmark.cond, &g_benchmark.lock);
+        }
+        pthread_mutex_unlock(&g_benchmark.lock);
+
+        pthread_mutex_destroy(&snapshot.lock);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -139,6 +887,12 @@ main(int argc, char **argv)
         char *url = hash_get(options, "url");
         char *topic = hash_get(options, "topic_path");
         const char *principal = hash_get(options, "principal");
+        const bool snapshot = hash_get(options, "snapshot") != NULL;
+        const char *benchmark = hash_get(options, "benchmark");
+        if(!snapshot && benchmark == NULL && topic == NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
 
         CREDENTIALS_T *credentials = NULL;
         const char *password = hash_get(options, "credentials");
@@ -168,6 +922,26 @@ main(int argc, char **argv)
                 return EXIT_FAILURE;
         }
 
+        if(snapshot || benchmark != NULL) {
+                const int page_size = atoi(hash_get(options, "page_size"));
+                const uint32_t max_result_size = (uint32_t)atol(hash_get(options, "max_result_size"));
+
+                if(snapshot) {
+                        take_snapshot(session, url, principal, credentials,
+                                      atoi(hash_get(options, "workers")), page_size, max_result_size);
+                }
+                else {
+                        run_decode_benchmark(session, atol(benchmark), page_size, max_result_size);
+                }
+
+                session_close(session, NULL);
+                session_free(session);
+
+                credentials_free(credentials);
+                hash_free(options, NULL, free);
+                return EXIT_SUCCESS;
+        }
+
         /*
          * Create the fetch request
          */
@@ -0,0 +1,680 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example compares two ways of building a local copy of the values
+ * of a set of topics when a client starts:
+ *
+ *   fetch      fetch the topics with their values, a page at a time
+ *   subscribe  add a value stream, subscribe, and wait until the initial
+ *              value of every topic has been received
+ *
+ * For each combination of tree size and depth, a tree of string topics is
+ * created, then each strategy is timed in a new session, storing every
+ * value in a HASH_T keyed by path. Each run is made in a new process, so
+ * memory retained by one run does not hide the growth of the next. The
+ * resident set size is sampled while the strategy runs, and the
+ * high-water mark above the size at the start of the process is reported
+ * alongside the time taken.
+ *
+ * A tree of depth D with N topics has a fan-out of N^(1/D), rounded up, at
+ * each level.
+ *
+ * Memory is read from /proc/self/statm, so is only reported on Linux.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+        #include <unistd.h>
+        #include <sys/types.h>
+        #include <sys/wait.h>
+#else
+        #define sleep(x) Sleep(1000 * x)
+#endif
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'t', "topic", "Root of the topic trees to create", ARG_OPTIONAL, ARG_HAS_VALUE, "fetch-vs-subscribe"},
+        {'n', "sizes", "Comma separated list of numbers of topics", ARG_OPTIONAL, ARG_HAS_VALUE, "1000,10000,100000"},
+        {'d', "depths", "Comma separated list of tree depths", ARG_OPTIONAL, ARG_HAS_VALUE, "1,3"},
+        {'s', "page_size", "Maximum number of topics in each fetch page", ARG_OPTIONAL, ARG_HAS_VALUE, "5000"},
+        {'v', "value_size", "Size in bytes of each topic value", ARG_OPTIONAL, ARG_HAS_VALUE, "64"},
+        {'w', "timeout", "Seconds to wait for a strategy to complete", ARG_OPTIONAL, ARG_HAS_VALUE, "120"},
+        {'r', "run", "Run only this strategy against the first size and depth, without creating topics", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * State shared with the handlers. Only one operation runs at a time.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        // Set when a topic update, removal or fetch page completes.
+        long in_flight;
+        long failed;
+
+        // The local view being built, and the number of topics it must hold.
+        HASH_T *view;
+        long view_size;
+        long expected;
+        size_t value_bytes;
+
+        // Paging state for fetches.
+        char *last_path;
+        bool has_more;
+
+        // Set when the strategy can add nothing more to the view.
+        bool complete;
+} g_run = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+};
+
+
+static void operation_complete(bool failed)
+{
+        pthread_mutex_lock(&g_run.lock);
+        g_run.in_flight--;
+        if(failed) {
+                g_run.failed++;
+        }
+        pthread_cond_broadcast(&g_run.cond);
+        pthread_mutex_unlock(&g_run.lock);
+}
+
+
+static void await_operations(void)
+{
+        pthread_mutex_lock(&g_run.lock);
+        while(g_run.in_flight > 0) {
+                pthread_cond_wait(&g_run.cond, &g_run.lock);
+        }
+        pthread_mutex_unlock(&g_run.lock);
+}
+
+
+/*
+ * Adds a value to the local view. Only the first value for each path
+ * counts towards completing the view.
+ */
+static void store_value(const char *topic_path, const DIFFUSION_VALUE_T *value)
+{
+        char *string_value;
+        if(value == NULL || !read_diffusion_string_value(value, &string_value, NULL)) {
+                return;
+        }
+
+        pthread_mutex_lock(&g_run.lock);
+        char *previous = hash_add(g_run.view, topic_path, string_value);
+        if(previous == NULL) {
+                g_run.view_size++;
+                g_run.value_bytes += strlen(string_value);
+                if(g_run.view_size == g_run.expected) {
+                        pthread_cond_broadcast(&g_run.cond);
+                }
+        }
+        pthread_mutex_unlock(&g_run.lock);
+        free(previous);
+}
+
+
+/*
+ * Resident set size sampling.
+ */
+static long read_resident_bytes(void)
+{
+        long pages = 0;
+        FILE *statm = fopen("/proc/self/statm", "r");
+        if(statm != NULL) {
+                if(fscanf(statm, "%*d %ld", &pages) != 1) {
+                        pages = 0;
+                }
+                fclose(statm);
+        }
+        return pages * sysconf(_SC_PAGESIZE);
+}
+
+
+typedef struct memory_sampler_s {
+        pthread_t thread;
+        volatile bool running;
+        long baseline;
+        long high_water;
+} MEMORY_SAMPLER_T;
+
+
+static void *memory_sampler_run(void *arg)
+{
+        MEMORY_SAMPLER_T *sampler = arg;
+        const struct timespec interval = { 0, 5 * 1000000 };
+
+        while(sampler->running) {
+                const long resident = read_resident_bytes();
+                if(resident > sampler->high_water) {
+                        sampler->high_water = resident;
+                }
+                nanosleep(&interval, NULL);
+        }
+        return NULL;
+}
+
+
+static void memory_sampler_start(MEMORY_SAMPLER_T *sampler)
+{
+        sampler->baseline = read_resident_bytes();
+        sampler->high_water = sampler->baseline;
+        sampler->running = true;
+        pthread_create(&sampler->thread, NULL, memory_sampler_run, sampler);
+}
+
+
+// Returns the high-water mark above the baseline, in bytes.
+static long memory_sampler_stop(MEMORY_SAMPLER_T *sampler)
+{
+        sampler->running = false;
+        pthread_join(sampler->thread, NULL);
+
+        const long resident = read_resident_bytes();
+        if(resident > sampler->high_water) {
+                sampler->high_water = resident;
+        }
+        return sampler->high_water - sampler->baseline;
+}
+
+
+/*
+ * Creating and removing the topic trees.
+ */
+static int on_topic_set(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_operation_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        if(g_run.failed == 0) {
+                printf("Operation failed: %s\n", error->message);
+        }
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_operation_discard(SESSION_T *session, void *context)
+{
+        operation_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_topics_removed(
+        SESSION_T *session,
+        const DIFFUSION_TOPIC_REMOVAL_RESULT_T *result,
+        void *context)
+{
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+// Path of topic "index" in a tree of the given depth and fan-out.
+static void tree_path(char *buffer, size_t size, const char *root, long index, int depth, long fan_out)
+{
+        long divisor = 1;
+        for(int level = 1; level < depth; level++) {
+                divisor *= fan_out;
+        }
+
+        int length = snprintf(buffer, size, "%s", root);
+        for(int level = 0; level < depth; level++) {
+                length += snprintf(buffer + length, size - length, "/%ld", (index / divisor) % fan_out);
+                divisor = divisor > 1 ? divisor / fan_out : 1;
+        }
+}
+
+
+static void create_tree(SESSION_T *session, const char *root, long count, int depth, int value_size)
+{
+        const long fan_out = (long)ceil(pow((double)count, 1.0 / depth));
+        TOPIC_SPECIFICATION_T *specification = topic_specification_init(TOPIC_TYPE_STRING);
+
+        char *value = malloc(value_size + 1);
+        memset(value, 'x', value_size);
+        value[value_size] = '\0';
+
+        for(long i = 0; i < count; i++) {
+                pthread_mutex_lock(&g_run.lock);
+                while(g_run.in_flight >= 1000) {
+                        pthread_cond_wait(&g_run.cond, &g_run.lock);
+                }
+                g_run.in_flight++;
+                pthread_mutex_unlock(&g_run.lock);
+
+                char topic_path[256];
+                tree_path(topic_path, sizeof(topic_path), root, i, depth, fan_out);
+
+                BUF_T *update_buf = buf_create();
+                write_diffusion_string_value(value, update_buf);
+
+                DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T params = {
+                        .topic_path = topic_path,
+                        .specification = specification,
+                        .datatype = DATATYPE_STRING,
+                        .update = update_buf,
+                        .on_topic_update_add_and_set = on_topic_set,
+                        .on_error = on_operation_error,
+                        .on_discard = on_operation_discard
+                };
+                diffusion_topic_update_add_and_set(session, params);
+                buf_free(update_buf);
+        }
+        await_operations();
+
+        free(value);
+        topic_specification_free(specification);
+}
+
+
+static void remove_tree(SESSION_T *session, const char *selector)
+{
+        TOPIC_REMOVAL_PARAMS_T remove_params = {
+                .topic_selector = selector,
+                .on_removed = on_topics_removed,
+                .on_error = on_operation_error,
+                .on_discard = on_operation_discard
+        };
+
+        pthread_mutex_lock(&g_run.lock);
+        g_run.in_flight = 1;
+        pthread_mutex_unlock(&g_run.lock);
+
+        topic_removal(session, remove_params);
+        await_operations();
+}
+
+
+/*
+ * Fetch strategy.
+ */
+static int on_fetch_page(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
+{
+        LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        const int size = list_get_size(results);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                char *topic_path = diffusion_topic_result_get_path(topic_result);
+                store_value(topic_path, diffusion_topic_result_get_value(topic_result));
+
+                if(i == size - 1) {
+                        free(g_run.last_path);
+                        g_run.last_path = topic_path;
+                }
+                else {
+                        free(topic_path);
+                }
+        }
+
+        g_run.has_more = diffusion_fetch_result_has_more(fetch_result);
+
+        list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        operation_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static void fetch_view(SESSION_T *session, const char *selector, int page_size)
+{
+        free(g_run.last_path);
+        g_run.last_path = NULL;
+
+        do {
+                DIFFUSION_FETCH_REQUEST_T *fetch_request = diffusion_fetch_request_init(session);
+                diffusion_fetch_request_with_values(fetch_request, NULL, NULL);
+                diffusion_fetch_request_first(fetch_request, page_size, NULL);
+                if(g_run.last_path != NULL) {
+                        diffusion_fetch_request_after(fetch_request, g_run.last_path, NULL);
+                }
+
+                DIFFUSION_FETCH_REQUEST_PARAMS_T params = {
+                        .topic_selector = selector,
+                        .fetch_request = fetch_request,
+                        .on_fetch_result = on_fetch_page,
+                        .on_error = on_operation_error,
+                        .on_discard = on_operation_discard
+                };
+
+                pthread_mutex_lock(&g_run.lock);
+                g_run.in_flight = 1;
+                g_run.has_more = false;
+                const long failed = g_run.failed;
+                pthread_mutex_unlock(&g_run.lock);
+
+                diffusion_fetch_request_fetch(session, params);
+                await_operations();
+                diffusion_fetch_request_free(fetch_request);
+
+                if(g_run.failed != failed) {
+                        break;
+                }
+        } while(g_run.has_more);
+
+        // Every page has been received, or one failed; stop waiting.
+        pthread_mutex_lock(&g_run.lock);
+        g_run.complete = true;
+        pthread_cond_broadcast(&g_run.cond);
+        pthread_mutex_unlock(&g_run.lock);
+}
+
+
+/*
+ * Subscribe strategy.
+ */
+static int on_value(
+        const char *topic_path,
+        const TOPIC_SPECIFICATION_T *const specification,
+        const DIFFUSION_DATATYPE datatype,
+        const DIFFUSION_VALUE_T *const old_value,
+        const DIFFUSION_VALUE_T *const new_value,
+        void *context)
+{
+        store_value(topic_path, new_value);
+        return HANDLER_SUCCESS;
+}
+
+
+static void subscribe_view(SESSION_T *session, const char *selector)
+{
+        VALUE_STREAM_T value_stream = {
+                .datatype = DATATYPE_STRING,
+                .on_value = on_value
+        };
+        add_stream(session, selector, &value_stream);
+
+        SUBSCRIPTION_PARAMS_T params = {
+                .topic_selector = selector
+        };
+        subscribe(session, params);
+}
+
+
+/*
+ * Runs one strategy in a new session, returning false if the view was not
+ * complete within the timeout.
+ */
+static bool run_strategy(
+        const char *name,
+        const char *url,
+        const char *principal,
+        CREDENTIALS_T *credentials,
+        const char *selector,
+        long count,
+        int depth,
+        int page_size,
+        int timeout)
+{
+        pthread_mutex_lock(&g_run.lock);
+        g_run.view = hash_new(count > 16 ? count : 16);
+        g_run.view_size = 0;
+        g_run.expected = count;
+        g_run.value_bytes = 0;
+        g_run.failed = 0;
+        g_run.complete = false;
+        pthread_mutex_unlock(&g_run.lock);
+
+        MEMORY_SAMPLER_T sampler = { 0 };
+        memory_sampler_start(&sampler);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        DIFFUSION_ERROR_T error = { 0 };
+        SESSION_T *session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                memory_sampler_stop(&sampler);
+                hash_free(g_run.view, NULL, free);
+                return false;
+        }
+
+        if(strcmp(name, "fetch") == 0) {
+                fetch_view(session, selector, page_size);
+        }
+        else {
+                subscribe_view(session, selector);
+        }
+
+        // Wait for every topic to be in the view.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout;
+
+        pthread_mutex_lock(&g_run.lock);
+        while(g_run.view_size < g_run.expected && !g_run.complete) {
+                if(pthread_cond_timedwait(&g_run.cond, &g_run.lock, &deadline) != 0) {
+                        break;
+                }
+        }
+        const long view_size = g_run.view_size;
+        const size_t value_bytes = g_run.value_bytes;
+        pthread_mutex_unlock(&g_run.lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const long high_water = memory_sampler_stop(&sampler);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("%8ld  %5d  %-9s  %8ld  %9.3f  %10.0f  %10.1f  %10zu\n",
+               count, depth, name, view_size, seconds,
+               seconds > 0 ? view_size / seconds : 0.0,
+               high_water / (1024.0 * 1024.0),
+               value_bytes);
+
+        session_close(session, NULL);
+        session_free(session);
+
+        pthread_mutex_lock(&g_run.lock);
+        hash_free(g_run.view, NULL, free);
+        g_run.view = NULL;
+        pthread_mutex_unlock(&g_run.lock);
+
+        return view_size == count;
+}
+
+
+/*
+ * Runs one strategy in a child process by executing this program again
+ * with --run, returning false if the view was not complete.
+ */
+static bool run_in_process(const char *strategy, HASH_T *options, long count, int depth)
+{
+        char size_arg[32];
+        char depth_arg[32];
+        snprintf(size_arg, sizeof(size_arg), "%ld", count);
+        snprintf(depth_arg, sizeof(depth_arg), "%d", depth);
+
+        const char *passed[] = { "url", "principal", "credentials", "topic", "page_size", "value_size", "timeout" };
+        const char *flags[] = { "-u", "-p", "-c", "-t", "-s", "-v", "-w" };
+
+        char *args[32];
+        int arg_count = 0;
+        args[arg_count++] = "fetch-vs-subscribe";
+        for(int i = 0; i < sizeof(passed) / sizeof(passed[0]); i++) {
+                char *value = hash_get(options, passed[i]);
+                if(value != NULL) {
+                        args[arg_count++] = (char *)flags[i];
+                        args[arg_count++] = value;
+                }
+        }
+        args[arg_count++] = "-n";
+        args[arg_count++] = size_arg;
+        args[arg_count++] = "-d";
+        args[arg_count++] = depth_arg;
+        args[arg_count++] = "-r";
+        args[arg_count++] = (char *)strategy;
+        args[arg_count] = NULL;
+
+        // The child shares stdout; don't let it repeat buffered output.
+        fflush(stdout);
+
+        const pid_t pid = fork();
+        if(pid < 0) {
+                perror("fork");
+                return false;
+        }
+        if(pid == 0) {
+                execv("/proc/self/exe", args);
+                _exit(127);
+        }
+
+        int status;
+        if(waitpid(pid, &status, 0) != pid) {
+                perror("waitpid");
+                return false;
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+
+// Parse a comma separated list of positive numbers.
+static int parse_list(const char *list, long *values, int max)
+{
+        int count = 0;
+        char *copy = strdup(list);
+        for(char *token = strtok(copy, ","); token != NULL && count < max; token = strtok(NULL, ",")) {
+                const long value = atol(token);
+                if(value > 0) {
+                        values[count++] = value;
+                }
+        }
+        free(copy);
+        return count;
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *root = hash_get(options, "topic");
+        const int page_size = atoi(hash_get(options, "page_size"));
+        const int value_size = atoi(hash_get(options, "value_size"));
+        const int timeout = atoi(hash_get(options, "timeout"));
+        const char *run = hash_get(options, "run");
+
+        long sizes[32];
+        long depths[32];
+        const int size_count = parse_list(hash_get(options, "sizes"), sizes, 32);
+        const int depth_count = parse_list(hash_get(options, "depths"), depths, 32);
+        if(size_count == 0 || depth_count == 0 || page_size < 1 || value_size < 0 ||
+           (run != NULL && strcmp(run, "fetch") != 0 && strcmp(run, "subscribe") != 0)) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // In a child process, run the one strategy and report whether
+        // the view was complete.
+        if(run != NULL) {
+                char selector[256];
+                snprintf(selector, sizeof(selector), "?%s//", root);
+
+                const bool complete = run_strategy(run, url, principal, credentials, selector,
+                                                   sizes[0], (int)depths[0], page_size, timeout);
+
+                free(g_run.last_path);
+                credentials_free(credentials);
+                hash_free(options, NULL, free);
+                return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        // Create a session with the Diffusion server to manage the topics.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        char selector[256];
+        snprintf(selector, sizeof(selector), "?%s//", root);
+
+        printf("%8s  %5s  %-9s  %8s  %9s  %10s  %10s  %10s\n",
+               "topics", "depth", "strategy", "received", "seconds", "topics/sec", "peak MB", "bytes");
+
+        for(int s = 0; s < size_count; s++) {
+                for(int d = 0; d < depth_count; d++) {
+                        g_run.failed = 0;
+                        create_tree(session, root, sizes[s], (int)depths[d], value_size);
+                        if(g_run.failed > 0) {
+                                printf("Failed to create %ld of %ld topics\n", g_run.failed, sizes[s]);
+                        }
+
+                        run_in_process("fetch", options, sizes[s], (int)depths[d]);
+                        run_in_process("subscribe", options, sizes[s], (int)depths[d]);
+
+                        remove_tree(session, selector);
+                }
+        }
+
+        free(g_run.last_path);
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return EXIT_SUCCESS;
+}
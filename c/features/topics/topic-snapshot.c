@@ -0,0 +1,984 @@
+/**
+ * Copyright © 2022 Push Technology Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This example is written in C99. Please use an appropriate C99 capable compiler
+ *
+ * @author Push Technology Limited
+ * @since 6.9
+ */
+
+/*
+ * This example saves the state of a topic tree to a compact binary
+ * snapshot file, and restores topics from one.
+ *
+ * In export mode, the topics matching a selector are fetched with their
+ * values and specification properties a page at a time and written to
+ * the file. Each page is limited to --max_result_size bytes as well as
+ * --page_size topics, so that large values don't make the server reject
+ * it. In import mode, the file is mapped into memory and every topic in
+ * it is created (or updated) with its saved properties and value,
+ * keeping a window of updates in flight.
+ * Lookup mode finds a single path in the file without reading the rest.
+ *
+ * The file is little-endian and laid out so that it can be used directly
+ * from a memory mapping:
+ *
+ *   header     "DIFFSNP1", uint32 version, uint32 entry count,
+ *              uint64 path table offset, uint64 value offset,
+ *              uint64 properties offset
+ *   index      one 32 byte entry per topic, sorted by path:
+ *              uint64 value offset, uint32 path offset, uint32 value length,
+ *              uint16 path length, uint8 topic type, 1 byte reserved,
+ *              uint32 properties length, uint64 properties offset
+ *   paths      the topic paths, each followed by a NUL
+ *   properties the specification properties of each topic, as NUL
+ *              terminated key and value strings, sorted by key
+ *   values     the serialised topic values
+ *
+ * Offsets in index entries are relative to the start of their section.
+ * Only topics of the JSON, string, int64, double, binary and RecordV2
+ * types, and time series topics with one of these event types, are
+ * saved. A time series topic is restored with its latest value as its
+ * only event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "diffusion.h"
+#include "args.h"
+#include "conversation.h"
+
+#define SNAPSHOT_MAGIC "DIFFSNP1"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_HEADER_SIZE 40
+#define SNAPSHOT_ENTRY_SIZE 32
+
+
+ARG_OPTS_T arg_opts[] = {
+        ARG_OPTS_HELP,
+        {'u', "url", "Diffusion server URL", ARG_OPTIONAL, ARG_HAS_VALUE, "ws://localhost:8080"},
+        {'p', "principal", "Principal (username) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "control"},
+        {'c', "credentials", "Credentials (password) for the connection", ARG_OPTIONAL, ARG_HAS_VALUE, "password"},
+        {'m', "mode", "export, import or lookup", ARG_OPTIONAL, ARG_HAS_VALUE, "export"},
+        {'f', "file", "Snapshot file", ARG_OPTIONAL, ARG_HAS_VALUE, "topics.snapshot"},
+        {'s', "selector", "Selector for the topics to export", ARG_OPTIONAL, ARG_HAS_VALUE, "?.*//"},
+        {'l', "lookup", "Topic path to find in lookup mode", ARG_OPTIONAL, ARG_HAS_VALUE, NULL},
+        {'n', "page_size", "Maximum number of topics fetched in each page when exporting", ARG_OPTIONAL, ARG_HAS_VALUE, "5000"},
+        {'x', "max_result_size", "Maximum size in bytes of each page fetched when exporting", ARG_OPTIONAL, ARG_HAS_VALUE, "8388608"},
+        {'w', "window", "Maximum number of updates in flight when importing", ARG_OPTIONAL, ARG_HAS_VALUE, "1000"},
+        END_OF_ARG_OPTS
+};
+
+
+/*
+ * The time series event value types that can be saved.
+ */
+static bool event_value_type_datatype(const char *event_value_type, DIFFUSION_DATATYPE *datatype)
+{
+        static const struct {
+                const char *name;
+                DIFFUSION_DATATYPE datatype;
+        } value_types[] = {
+                { "json", DATATYPE_JSON },
+                { "string", DATATYPE_STRING },
+                { "int64", DATATYPE_INT64 },
+                { "double", DATATYPE_DOUBLE },
+                { "binary", DATATYPE_BINARY },
+                { "record_v2", DATATYPE_RECORDV2 }
+        };
+
+        if(event_value_type == NULL) {
+                return false;
+        }
+        for(size_t i = 0; i < sizeof(value_types) / sizeof(value_types[0]); i++) {
+                if(strcmp(event_value_type, value_types[i].name) == 0) {
+                        *datatype = value_types[i].datatype;
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+/*
+ * The topic types that can be saved, with the datatype used to restore
+ * their values. A time series topic is restored with the datatype of its
+ * event value type.
+ */
+static bool topic_type_datatype(TOPIC_TYPE_T topic_type, const char *event_value_type, DIFFUSION_DATATYPE *datatype)
+{
+        switch(topic_type) {
+        case TOPIC_TYPE_TIME_SERIES:
+                return event_value_type_datatype(event_value_type, datatype);
+        case TOPIC_TYPE_JSON:
+                *datatype = DATATYPE_JSON;
+                return true;
+        case TOPIC_TYPE_STRING:
+                *datatype = DATATYPE_STRING;
+                return true;
+        case TOPIC_TYPE_INT64:
+                *datatype = DATATYPE_INT64;
+                return true;
+        case TOPIC_TYPE_DOUBLE:
+                *datatype = DATATYPE_DOUBLE;
+                return true;
+        case TOPIC_TYPE_BINARY:
+                *datatype = DATATYPE_BINARY;
+                return true;
+        case TOPIC_TYPE_RECORDV2:
+                *datatype = DATATYPE_RECORDV2;
+                return true;
+        default:
+                return false;
+        }
+}
+
+
+static uint64_t read_le(const unsigned char *p, int bytes)
+{
+        uint64_t value = 0;
+        for(int i = bytes - 1; i >= 0; i--) {
+                value = (value << 8) | p[i];
+        }
+        return value;
+}
+
+
+static void write_le(unsigned char *p, uint64_t value, int bytes)
+{
+        for(int i = 0; i < bytes; i++) {
+                p[i] = value & 0xff;
+                value >>= 8;
+        }
+}
+
+
+/*
+ * Specification properties are stored as NUL terminated key and value
+ * strings, one pair after another.
+ */
+static int compare_keys(const void *a, const void *b)
+{
+        return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+// Serialise properties with their keys in order, so that equal sets of
+// properties have equal bytes.
+static char *encode_properties(const HASH_T *properties, size_t *length)
+{
+        *length = 0;
+        if(properties == NULL) {
+                return NULL;
+        }
+
+        char **keys = hash_keys(properties);
+        size_t count = 0;
+        for(char **k = keys; *k != NULL; k++) {
+                const char *value = hash_get(properties, *k);
+                *length += strlen(*k) + 1 + (value != NULL ? strlen(value) : 0) + 1;
+                count++;
+        }
+        qsort(keys, count, sizeof(char *), compare_keys);
+
+        char *encoded = NULL;
+        if(*length > 0) {
+                encoded = malloc(*length);
+                char *p = encoded;
+                for(size_t i = 0; i < count; i++) {
+                        const char *value = hash_get(properties, keys[i]);
+                        p += sprintf(p, "%s", keys[i]) + 1;
+                        p += sprintf(p, "%s", value != NULL ? value : "") + 1;
+                }
+        }
+        free(keys);
+        return encoded;
+}
+
+
+// Whether a block of properties is a whole number of key and value pairs.
+static bool properties_valid(const char *properties, uint32_t length)
+{
+        if(length == 0) {
+                return true;
+        }
+        if(properties[length - 1] != '\0') {
+                return false;
+        }
+        uint32_t strings = 0;
+        for(uint32_t i = 0; i < length; i++) {
+                strings += properties[i] == '\0';
+        }
+        return strings % 2 == 0;
+}
+
+
+static const char *properties_find(const char *properties, uint32_t length, const char *key)
+{
+        const char *end = properties + length;
+        for(const char *p = properties; p < end; ) {
+                const char *value = p + strlen(p) + 1;
+                if(strcmp(p, key) == 0) {
+                        return value;
+                }
+                p = value + strlen(value) + 1;
+        }
+        return NULL;
+}
+
+
+/*
+ * Export.
+ */
+typedef struct snapshot_entry_s {
+        char *path;
+        TOPIC_TYPE_T topic_type;
+        char *properties;
+        size_t properties_length;
+        char *value;
+        size_t value_length;
+} SNAPSHOT_ENTRY_T;
+
+
+typedef struct export_s {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool done;
+        bool failed;
+        bool has_more;
+
+        char *last_path;
+
+        SNAPSHOT_ENTRY_T *entries;
+        long entry_count;
+        long entry_capacity;
+        long skipped;
+        size_t path_bytes;
+        size_t properties_bytes;
+        size_t value_bytes;
+} EXPORT_T;
+
+
+static void export_page_complete(EXPORT_T *export, bool failed)
+{
+        pthread_mutex_lock(&export->lock);
+        export->done = true;
+        export->failed = failed;
+        pthread_cond_signal(&export->cond);
+        pthread_mutex_unlock(&export->lock);
+}
+
+
+static int on_export_page(const DIFFUSION_FETCH_RESULT_T *fetch_result, void *context)
+{
+        EXPORT_T *export = context;
+
+        LIST_T *results = diffusion_fetch_result_get_topic_results(fetch_result);
+        const int size = list_get_size(results);
+
+        for(int i = 0; i < size; i++) {
+                DIFFUSION_TOPIC_RESULT_T *topic_result = list_get_data_indexed(results, i);
+                char *path = diffusion_topic_result_get_path(topic_result);
+
+                // The next page starts after the last path of this one.
+                if(i == size - 1) {
+                        free(export->last_path);
+                        export->last_path = strdup(path);
+                }
+
+                DIFFUSION_DATATYPE datatype;
+                const TOPIC_TYPE_T topic_type = diffusion_topic_result_get_topic_type(topic_result);
+                DIFFUSION_VALUE_T *value = diffusion_topic_result_get_value(topic_result);
+                TOPIC_SPECIFICATION_T *specification = diffusion_topic_result_get_specification(topic_result);
+                HASH_T *properties = specification != NULL ? topic_specification_get_properties(specification) : NULL;
+                const char *event_value_type = properties != NULL
+                        ? hash_get(properties, DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE)
+                        : NULL;
+
+                SNAPSHOT_ENTRY_T entry = {
+                        .path = path,
+                        .topic_type = topic_type
+                };
+                const bool saved = strlen(path) <= UINT16_MAX
+                        && topic_type_datatype(topic_type, event_value_type, &datatype)
+                        && value != NULL
+                        && diffusion_value_get_raw_bytes(value, &entry.value, &entry.value_length);
+                if(saved) {
+                        entry.properties = encode_properties(properties, &entry.properties_length);
+                }
+
+                if(properties != NULL) {
+                        hash_free(properties, free, free);
+                }
+                if(specification != NULL) {
+                        topic_specification_free(specification);
+                }
+                if(value != NULL) {
+                        diffusion_value_free(value);
+                }
+
+                if(!saved || entry.value_length > UINT32_MAX || entry.properties_length > UINT32_MAX) {
+                        export->skipped++;
+                        free(entry.properties);
+                        free(entry.value);
+                        free(path);
+                        continue;
+                }
+
+                if(export->entry_count == export->entry_capacity) {
+                        export->entry_capacity = export->entry_capacity * 2 + 1024;
+                        export->entries = realloc(export->entries, export->entry_capacity * sizeof(SNAPSHOT_ENTRY_T));
+                }
+                export->entries[export->entry_count++] = entry;
+                export->path_bytes += strlen(path) + 1;
+                export->properties_bytes += entry.properties_length;
+                export->value_bytes += entry.value_length;
+        }
+
+        export->has_more = diffusion_fetch_result_has_more(fetch_result);
+
+        list_free(results, (void (*)(void *))diffusion_topic_result_free);
+        export_page_complete(export, false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_export_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        printf("Fetch failed: %s\n", error->message);
+        export_page_complete(error->context, true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_export_discard(SESSION_T *session, void *context)
+{
+        export_page_complete(context, true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int compare_entries(const void *a, const void *b)
+{
+        return strcmp(((const SNAPSHOT_ENTRY_T *)a)->path, ((const SNAPSHOT_ENTRY_T *)b)->path);
+}
+
+
+// Fetch every page of the selector into memory.
+static bool fetch_entries(
+        SESSION_T *session,
+        const char *selector,
+        int page_size,
+        uint32_t max_result_size,
+        EXPORT_T *export)
+{
+        do {
+                DIFFUSION_FETCH_REQUEST_T *fetch_request = diffusion_fetch_request_init(session);
+                diffusion_fetch_request_with_values(fetch_request, NULL, NULL);
+                diffusion_fetch_request_with_properties(fetch_request, NULL);
+                diffusion_fetch_request_maximum_result_size(fetch_request, max_result_size, NULL);
+                diffusion_fetch_request_first(fetch_request, page_size, NULL);
+                if(export->last_path != NULL) {
+                        diffusion_fetch_request_after(fetch_request, export->last_path, NULL);
+                }
+
+                DIFFUSION_FETCH_REQUEST_PARAMS_T params = {
+                        .topic_selector = selector,
+                        .fetch_request = fetch_request,
+                        .on_fetch_result = on_export_page,
+                        .on_error = on_export_error,
+                        .on_discard = on_export_discard,
+                        .context = export
+                };
+
+                pthread_mutex_lock(&export->lock);
+                export->done = false;
+                export->has_more = false;
+                pthread_mutex_unlock(&export->lock);
+
+                diffusion_fetch_request_fetch(session, params);
+
+                pthread_mutex_lock(&export->lock);
+                while(!export->done) {
+                        pthread_cond_wait(&export->cond, &export->lock);
+                }
+                pthread_mutex_unlock(&export->lock);
+
+                diffusion_fetch_request_free(fetch_request);
+        } while(!export->failed && export->has_more);
+
+        return !export->failed;
+}
+
+
+// Write the sorted entries out in the snapshot format.
+static bool write_snapshot(const char *file_name, EXPORT_T *export)
+{
+        if(export->path_bytes > UINT32_MAX) {
+                fprintf(stderr, "Too many topic paths for one snapshot\n");
+                return false;
+        }
+
+        FILE *file = fopen(file_name, "wb");
+        if(file == NULL) {
+                fprintf(stderr, "Unable to create \"%s\"\n", file_name);
+                return false;
+        }
+
+        const uint64_t path_table_offset = SNAPSHOT_HEADER_SIZE + (uint64_t)export->entry_count * SNAPSHOT_ENTRY_SIZE;
+        const uint64_t properties_offset = path_table_offset + export->path_bytes;
+        const uint64_t value_offset = properties_offset + export->properties_bytes;
+
+        unsigned char header[SNAPSHOT_HEADER_SIZE] = { 0 };
+        memcpy(header, SNAPSHOT_MAGIC, 8);
+        write_le(header + 8, SNAPSHOT_VERSION, 4);
+        write_le(header + 12, export->entry_count, 4);
+        write_le(header + 16, path_table_offset, 8);
+        write_le(header + 24, value_offset, 8);
+        write_le(header + 32, properties_offset, 8);
+        bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+        uint32_t path_position = 0;
+        uint64_t properties_position = 0;
+        uint64_t value_position = 0;
+        for(long i = 0; ok && i < export->entry_count; i++) {
+                const SNAPSHOT_ENTRY_T *entry = &export->entries[i];
+                const size_t path_length = strlen(entry->path);
+
+                unsigned char index_entry[SNAPSHOT_ENTRY_SIZE] = { 0 };
+                write_le(index_entry, value_position, 8);
+                write_le(index_entry + 8, path_position, 4);
+                write_le(index_entry + 12, entry->value_length, 4);
+                write_le(index_entry + 16, path_length, 2);
+                index_entry[18] = (unsigned char)entry->topic_type;
+                write_le(index_entry + 20, entry->properties_length, 4);
+                write_le(index_entry + 24, properties_position, 8);
+                ok = fwrite(index_entry, sizeof(index_entry), 1, file) == 1;
+
+                path_position += path_length + 1;
+                properties_position += entry->properties_length;
+                value_position += entry->value_length;
+        }
+
+        for(long i = 0; ok && i < export->entry_count; i++) {
+                const char *path = export->entries[i].path;
+                ok = fwrite(path, strlen(path) + 1, 1, file) == 1;
+        }
+
+        for(long i = 0; ok && i < export->entry_count; i++) {
+                const SNAPSHOT_ENTRY_T *entry = &export->entries[i];
+                ok = entry->properties_length == 0 || fwrite(entry->properties, entry->properties_length, 1, file) == 1;
+        }
+
+        for(long i = 0; ok && i < export->entry_count; i++) {
+                const SNAPSHOT_ENTRY_T *entry = &export->entries[i];
+                ok = entry->value_length == 0 || fwrite(entry->value, entry->value_length, 1, file) == 1;
+        }
+
+        if(fclose(file) != 0 || !ok) {
+                fprintf(stderr, "Failed to write \"%s\"\n", file_name);
+                return false;
+        }
+        return true;
+}
+
+
+static bool export_snapshot(
+        SESSION_T *session,
+        const char *file_name,
+        const char *selector,
+        int page_size,
+        uint32_t max_result_size)
+{
+        EXPORT_T export = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER
+        };
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        bool ok = fetch_entries(session, selector, page_size, max_result_size, &export);
+        if(ok) {
+                // Pages arrive in path order, but the index must be sorted.
+                qsort(export.entries, export.entry_count, sizeof(SNAPSHOT_ENTRY_T), compare_entries);
+                ok = write_snapshot(file_name, &export);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if(ok) {
+                printf("Exported %ld topics (%zu value bytes) to \"%s\" in %.3f s, %ld skipped\n",
+                       export.entry_count, export.value_bytes, file_name, seconds, export.skipped);
+        }
+
+        for(long i = 0; i < export.entry_count; i++) {
+                free(export.entries[i].path);
+                free(export.entries[i].properties);
+                free(export.entries[i].value);
+        }
+        free(export.entries);
+        free(export.last_path);
+        return ok;
+}
+
+
+/*
+ * Reading a mapped snapshot.
+ */
+typedef struct snapshot_s {
+        const unsigned char *data;
+        size_t size;
+        uint32_t entry_count;
+        const unsigned char *index;
+        const char *paths;
+        const char *properties;
+        const unsigned char *values;
+} SNAPSHOT_T;
+
+
+typedef struct snapshot_view_s {
+        const char *path;
+        TOPIC_TYPE_T topic_type;
+        const char *properties;
+        uint32_t properties_length;
+        const unsigned char *value;
+        uint32_t value_length;
+} SNAPSHOT_VIEW_T;
+
+
+// Check the header and that every section lies within the file.
+static bool snapshot_open(SNAPSHOT_T *snapshot, const unsigned char *data, size_t size)
+{
+        if(size < SNAPSHOT_HEADER_SIZE || memcmp(data, SNAPSHOT_MAGIC, 8) != 0
+           || read_le(data + 8, 4) != SNAPSHOT_VERSION) {
+                return false;
+        }
+
+        const uint64_t entry_count = read_le(data + 12, 4);
+        const uint64_t path_table_offset = read_le(data + 16, 8);
+        const uint64_t value_offset = read_le(data + 24, 8);
+        const uint64_t properties_offset = read_le(data + 32, 8);
+        if(path_table_offset != SNAPSHOT_HEADER_SIZE + entry_count * SNAPSHOT_ENTRY_SIZE
+           || properties_offset < path_table_offset || value_offset < properties_offset || value_offset > size) {
+                return false;
+        }
+
+        snapshot->data = data;
+        snapshot->size = size;
+        snapshot->entry_count = (uint32_t)entry_count;
+        snapshot->index = data + SNAPSHOT_HEADER_SIZE;
+        snapshot->paths = (const char *)data + path_table_offset;
+        snapshot->properties = (const char *)data + properties_offset;
+        snapshot->values = data + value_offset;
+        return true;
+}
+
+
+static bool snapshot_get(const SNAPSHOT_T *snapshot, uint32_t i, SNAPSHOT_VIEW_T *view)
+{
+        const unsigned char *entry = snapshot->index + (size_t)i * SNAPSHOT_ENTRY_SIZE;
+        const uint64_t value_position = read_le(entry, 8);
+        const uint64_t path_position = read_le(entry + 8, 4);
+        const uint32_t value_length = (uint32_t)read_le(entry + 12, 4);
+        const uint64_t path_length = read_le(entry + 16, 2);
+        const uint32_t properties_length = (uint32_t)read_le(entry + 20, 4);
+        const uint64_t properties_position = read_le(entry + 24, 8);
+
+        const size_t path_limit = snapshot->properties - snapshot->paths;
+        const size_t properties_limit = (const char *)snapshot->values - snapshot->properties;
+        const size_t value_limit = snapshot->data + snapshot->size - snapshot->values;
+        if(path_position + path_length >= path_limit || snapshot->paths[path_position + path_length] != '\0'
+           || properties_position > properties_limit || properties_length > properties_limit - properties_position
+           || !properties_valid(snapshot->properties + properties_position, properties_length)
+           || value_position + value_length > value_limit) {
+                return false;
+        }
+
+        view->path = snapshot->paths + path_position;
+        view->topic_type = entry[18];
+        view->properties = snapshot->properties + properties_position;
+        view->properties_length = properties_length;
+        view->value = snapshot->values + value_position;
+        view->value_length = value_length;
+        return true;
+}
+
+
+// Binary search of the sorted index.
+static bool snapshot_find(const SNAPSHOT_T *snapshot, const char *path, SNAPSHOT_VIEW_T *view)
+{
+        uint32_t low = 0;
+        uint32_t high = snapshot->entry_count;
+        while(low < high) {
+                const uint32_t mid = low + (high - low) / 2;
+                if(!snapshot_get(snapshot, mid, view)) {
+                        return false;
+                }
+                const int comparison = strcmp(view->path, path);
+                if(comparison == 0) {
+                        return true;
+                }
+                if(comparison < 0) {
+                        low = mid + 1;
+                }
+                else {
+                        high = mid;
+                }
+        }
+        return false;
+}
+
+
+/*
+ * Import.
+ */
+static pthread_mutex_t g_import_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_import_cond = PTHREAD_COND_INITIALIZER;
+static long g_in_flight;
+static long g_restored;
+static long g_failed;
+
+
+static void import_complete(bool failed)
+{
+        pthread_mutex_lock(&g_import_lock);
+        g_in_flight--;
+        if(failed) {
+                g_failed++;
+        }
+        else {
+                g_restored++;
+        }
+        pthread_cond_signal(&g_import_cond);
+        pthread_mutex_unlock(&g_import_lock);
+}
+
+
+static int on_topic_restored(DIFFUSION_TOPIC_CREATION_RESULT_T result, void *context)
+{
+        import_complete(false);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_restore_error(SESSION_T *session, const DIFFUSION_ERROR_T *error)
+{
+        if(g_failed == 0) {
+                printf("Failed to restore a topic: %s\n", error->message);
+        }
+        import_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+static int on_restore_discard(SESSION_T *session, void *context)
+{
+        import_complete(true);
+        return HANDLER_SUCCESS;
+}
+
+
+/*
+ * The specifications used by an import, one for each distinct topic type
+ * and set of properties, in an open addressed table keyed by a hash of
+ * the type and the saved properties.
+ */
+typedef struct import_specification_s {
+        TOPIC_SPECIFICATION_T *specification;
+        TOPIC_TYPE_T topic_type;
+        const char *properties;
+        uint32_t properties_length;
+        uint32_t hash;
+} IMPORT_SPECIFICATION_T;
+
+
+typedef struct specification_table_s {
+        IMPORT_SPECIFICATION_T *slots;
+        size_t size;
+        size_t count;
+} SPECIFICATION_TABLE_T;
+
+
+static uint32_t hash_specification(TOPIC_TYPE_T topic_type, const char *properties, uint32_t length)
+{
+        uint32_t hash = (2166136261u ^ (uint32_t)topic_type) * 16777619u;
+        for(uint32_t i = 0; i < length; i++) {
+                hash ^= (unsigned char)properties[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+
+static void specification_table_grow(SPECIFICATION_TABLE_T *table)
+{
+        const size_t size = table->size == 0 ? 64 : table->size * 2;
+        IMPORT_SPECIFICATION_T *slots = calloc(size, sizeof(IMPORT_SPECIFICATION_T));
+        for(size_t i = 0; i < table->size; i++) {
+                if(table->slots[i].specification != NULL) {
+                        size_t j = table->slots[i].hash & (size - 1);
+                        while(slots[j].specification != NULL) {
+                                j = (j + 1) & (size - 1);
+                        }
+                        slots[j] = table->slots[i];
+                }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->size = size;
+}
+
+
+// The specification for a saved topic, created on first use.
+static TOPIC_SPECIFICATION_T *specification_for(SPECIFICATION_TABLE_T *table, const SNAPSHOT_VIEW_T *view)
+{
+        if((table->count + 1) * 2 > table->size) {
+                specification_table_grow(table);
+        }
+
+        const uint32_t hash = hash_specification(view->topic_type, view->properties, view->properties_length);
+        size_t i = hash & (table->size - 1);
+        for(; table->slots[i].specification != NULL; i = (i + 1) & (table->size - 1)) {
+                const IMPORT_SPECIFICATION_T *slot = &table->slots[i];
+                if(slot->hash == hash && slot->topic_type == view->topic_type
+                   && slot->properties_length == view->properties_length
+                   && memcmp(slot->properties, view->properties, view->properties_length) == 0) {
+                        return slot->specification;
+                }
+        }
+
+        // The properties are read in place from the mapped snapshot.
+        HASH_T *properties = hash_new(16);
+        const char *end = view->properties + view->properties_length;
+        for(const char *p = view->properties; p < end; ) {
+                const char *value = p + strlen(p) + 1;
+                hash_add(properties, p, value);
+                p = value + strlen(value) + 1;
+        }
+
+        IMPORT_SPECIFICATION_T *slot = &table->slots[i];
+        slot->specification = topic_specification_init_with_properties(view->topic_type, properties);
+        slot->topic_type = view->topic_type;
+        slot->properties = view->properties;
+        slot->properties_length = view->properties_length;
+        slot->hash = hash;
+        table->count++;
+
+        hash_free(properties, NULL, NULL);
+        return slot->specification;
+}
+
+
+static void specification_table_free(SPECIFICATION_TABLE_T *table)
+{
+        for(size_t i = 0; i < table->size; i++) {
+                if(table->slots[i].specification != NULL) {
+                        topic_specification_free(table->slots[i].specification);
+                }
+        }
+        free(table->slots);
+}
+
+
+static bool import_snapshot(SESSION_T *session, const SNAPSHOT_T *snapshot, long window)
+{
+        SPECIFICATION_TABLE_T specifications = { 0 };
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        long invalid = 0;
+        for(uint32_t i = 0; i < snapshot->entry_count; i++) {
+                SNAPSHOT_VIEW_T view;
+                DIFFUSION_DATATYPE datatype;
+                if(!snapshot_get(snapshot, i, &view)) {
+                        invalid++;
+                        continue;
+                }
+                const char *event_value_type = properties_find(view.properties, view.properties_length,
+                                                               DIFFUSION_TIME_SERIES_EVENT_VALUE_TYPE);
+                if(!topic_type_datatype(view.topic_type, event_value_type, &datatype)) {
+                        invalid++;
+                        continue;
+                }
+                TOPIC_SPECIFICATION_T *specification = specification_for(&specifications, &view);
+
+                pthread_mutex_lock(&g_import_lock);
+                while(g_in_flight >= window) {
+                        pthread_cond_wait(&g_import_cond, &g_import_lock);
+                }
+                g_in_flight++;
+                pthread_mutex_unlock(&g_import_lock);
+
+                // The saved value is already serialised for its datatype.
+                BUF_T *update_buf = buf_create();
+                buf_write_bytes(update_buf, view.value, view.value_length);
+
+                DIFFUSION_TOPIC_UPDATE_ADD_AND_SET_PARAMS_T params = {
+                        .topic_path = view.path,
+                        .specification = specification,
+                        .datatype = datatype,
+                        .update = update_buf,
+                        .on_topic_update_add_and_set = on_topic_restored,
+                        .on_error = on_restore_error,
+                        .on_discard = on_restore_discard
+                };
+                diffusion_topic_update_add_and_set(session, params);
+                buf_free(update_buf);
+        }
+
+        pthread_mutex_lock(&g_import_lock);
+        while(g_in_flight > 0) {
+                pthread_cond_wait(&g_import_cond, &g_import_lock);
+        }
+        pthread_mutex_unlock(&g_import_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("Restored %ld topics in %.3f s (%.0f topics/sec), %ld failed, %ld invalid entries\n",
+               g_restored, seconds, seconds > 0 ? g_restored / seconds : 0.0, g_failed, invalid);
+
+        specification_table_free(&specifications);
+        return g_failed == 0 && invalid == 0;
+}
+
+
+// Program entry point.
+int main(int argc, char** argv)
+{
+        // Standard command-line parsing.
+        HASH_T *options = parse_cmdline(argc, argv, arg_opts);
+        if(options == NULL || hash_get(options, "help") != NULL) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+
+        const char *url = hash_get(options, "url");
+        const char *principal = hash_get(options, "principal");
+        const char *password = hash_get(options, "credentials");
+        const char *mode = hash_get(options, "mode");
+        const char *file_name = hash_get(options, "file");
+        const char *selector = hash_get(options, "selector");
+        const char *lookup = hash_get(options, "lookup");
+        const int page_size = atoi(hash_get(options, "page_size"));
+        const long window = atol(hash_get(options, "window"));
+        const long long max_result_size = atoll(hash_get(options, "max_result_size"));
+
+        const bool exporting = strcmp(mode, "export") == 0;
+        const bool importing = strcmp(mode, "import") == 0;
+        if(!exporting && !importing && (strcmp(mode, "lookup") != 0 || lookup == NULL)) {
+                show_usage(argc, argv, arg_opts);
+                return EXIT_FAILURE;
+        }
+        if(page_size < 1 || window < 1) {
+                fprintf(stderr, "page_size and window must both be at least 1\n");
+                return EXIT_FAILURE;
+        }
+        if(max_result_size < 1024 || max_result_size > UINT32_MAX) {
+                fprintf(stderr, "max_result_size must be between 1024 and %" PRIu32 "\n", UINT32_MAX);
+                return EXIT_FAILURE;
+        }
+
+        /*
+         * Map the snapshot into memory, unless we're writing one.
+         */
+        const unsigned char *data = NULL;
+        size_t size = 0;
+        SNAPSHOT_T snapshot = { 0 };
+        if(!exporting) {
+                int fd = open(file_name, O_RDONLY);
+                struct stat file_stat;
+                if(fd < 0 || fstat(fd, &file_stat) != 0) {
+                        fprintf(stderr, "Unable to open \"%s\"\n", file_name);
+                        return EXIT_FAILURE;
+                }
+                size = file_stat.st_size;
+                if(size > 0) {
+                        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if(data == MAP_FAILED) {
+                                fprintf(stderr, "Unable to map \"%s\"\n", file_name);
+                                return EXIT_FAILURE;
+                        }
+                }
+                close(fd);
+
+                if(!snapshot_open(&snapshot, data, size)) {
+                        fprintf(stderr, "\"%s\" is not a valid snapshot\n", file_name);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if(!exporting && !importing) {
+                SNAPSHOT_VIEW_T view;
+                const bool found = snapshot_find(&snapshot, lookup, &view);
+                if(found) {
+                        printf("%s: topic type %d, %u value bytes\n", view.path, view.topic_type, view.value_length);
+                        const char *end = view.properties + view.properties_length;
+                        for(const char *p = view.properties; p < end; ) {
+                                const char *value = p + strlen(p) + 1;
+                                printf("        %s=%s\n", p, value);
+                                p = value + strlen(value) + 1;
+                        }
+                }
+                else {
+                        printf("%s: not in snapshot\n", lookup);
+                }
+                munmap((void *)data, size);
+                hash_free(options, NULL, free);
+                return found ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        CREDENTIALS_T *credentials = NULL;
+        if(password != NULL) {
+                credentials = credentials_create_password(password);
+        }
+
+        // Create a session with the Diffusion server.
+        SESSION_T *session;
+        DIFFUSION_ERROR_T error = { 0 };
+        session = session_create(url, principal, credentials, NULL, NULL, &error);
+        if(session == NULL) {
+                fprintf(stderr, "TEST: Failed to create session\n");
+                fprintf(stderr, "ERR : %s\n", error.message);
+                return EXIT_FAILURE;
+        }
+
+        const bool ok = exporting
+                ? export_snapshot(session, file_name, selector, page_size, (uint32_t)max_result_size)
+                : import_snapshot(session, &snapshot, window);
+
+        // Close session and free resources.
+        session_close(session, NULL);
+        session_free(session);
+
+        if(data != NULL) {
+                munmap((void *)data, size);
+        }
+        credentials_free(credentials);
+        hash_free(options, NULL, free);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}